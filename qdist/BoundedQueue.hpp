@@ -0,0 +1,82 @@
+#ifndef BOUNDED_QUEUE_H
+#define BOUNDED_QUEUE_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+/*
+ * A bounded lock-free queue between one producer thread and one consumer thread, for the
+ * stages of a pipeline.
+ *
+ * The items live in a ring of capacity slots. The producer alone advances the tail and the
+ * consumer alone advances the head, so each end needs only an atomic store to publish its
+ * move and never takes a lock. Push waits while the queue is full, which holds back a
+ * faster stage before it runs ahead of a slower one, and Pop waits while it is empty. The
+ * waits first yield and then sleep for longer and longer, up to a millisecond, so a stage
+ * that waits on a long comparison does not keep a core busy.
+ */
+template<typename T>
+class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity)
+        : slots(std::max(capacity, size_t(1))),
+          head(0),
+          padding(),
+          tail(0)
+    {}
+
+    // Add an item, or return false at once if the queue is full. Producer only.
+    bool TryPush(const T &item) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) == slots.size())
+            return false;
+        slots[t % slots.size()] = item;
+        tail.store(t + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Take the oldest item, or return false at once if the queue is empty. Consumer only.
+    bool TryPop(T &item) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire))
+            return false;
+        item = slots[h % slots.size()];
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    void Push(const T &item) {
+        for (int rounds = 0; !TryPush(item); rounds++)
+            Wait(rounds);
+    }
+
+    T Pop() {
+        T item;
+        for (int rounds = 0; !TryPop(item); rounds++)
+            Wait(rounds);
+        return item;
+    }
+
+private:
+    BoundedQueue(const BoundedQueue &);
+    BoundedQueue &operator=(const BoundedQueue &);
+
+    static void Wait(int rounds) {
+        if (rounds < 64)
+            std::this_thread::yield();
+        else
+            std::this_thread::sleep_for(std::chrono::microseconds(std::min(1000, 10 << std::min(rounds - 64, 7))));
+    }
+
+    std::vector<T> slots;
+    //the number of items popped and pushed so far, a cache line apart so the two threads do
+    //not contend for one line
+    std::atomic<size_t> head;
+    char padding[64];
+    std::atomic<size_t> tail;
+};
+
+#endif
@@ -0,0 +1,106 @@
+#include "Checkpoint.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+
+static const char* MAGIC = "qdist-checkpoint 1";
+
+Checkpoint::Checkpoint(const std::string &filename, unsigned long fingerprint, int interval)
+    : filename(filename),
+      fingerprint(fingerprint),
+      interval(std::chrono::seconds(interval)),
+      lastSave(std::chrono::steady_clock::now()),
+      values(),
+      lines()
+{}
+
+bool Checkpoint::Load() {
+    std::ifstream in(filename.c_str());
+    if (!in)
+        return false;
+
+    std::string line;
+    if (!std::getline(in, line) || line != MAGIC) {
+        std::cerr << "Not a checkpoint file: " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::string keyword;
+    unsigned long saved = 0;
+    if (!(in >> keyword >> std::hex >> saved >> std::dec) || keyword != "fingerprint") {
+        std::cerr << "Checkpoint file without fingerprint: " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (saved != fingerprint) {
+        std::cerr << "Checkpoint " << filename << " was saved for different input" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    std::getline(in, line);
+
+    while (std::getline(in, line)) {
+        if (line.compare(0, 5, "line ") == 0) {
+            lines.push_back(line.substr(5));
+            continue;
+        }
+
+        std::istringstream fields(line);
+        std::string name;
+        if (!(fields >> keyword >> name) || keyword != "value") {
+            std::cerr << "Bad checkpoint line in " << filename << ": " << line << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        std::vector<long> &list = values[name];
+        list.clear();
+        long value;
+        while (fields >> value)
+            list.push_back(value);
+    }
+
+    return true;
+}
+
+long Checkpoint::Get(const std::string &name) const {
+    std::map<std::string, std::vector<long> >::const_iterator found = values.find(name);
+    return found == values.end() || found->second.empty() ? 0 : found->second[0];
+}
+
+std::vector<long> Checkpoint::GetList(const std::string &name) const {
+    std::map<std::string, std::vector<long> >::const_iterator found = values.find(name);
+    return found == values.end() ? std::vector<long>() : found->second;
+}
+
+void Checkpoint::Save() {
+    std::ostringstream state;
+    state << MAGIC << '\n' << "fingerprint " << std::hex << fingerprint << std::dec << '\n';
+    for (std::map<std::string, std::vector<long> >::const_iterator it = values.begin(); it != values.end(); ++it) {
+        state << "value " << it->first;
+        for (unsigned i = 0; i < it->second.size(); i++)
+            state << ' ' << it->second[i];
+        state << '\n';
+    }
+    for (unsigned i = 0; i < lines.size(); i++)
+        state << "line " << lines[i] << '\n';
+
+    //write the new state aside and move it into place only once it is on disk
+    std::string temporary = filename + ".tmp";
+    FILE* file = fopen(temporary.c_str(), "w");
+    if (file == NULL) {
+        std::cerr << "Could not open file: " << temporary << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    const std::string &bytes = state.str();
+    bool written = fwrite(bytes.data(), 1, bytes.size(), file) == bytes.size()
+        && fflush(file) == 0 && fsync(fileno(file)) == 0;
+    if (fclose(file) != 0 || !written || rename(temporary.c_str(), filename.c_str()) != 0) {
+        std::cerr << "Could not save checkpoint " << filename << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    lastSave = std::chrono::steady_clock::now();
+}
@@ -0,0 +1,56 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include <chrono>
+#include <map>
+#include <string>
+#include <vector>
+
+/*
+ * The saved state of a long computation, so it can continue after an interruption.
+ *
+ * The state is a set of named lists of numbers and a list of text lines, such as result
+ * lines already written, together with a fingerprint of the input the state belongs to. A
+ * save writes a temporary file next to the state file and renames it over the state file, so
+ * an interruption leaves either the old state or the new one, never a mix.
+ *
+ * FORMAT (text, one entry per line):
+ *
+ *   qdist-checkpoint 1
+ *   fingerprint <hex>
+ *   value <name> <number>...
+ *   line <text>
+ */
+class Checkpoint {
+public:
+    // The state is saved to filename, and a save is due every interval seconds
+    Checkpoint(const std::string &filename, unsigned long fingerprint, int interval = 60);
+
+    // Load the state saved in the file. Returns false if there is no file, and exits if the
+    // state belongs to other input.
+    bool Load();
+
+    void Set(const std::string &name, long value) { values[name] = std::vector<long>(1, value); }
+    void Set(const std::string &name, const std::vector<long> &list) { values[name] = list; }
+    // The value or list saved under name, 0 or empty if there is none
+    long Get(const std::string &name) const;
+    std::vector<long> GetList(const std::string &name) const;
+
+    void AddLine(const std::string &line) { lines.push_back(line); }
+    const std::vector<std::string> &GetLines() const { return lines; }
+
+    void Save();
+    // Whether interval seconds have passed since the last save
+    bool Due() const { return std::chrono::steady_clock::now() - lastSave >= interval; }
+
+private:
+    std::string filename;
+    unsigned long fingerprint;
+    std::chrono::steady_clock::duration interval;
+    std::chrono::steady_clock::time_point lastSave;
+
+    std::map<std::string, std::vector<long> > values;
+    std::vector<std::string> lines;
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "LcaIndex.hpp"
+#include "InternalNode.hpp"
+#include "LeafNode.hpp"
+#include "DirectedEdge.hpp"
+
+#include <assert.h>
+#include <utility>
+
+LcaIndex::LcaIndex(Tree* tree)
+    : numInternalNodes(tree->NumInternalNodes()),
+      depth(tree->NumInternalNodes() + tree->NumLeafNodes(), 0),
+      preorder(depth.size(), -1),
+      subtreeEnd(depth.size(), -1),
+      parentEdge(depth.size(), NULL),
+      nodeAt(),
+      sparseTable()
+{
+    const int numNodes = depth.size();
+    nodeAt.reserve(numNodes);
+
+    //preorder with an explicit stack of edges pointing down into the nodes still to visit
+    Node* root = tree->GetRoot();
+    preorder[Index(root)] = 0;
+    nodeAt.push_back(Index(root));
+
+    std::vector<DirectedEdge*> stack;
+    if (root->isInternal()) {
+        const std::vector<DirectedEdge*> &edges = ((InternalNode*)root)->GetEdges();
+        stack.assign(edges.rbegin(), edges.rend());
+    }
+    while (!stack.empty()) {
+        DirectedEdge* edge = stack.back();
+        stack.pop_back();
+
+        Node* node = edge->GetToNode();
+        int index = Index(node);
+        depth[index] = depth[Index(edge->GetFromNode())] + 1;
+        parentEdge[index] = edge;
+        preorder[index] = nodeAt.size();
+        nodeAt.push_back(index);
+
+        if (node->isInternal()) {
+            const std::vector<DirectedEdge*> &edges = ((InternalNode*)node)->GetEdges();
+            for (std::vector<DirectedEdge*>::size_type i = edges.size(); i-- > 0; )
+                if (edges[i] != edge->GetBackEdge())
+                    stack.push_back(edges[i]);
+        }
+    }
+    assert((int)nodeAt.size() == numNodes);
+
+    //a subtree ends where the subtree of the next sibling or ancestor sibling begins, so
+    //going backwards each node ends where its last child ends
+    for (int pos = numNodes - 1; pos >= 0; pos--) {
+        int index = nodeAt[pos];
+        if (subtreeEnd[index] == -1)
+            subtreeEnd[index] = pos + 1;
+        if (parentEdge[index] != NULL) {
+            int parent = Index(parentEdge[index]->GetFromNode());
+            if (subtreeEnd[parent] == -1)
+                subtreeEnd[parent] = subtreeEnd[index];
+        }
+    }
+
+    //sparse table of minimum depth positions
+    sparseTable.push_back(std::vector<int>(numNodes));
+    for (int pos = 0; pos < numNodes; pos++)
+        sparseTable[0][pos] = pos;
+
+    for (int k = 1; (1 << k) <= numNodes; k++) {
+        const std::vector<int> &below = sparseTable[k - 1];
+        std::vector<int> level(numNodes - (1 << k) + 1);
+        for (int pos = 0; pos < (int)level.size(); pos++) {
+            int left = below[pos];
+            int right = below[pos + (1 << (k - 1))];
+            level[pos] = depth[nodeAt[right]] <= depth[nodeAt[left]] ? right : left;
+        }
+        sparseTable.push_back(level);
+    }
+}
+
+int LcaIndex::Index(Node* node) const {
+    if (node->isLeaf())
+        return numInternalNodes + ((LeafNode*)node)->GetLeafId();
+    return ((InternalNode*)node)->GetInternalId();
+}
+
+int LcaIndex::MinPosition(int lo, int hi) const {
+    int k = 31 - __builtin_clz(hi - lo + 1);
+    int left = sparseTable[k][lo];
+    int right = sparseTable[k][hi - (1 << k) + 1];
+    return depth[nodeAt[right]] <= depth[nodeAt[left]] ? right : left;
+}
+
+bool LcaIndex::IsAncestor(Node* ancestor, Node* node) const {
+    int a = Index(ancestor);
+    int pos = preorder[Index(node)];
+    return preorder[a] <= pos && pos < subtreeEnd[a];
+}
+
+Node* LcaIndex::Lca(Node* a, Node* b) const {
+    int posA = preorder[Index(a)];
+    int posB = preorder[Index(b)];
+    if (posA == posB)
+        return a;
+    if (posA > posB)
+        std::swap(posA, posB);
+
+    //the shallowest node after a up to b is a child of the lca
+    int child = nodeAt[MinPosition(posA + 1, posB)];
+    return parentEdge[child]->GetFromNode();
+}
+
+int LcaIndex::Distance(Node* a, Node* b) const {
+    return depth[Index(a)] + depth[Index(b)] - 2 * depth[Index(Lca(a, b))];
+}
+
+DirectedEdge* LcaIndex::EdgeTowards(Node* from, Node* to) const {
+    assert(from != to);
+
+    //towards a descendant, down into the latest child starting at or before it
+    if (IsAncestor(from, to)) {
+        int child = nodeAt[MinPosition(preorder[Index(from)] + 1, preorder[Index(to)])];
+        return parentEdge[child];
+    }
+
+    //otherwise up towards the root
+    return parentEdge[Index(from)]->GetBackEdge();
+}
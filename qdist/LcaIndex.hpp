@@ -0,0 +1,56 @@
+#ifndef LCA_INDEX_H
+#define LCA_INDEX_H
+
+#include "Tree.hpp"
+
+#include <vector>
+
+class Node;
+class DirectedEdge;
+
+/*
+ * An index answering lowest common ancestor queries on a tree, rooted at its root, in
+ * constant time.
+ *
+ * The nodes are numbered in preorder. For two nodes u and v with u before v, the node of
+ * least depth among the positions (pre(u),pre(v)] is a child of lca(u,v) on the path to v,
+ * so a sparse table of range minima over the depths answers the query. Ties go to the later
+ * position, which makes the same query also find the child of an ancestor towards a node.
+ *
+ * Building the index takes O(n log n) time and space.
+ */
+class LcaIndex {
+public:
+    LcaIndex(Tree* tree);
+
+    Node* Lca(Node* a, Node* b) const;
+    int Depth(Node* node) const { return depth[Index(node)]; }
+    // number of edges on the path between two nodes
+    int Distance(Node* a, Node* b) const;
+    bool IsAncestor(Node* ancestor, Node* node) const;
+
+    // the edge pointing down into a node from its parent, NULL for the root
+    DirectedEdge* ParentEdge(Node* node) const { return parentEdge[Index(node)]; }
+    // the edge out of from on the path to another node
+    DirectedEdge* EdgeTowards(Node* from, Node* to) const;
+
+private:
+    int Index(Node* node) const;
+    // the preorder position of least depth in [lo,hi], the latest one on ties
+    int MinPosition(int lo, int hi) const;
+
+    int numInternalNodes;
+
+    //by node index: internal id, or the number of internal nodes plus leaf id
+    std::vector<int> depth;
+    std::vector<int> preorder;
+    std::vector<int> subtreeEnd;
+    std::vector<DirectedEdge*> parentEdge;
+
+    //node index at each preorder position
+    std::vector<int> nodeAt;
+    //level k holds the minimum position of each range [i, i + 2^k)
+    std::vector<std::vector<int> > sparseTable;
+};
+
+#endif
@@ -0,0 +1,57 @@
+#include "LeafIntervals.hpp"
+#include "TreeUtil.hpp"
+#include "LeafNode.hpp"
+
+LeafIntervals::LeafIntervals(Tree* tree)
+    : leaves(),
+      position(tree->NumLeafNodes(), -1),
+      start(tree->NumEdges(), 0),
+      stop(tree->NumEdges(), 0)
+{
+    const int n = tree->NumLeafNodes();
+    leaves.reserve(2 * n);
+
+    //the down edges are in preorder, so the leaves below an edge are the ones met until the
+    //traversal leaves its subtree
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(tree);
+    std::vector<DirectedEdge*> open;
+
+    if (tree->GetRoot()->isLeaf()) {
+        position[((LeafNode*)tree->GetRoot())->GetLeafId()] = leaves.size();
+        leaves.push_back((LeafNode*)tree->GetRoot());
+    }
+    for (unsigned k = 0; k < downEdges.size(); k++) {
+        DirectedEdge* edge = downEdges[k];
+
+        //close the intervals of the edges whose subtrees we have left
+        while (!open.empty() && open.back()->GetToNode() != edge->GetFromNode()) {
+            stop[open.back()->GetEdgeId()] = leaves.size();
+            open.pop_back();
+        }
+
+        start[edge->GetEdgeId()] = leaves.size();
+        Node* toNode = edge->GetToNode();
+        if (toNode->isLeaf()) {
+            position[((LeafNode*)toNode)->GetLeafId()] = leaves.size();
+            leaves.push_back((LeafNode*)toNode);
+            stop[edge->GetEdgeId()] = leaves.size();
+        }
+        else
+            open.push_back(edge);
+    }
+    while (!open.empty()) {
+        stop[open.back()->GetEdgeId()] = leaves.size();
+        open.pop_back();
+    }
+
+    //the complements
+    for (unsigned k = 0; k < downEdges.size(); k++) {
+        int down = downEdges[k]->GetEdgeId();
+        int up = downEdges[k]->GetBackEdge()->GetEdgeId();
+        start[up] = stop[down];
+        stop[up] = start[down] + n;
+    }
+
+    for (int i = 0; i < n; i++)
+        leaves.push_back(leaves[i]);
+}
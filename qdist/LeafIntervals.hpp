@@ -0,0 +1,44 @@
+#ifndef LEAF_INTERVALS_H
+#define LEAF_INTERVALS_H
+
+#include "Tree.hpp"
+#include "DirectedEdge.hpp"
+
+#include <vector>
+
+class LeafNode;
+
+/*
+ * The leaves of a tree in the order a depth-first traversal from the root meets them, such
+ * that the leaves of the subtree identified by any directed edge are one contiguous span.
+ *
+ * For an edge pointing away from the root the span is an interval [lo,hi) of positions. For
+ * an edge pointing towards the root it is the complement, [hi,n) followed by [0,lo), which is
+ * contiguous too because the array holds the order twice. Enumerating the leaves of a subtree
+ * therefore copies nothing, and the size of a subtree is the length of its span.
+ */
+class LeafIntervals {
+public:
+    LeafIntervals(Tree* tree);
+
+    // the leaves of the subtree identified by an edge are [Begin(edge),End(edge))
+    LeafNode* const* Begin(DirectedEdge* edge) const { return &leaves[start[edge->GetEdgeId()]]; }
+    LeafNode* const* End(DirectedEdge* edge) const   { return &leaves[0] + stop[edge->GetEdgeId()]; }
+    int Size(DirectedEdge* edge) const { return stop[edge->GetEdgeId()] - start[edge->GetEdgeId()]; }
+
+    // for an edge pointing away from the root, the interval of positions of its leaves
+    int Lo(DirectedEdge* edge) const { return start[edge->GetEdgeId()]; }
+    int Hi(DirectedEdge* edge) const { return stop[edge->GetEdgeId()]; }
+    // the position of a leaf in the order
+    int Position(int leafId) const { return position[leafId]; }
+
+private:
+    //the order of the leaves, twice
+    std::vector<LeafNode*> leaves;
+    std::vector<int> position;
+    //span of each edge, by edge id, as offsets into leaves
+    std::vector<int> start;
+    std::vector<int> stop;
+};
+
+#endif
@@ -4,11 +4,20 @@
 
 
 #include<iostream>
+#include<algorithm>
 
 #include"include_blas.hpp"
 
 
 
+/*
+ * A dense row-major matrix with the products needed by the quartet distance algorithm.
+ *
+ * Products are computed exactly by built-in kernels for any element type. The kernels are
+ * cache-blocked and written so the inner loops run over contiguous memory, which lets the
+ * compiler vectorise them. When built with BLAS (QDIST_USE_BLAS), products large enough for
+ * BLAS to pay off are handed to cblas_dgemm instead.
+ */
 template<typename E>
 class Matrix {
 private:
@@ -21,9 +30,10 @@ private:
 
 public:
 
-    typedef CBLAS_TRANSPOSE Transpose;
-    static const Transpose TRANSPOSE = CblasTrans;
-    static const Transpose NO_TRANSPOSE = CblasNoTrans;
+    enum Transpose { NO_TRANSPOSE, TRANSPOSE };
+
+    // Products with fewer multiply-adds than this are never handed to BLAS.
+    static const long BLAS_THRESHOLD = 128L * 128L * 128L;
 
     Matrix()
         : height(1), width(1),
@@ -51,6 +61,10 @@ private:
 
     unsigned Idx(int i, int j) const { return i * width + j; }
 
+    // Block sizes for the inner dimension and the output columns of the kernels.
+    static const int BLOCK_K = 128;
+    static const int BLOCK_J = 256;
+
 
 
 public:
@@ -64,7 +78,7 @@ public:
     {
         this->height = height;
         this->width = width;
-        unsigned long newAllocated = height * width;
+        unsigned long newAllocated = (unsigned long)height * width;
         if(newAllocated > allocatedSize)
         {
             allocatedSize = newAllocated;
@@ -76,31 +90,244 @@ public:
     int GetHeight() const { return height; }
     int GetWidth()  const { return width;  }
 
+    E* GetData()             { return data; }
+    const E* GetData() const { return data; }
+
 
 
     static void Mult(const Matrix &in1, Transpose transpose1,
                      const Matrix &in2, Transpose transpose2,
                      Matrix &out)
     {
-        cblas_dgemm(CblasRowMajor,
-                    transpose1,
-                    transpose2,
-                    out.height, out.width, transpose1 == NO_TRANSPOSE ? in1.width : in1.height,
-                    1.0,
-                    in1.data, in1.width,
-                    in2.data, in2.width,
-                    0.0,
-                    out.data, out.width);
+        const int inner = transpose1 == NO_TRANSPOSE ? in1.width : in1.height;
+
+#ifdef QDIST_USE_BLAS
+        if((long)out.height * out.width * inner >= BLAS_THRESHOLD)
+        {
+            BlasMult(in1, transpose1, in2, transpose2, out, inner);
+            return;
+        }
+#endif
+
+        std::fill(out.data, out.data + (unsigned long)out.height * out.width, E(0));
+
+        // A product of a matrix with its own transpose is symmetric, so only the upper
+        // triangle is computed.
+        if(&in1 == &in2 && transpose1 != transpose2)
+        {
+            if(transpose1 == NO_TRANSPOSE)
+                GramRows(in1, out);
+            else
+                GramColumns(in1, out);
+            for(int i = 0; i < out.height; ++i)
+                for(int j = 0; j < i; ++j)
+                    out(i, j) = out(j, i);
+            return;
+        }
+
+        if(transpose1 == NO_TRANSPOSE && transpose2 == NO_TRANSPOSE)
+            MultNN(in1, in2, out, inner);
+        else if(transpose1 == TRANSPOSE && transpose2 == NO_TRANSPOSE)
+            MultTN(in1, in2, out, inner);
+        else if(transpose1 == NO_TRANSPOSE && transpose2 == TRANSPOSE)
+            MultNT(in1, in2, out, inner);
+        else
+            for(int i = 0; i < out.height; ++i)
+                for(int j = 0; j < out.width; ++j)
+                {
+                    E sum = 0;
+                    for(int p = 0; p < inner; ++p)
+                        sum += in1(p, i) * in2(j, p);
+                    out(i, j) = sum;
+                }
     }
 
     static void Mult(const Matrix &in1,
                      const Matrix &in2,
                      Matrix &out)
     { Mult(in1, NO_TRANSPOSE, in2, NO_TRANSPOSE, out); }
+
+
+
+private:
+
+    /*
+     * out += in1 * in2. Rows of in2 are added to rows of out, blocked so that the
+     * touched part of in2 stays in cache.
+     */
+    static void MultNN(const Matrix &in1, const Matrix &in2, Matrix &out, int inner)
+    {
+        for(int p0 = 0; p0 < inner; p0 += BLOCK_K)
+        {
+            const int p1 = std::min(p0 + BLOCK_K, inner);
+            for(int j0 = 0; j0 < out.width; j0 += BLOCK_J)
+            {
+                const int j1 = std::min(j0 + BLOCK_J, out.width);
+                for(int i = 0; i < out.height; ++i)
+                {
+                    E* __restrict__ outRow = out.data + (unsigned long)i * out.width;
+                    for(int p = p0; p < p1; ++p)
+                    {
+                        const E a = in1.data[(unsigned long)i * in1.width + p];
+                        if(a == 0)
+                            continue;
+                        const E* __restrict__ in2Row = in2.data + (unsigned long)p * in2.width;
+                        for(int j = j0; j < j1; ++j)
+                            outRow[j] += a * in2Row[j];
+                    }
+                }
+            }
+        }
+    }
+
+    /*
+     * out += in1^T * in2. Every row p of the inputs contributes an outer product.
+     */
+    static void MultTN(const Matrix &in1, const Matrix &in2, Matrix &out, int inner)
+    {
+        for(int j0 = 0; j0 < out.width; j0 += BLOCK_J)
+        {
+            const int j1 = std::min(j0 + BLOCK_J, out.width);
+            for(int p = 0; p < inner; ++p)
+            {
+                const E* __restrict__ in1Row = in1.data + (unsigned long)p * in1.width;
+                const E* __restrict__ in2Row = in2.data + (unsigned long)p * in2.width;
+                for(int i = 0; i < out.height; ++i)
+                {
+                    const E a = in1Row[i];
+                    if(a == 0)
+                        continue;
+                    E* __restrict__ outRow = out.data + (unsigned long)i * out.width;
+                    for(int j = j0; j < j1; ++j)
+                        outRow[j] += a * in2Row[j];
+                }
+            }
+        }
+    }
+
+    /*
+     * out = in1 * in2^T. Every entry is a dot product of two contiguous rows.
+     */
+    static void MultNT(const Matrix &in1, const Matrix &in2, Matrix &out, int inner)
+    {
+        for(int i = 0; i < out.height; ++i)
+        {
+            const E* __restrict__ in1Row = in1.data + (unsigned long)i * in1.width;
+            for(int j = 0; j < out.width; ++j)
+            {
+                const E* __restrict__ in2Row = in2.data + (unsigned long)j * in2.width;
+                E sum = 0;
+                for(int p = 0; p < inner; ++p)
+                    sum += in1Row[p] * in2Row[p];
+                out.data[(unsigned long)i * out.width + j] = sum;
+            }
+        }
+    }
+
+    /*
+     * Upper triangle of in * in^T.
+     */
+    static void GramRows(const Matrix &in, Matrix &out)
+    {
+        for(int i = 0; i < in.height; ++i)
+        {
+            const E* __restrict__ row1 = in.data + (unsigned long)i * in.width;
+            for(int j = i; j < in.height; ++j)
+            {
+                const E* __restrict__ row2 = in.data + (unsigned long)j * in.width;
+                E sum = 0;
+                for(int p = 0; p < in.width; ++p)
+                    sum += row1[p] * row2[p];
+                out.data[(unsigned long)i * out.width + j] = sum;
+            }
+        }
+    }
+
+    /*
+     * Upper triangle of in^T * in.
+     */
+    static void GramColumns(const Matrix &in, Matrix &out)
+    {
+        for(int p = 0; p < in.height; ++p)
+        {
+            const E* __restrict__ row = in.data + (unsigned long)p * in.width;
+            for(int i = 0; i < in.width; ++i)
+            {
+                const E a = row[i];
+                if(a == 0)
+                    continue;
+                E* __restrict__ outRow = out.data + (unsigned long)i * out.width;
+                for(int j = i; j < in.width; ++j)
+                    outRow[j] += a * row[j];
+            }
+        }
+    }
+
+
+
+#ifdef QDIST_USE_BLAS
+    static CBLAS_TRANSPOSE BlasTranspose(Transpose transpose)
+    { return transpose == TRANSPOSE ? CblasTrans : CblasNoTrans; }
+
+    static void Gemm(const Matrix<double> &in1, Transpose transpose1,
+                     const Matrix<double> &in2, Transpose transpose2,
+                     Matrix<double> &out, int inner)
+    {
+        cblas_dgemm(CblasRowMajor,
+                    BlasTranspose(transpose1),
+                    BlasTranspose(transpose2),
+                    out.GetHeight(), out.GetWidth(), inner,
+                    1.0,
+                    in1.GetData(), in1.GetWidth(),
+                    in2.GetData(), in2.GetWidth(),
+                    0.0,
+                    out.GetData(), out.GetWidth());
+    }
+
+    /*
+     * Compute the product with BLAS. Integer matrices are converted to doubles and back,
+     * which is exact as long as all entries of the result stay below 2^53.
+     */
+    static void BlasMult(const Matrix &in1, Transpose transpose1,
+                         const Matrix &in2, Transpose transpose2,
+                         Matrix &out, int inner);
+#endif
 };
 
 
 
+#ifdef QDIST_USE_BLAS
+template<>
+inline
+void Matrix<double>::BlasMult(const Matrix &in1, Transpose transpose1,
+                              const Matrix &in2, Transpose transpose2,
+                              Matrix &out, int inner)
+{
+    Gemm(in1, transpose1, in2, transpose2, out, inner);
+}
+
+template<typename E>
+inline
+void Matrix<E>::BlasMult(const Matrix &in1, Transpose transpose1,
+                         const Matrix &in2, Transpose transpose2,
+                         Matrix &out, int inner)
+{
+    Matrix<double> d1(in1.height, in1.width);
+    std::copy(in1.data, in1.data + (unsigned long)in1.height * in1.width, d1.GetData());
+    Matrix<double> d2(in2.height, in2.width);
+    std::copy(in2.data, in2.data + (unsigned long)in2.height * in2.width, d2.GetData());
+    Matrix<double> dOut(out.height, out.width);
+
+    Gemm(d1, transpose1, d2, transpose2, dOut, inner);
+
+    const double* result = dOut.GetData();
+    for(unsigned long k = 0; k < (unsigned long)out.height * out.width; ++k)
+        out.data[k] = E(result[k] + (result[k] < 0 ? -0.5 : 0.5));
+}
+#endif
+
+
+
 template<typename E>
 inline
 std::ostream &operator<<(std::ostream &out, const Matrix<E> &m)
@@ -124,6 +124,32 @@ Tree* NewickParser::Parse(std::string string) {
     return tree;
 }
 
+/*
+ * Split a string holding several trees into one string per tree, each ending with its
+ * semicolon. Text after the last semicolon is ignored if it is only whitespace.
+ */
+std::vector<std::string> NewickParser::SplitTrees(const std::string &string) {
+    std::vector<std::string> trees;
+
+    std::string::size_type start = 0;
+    int parenthesesDepth = 0;
+    for (std::string::size_type index = 0; index < string.size(); index++) {
+        if (string[index] == '(')
+            parenthesesDepth++;
+        else if (string[index] == ')')
+            parenthesesDepth--;
+        else if (string[index] == ';' && parenthesesDepth == 0) {
+            trees.push_back(string.substr(start, index + 1 - start));
+            start = index + 1;
+        }
+    }
+
+    if (trim(string.substr(start)) != "")
+        trees.push_back(string.substr(start));
+
+    return trees;
+}
+
 /*
  * Subtree --> Leaf | Internal
  */
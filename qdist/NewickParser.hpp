@@ -23,6 +23,8 @@ public:
 
     Tree* Parse(std::string string);
 
+    static std::vector<std::string> SplitTrees(const std::string &string);
+
 private:
     int internalIdCount;
     int leafIdCount;
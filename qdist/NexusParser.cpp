@@ -0,0 +1,190 @@
+#include "NexusParser.hpp"
+#include "InternalNode.hpp"
+#include "LeafNode.hpp"
+#include "DirectedEdge.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+
+NexusParser::NexusParser()
+    : tokenIds(),
+      labels()
+{}
+
+void NexusParser::AddTranslation(const std::string &token, const std::string &label) {
+    tokenIds[token] = labels.size();
+    labels.push_back(label);
+}
+
+/*
+ * Helper function. Read the token at index, a quoted string with '' for a quote, or the
+ * characters up to the next punctuation or whitespace, and move index past it.
+ */
+static std::string ReadToken(const std::string &string, std::string::size_type &index) {
+    std::string token;
+    if (string[index] == '\'') {
+        for (index++; index < string.size(); index++) {
+            if (string[index] == '\'') {
+                if (index + 1 < string.size() && string[index + 1] == '\'')
+                    index++;
+                else {
+                    index++;
+                    break;
+                }
+            }
+            token += string[index];
+        }
+        return token;
+    }
+
+    std::string::size_type start = index;
+    while (index < string.size() && !strchr("(),:;[ \t\r\n", string[index]))
+        index++;
+    return string.substr(start, index - start);
+}
+
+Tree* NexusParser::Parse(const std::string &description) const {
+    std::vector<InternalNode*> internalNodes;
+    std::vector<LeafNode*> leafNodes;
+    std::vector<DirectedEdge*> edges;
+    //for each leaf its position in the table, or for leaves not in the table a position
+    //past the table in order of appearance
+    std::vector<int> leafKeys;
+
+    //the branches to the children of each open parenthesis, and the subtree just read,
+    //waiting for the branch to it
+    std::vector<std::vector<DirectedEdge*> > open;
+    Node* node = NULL;
+
+    std::string::size_type index = 0;
+    while (index < description.size()) {
+        char c = description[index];
+
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n')
+            index++;
+        else if (c == '(') {
+            if (node != NULL) {
+                std::cerr << "NexusParser ERROR: Unexpected ( after a subtree." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            open.push_back(std::vector<DirectedEdge*>());
+            index++;
+        }
+        else if (c == ',' || c == ')') {
+            if (open.empty()) {
+                std::cerr << "NexusParser ERROR: Unexpected " << c << " outside of parentheses." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            index++;
+
+            //an empty branch is an unnamed leaf
+            if (node == NULL) {
+                leafKeys.push_back(labels.size() + leafKeys.size());
+                LeafNode* leaf = new LeafNode("Leaf NONAME", 0);
+                leafNodes.push_back(leaf);
+                node = leaf;
+            }
+
+            DirectedEdge* branch = new DirectedEdge(edges.size());
+            edges.push_back(branch);
+            branch->SetToNode(node);
+            open.back().push_back(branch);
+            node = NULL;
+
+            if (c == ')') {
+                std::string name;
+                if (index < description.size() && !strchr("(),:;[ \t\r\n", description[index]))
+                    name = ReadToken(description, index);
+
+                InternalNode* internalNode = new InternalNode(name.empty() ? "Internal NONAME" : name, internalNodes.size());
+                const std::vector<DirectedEdge*> &branchSet = open.back();
+                for (unsigned i = 0; i < branchSet.size(); i++) {
+                    DirectedEdge* edge = branchSet[i];
+                    edge->SetFromNode(internalNode);
+
+                    DirectedEdge* backEdge = new DirectedEdge(edges.size());
+                    edges.push_back(backEdge);
+                    backEdge->SetFromNode(edge->GetToNode());
+                    backEdge->SetToNode(internalNode);
+                    internalNode->AddEdge(edge);
+                    edge->GetToNode()->AddEdge(backEdge);
+
+                    edge->SetBackEdge(backEdge);
+                    backEdge->SetBackEdge(edge);
+                }
+
+                internalNodes.push_back(internalNode);
+                open.pop_back();
+                node = internalNode;
+            }
+        }
+        else if (c == ':') {
+            //the length is not used
+            for (index++; index < description.size() && !strchr("(),:;[ \t\r\n", description[index]); index++)
+                ;
+        }
+        else if (c == ';')
+            break;
+        else {
+            if (node != NULL) {
+                std::cerr << "NexusParser ERROR: Unexpected name after a subtree." << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            std::string token = ReadToken(description, index);
+            std::unordered_map<std::string, int>::const_iterator found = tokenIds.find(token);
+
+            LeafNode* leaf;
+            if (found != tokenIds.end()) {
+                leafKeys.push_back(found->second);
+                leaf = new LeafNode(labels[found->second], 0);
+            }
+            else {
+                leafKeys.push_back(labels.size() + leafKeys.size());
+                leaf = new LeafNode(token, 0);
+            }
+            leafNodes.push_back(leaf);
+            node = leaf;
+        }
+    }
+
+    if (!open.empty() || node == NULL) {
+        std::cerr << "NexusParser ERROR: Incomplete tree." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    //the positions are the leaf ids if the leaves are exactly the table, and otherwise the
+    //leaves are numbered in the order of their positions
+    const int numLeaves = leafNodes.size();
+    std::vector<char> seen(numLeaves, 0);
+    bool exact = true;
+    for (int i = 0; i < numLeaves && exact; i++) {
+        exact = leafKeys[i] < numLeaves && !seen[leafKeys[i]];
+        if (exact)
+            seen[leafKeys[i]] = 1;
+    }
+
+    std::vector<int> order(numLeaves);
+    for (int i = 0; i < numLeaves; i++)
+        order[i] = i;
+    if (exact)
+        for (int i = 0; i < numLeaves; i++)
+            order[leafKeys[i]] = i;
+    else
+        std::stable_sort(order.begin(), order.end(), [&](int a, int b) { return leafKeys[a] < leafKeys[b]; });
+
+    std::vector<LeafNode*> leavesById(numLeaves);
+    for (int id = 0; id < numLeaves; id++) {
+        leavesById[id] = leafNodes[order[id]];
+        leavesById[id]->SetLeafId(id);
+    }
+
+    Tree* tree = new Tree();
+    tree->SetRoot(node);
+    tree->SetInternalNodeList(internalNodes);
+    tree->SetLeafNodeList(leavesById);
+    tree->SetEdgeList(edges);
+
+    return tree;
+}
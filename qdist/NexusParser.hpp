@@ -0,0 +1,42 @@
+#ifndef NEXUS_PARSER_H
+#define NEXUS_PARSER_H
+
+#include <string>
+#include <vector>
+#include <unordered_map>
+
+#include "Tree.hpp"
+
+/*
+ * A parser for the tree descriptions of a NEXUS TREES block, as written by MrBayes and
+ * BEAST, where the leaves are usually named by the tokens of a TRANSLATE table.
+ *
+ * A description is read in a single pass with an explicit stack of the open parentheses.
+ * Leaf tokens are looked up in the table, which gives each leaf its label, copied from the
+ * table, and its id, the position of the token in the table. Tokens not in the table are
+ * labels of their own. Callers that compare trees still renumber them canonically, by label,
+ * as for trees from newick files, so the table ids only last until then. Branch lengths are
+ * skipped, and so are comments, which the NEXUS reading of TreeReader has already removed.
+ *
+ * The nodes and edges are numbered as by NewickParser on the same tree with the labels
+ * filled in. Parse keeps no state, so several threads may use one parser.
+ */
+class NexusParser {
+public:
+    NexusParser();
+
+    // Add the next TRANSLATE entry, mapping a token to a label
+    void AddTranslation(const std::string &token, const std::string &label);
+
+    bool operator==(const NexusParser &other) const { return labels == other.labels && tokenIds == other.tokenIds; }
+
+    // Parse a tree description, with or without its semicolon
+    Tree* Parse(const std::string &description) const;
+
+private:
+    //the position of each token in the table, and the label of each position
+    std::unordered_map<std::string, int> tokenIds;
+    std::vector<std::string> labels;
+};
+
+#endif
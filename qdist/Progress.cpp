@@ -0,0 +1,47 @@
+#include "Progress.hpp"
+
+#include <iostream>
+#include <iomanip>
+#include <sstream>
+
+Progress::Progress(const std::string &what, long total, long done, int interval)
+    : what(what),
+      total(total),
+      start(done),
+      done(done),
+      startTime(std::chrono::steady_clock::now()),
+      lastReport(startTime),
+      interval(std::chrono::seconds(interval))
+{}
+
+void Progress::Update(long done) {
+    this->done = done;
+    if (std::chrono::steady_clock::now() - lastReport >= interval)
+        Report();
+}
+
+void Progress::Finish() {
+    Report();
+}
+
+/*
+ * Print e.g. "qdist: 1200 of 5000 (24.0%), about 0:03:10 left".
+ */
+void Progress::Report() {
+    lastReport = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(lastReport - startTime).count();
+
+    std::ostringstream line;
+    line << what << ": " << done << " of " << total;
+    if (total > 0)
+        line << " (" << std::fixed << std::setprecision(1) << 100.0 * done / total << "%)";
+
+    //the rate of this run only, as work restored from a checkpoint took no time
+    if (done < total && done > start && seconds > 0) {
+        long left = (long)((total - done) * seconds / (done - start));
+        line << ", about " << left / 3600 << ':' << std::setfill('0') << std::setw(2) << left / 60 % 60
+             << ':' << std::setw(2) << left % 60 << " left";
+    }
+
+    std::cerr << line.str() << std::endl;
+}
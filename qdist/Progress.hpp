@@ -0,0 +1,32 @@
+#ifndef PROGRESS_H
+#define PROGRESS_H
+
+#include <chrono>
+#include <string>
+
+/*
+ * Reports the progress of a long computation on stderr, with an estimate of the time left
+ * from the rate of the work done so far, at most every interval seconds.
+ */
+class Progress {
+public:
+    // Work starts at done out of total units, more than 0 when continuing from a checkpoint
+    Progress(const std::string &what, long total, long done = 0, int interval = 10);
+
+    void Update(long done);
+    // Report the final count regardless of the interval
+    void Finish();
+
+private:
+    void Report();
+
+    std::string what;
+    long total;
+    long start;
+    long done;
+    std::chrono::steady_clock::time_point startTime;
+    std::chrono::steady_clock::time_point lastReport;
+    std::chrono::steady_clock::duration interval;
+};
+
+#endif
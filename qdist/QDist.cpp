@@ -1,13 +1,124 @@
 #include "QDist.hpp"
 #include <iostream>
+#include <algorithm>
+#include <map>
 
 #include "TreeUtil.hpp"
 #include "Util.hpp"
 #include "Matrix.hpp"
+#include "Checkpoint.hpp"
+#include "Progress.hpp"
 
 
-static long CountButterflies(Tree *t);
-static void Count(Tree* t1, Tree* t2, long &shared, long &diff);
+static long CountButterflies(Tree *t, std::vector<long> *edgeTerms = NULL);
+template<typename Size>
+static void Count(Tree* t1, Tree* t2, long &shared, long &diff, const QDistOptions &options,
+                  std::vector<long> *sharedEdgeTerms, std::vector<long> *leafWeights);
+
+
+/*
+ * The leaves are written by label. Each split is named by the sorted labels of its smaller
+ * side, or of the side with the smallest label if the sides are even, and gets the counts of
+ * the edges in both directions. At a root of degree two, the two edges below it are the same
+ * split of the unrooted tree, so they share a line, and the lines are sorted by name.
+ */
+void QDistBreakdown::Write(std::ostream &out, Tree* t1) const {
+    out << "type\tname\tquartets" << std::endl;
+
+    std::vector<std::pair<std::string, long> > leaves;
+    for (int i = 0; i < t1->NumLeafNodes(); i++)
+        leaves.push_back(std::make_pair(t1->GetLeafNode(i)->GetLabel(), leafQuartets[i]));
+    std::sort(leaves.begin(), leaves.end());
+    for (unsigned i = 0; i < leaves.size(); i++)
+        out << "leaf\t" << leaves[i].first << '\t' << leaves[i].second << std::endl;
+
+    std::map<std::string, long> splits;
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(t1);
+    for (unsigned k = 0; k < downEdges.size(); k++) {
+        DirectedEdge* edge = downEdges[k];
+        std::vector<std::string> below, above;
+        std::vector<LeafNode*> side = TreeUtil::CollectLeavesInSubtree(edge);
+        for (unsigned i = 0; i < side.size(); i++)
+            below.push_back(side[i]->GetLabel());
+        side = TreeUtil::CollectLeavesInSubtree(edge->GetBackEdge());
+        for (unsigned i = 0; i < side.size(); i++)
+            above.push_back(side[i]->GetLabel());
+        //a split with a single leaf on one side is trivial
+        if (below.size() < 2 || above.size() < 2)
+            continue;
+
+        std::sort(below.begin(), below.end());
+        std::sort(above.begin(), above.end());
+        const std::vector<std::string> &smaller = below.size() != above.size()
+            ? (below.size() < above.size() ? below : above)
+            : (below[0] < above[0] ? below : above);
+
+        std::string name;
+        for (unsigned i = 0; i < smaller.size(); i++)
+            name += (i == 0 ? "" : ",") + smaller[i];
+        splits[name] += edgeQuartets[edge->GetEdgeId()] + edgeQuartets[edge->GetBackEdge()->GetEdgeId()];
+    }
+
+    for (std::map<std::string, long>::iterator it = splits.begin(); it != splits.end(); ++it)
+        out << "edge\t" << it->first << '\t' << it->second << std::endl;
+}
+
+/*
+ * Sums directed edge weights over the leaves of a tree: for every leaf, the sum of the
+ * weights of all directed edges whose subtree contains the leaf. Each sum takes time linear
+ * in the size of the tree.
+ */
+class EdgeSumsOverLeaves {
+public:
+    EdgeSumsOverLeaves(Tree* t)
+        : downEdges(TreeUtil::CollectEdgesPointingAwayFromRoot(t)),
+          parent(downEdges.size(), -1),
+          leafEdge(t->NumLeafNodes(), -1),
+          pathSums(downEdges.size())
+    {
+        std::vector<int> idx(t->NumEdges());
+        for (unsigned k = 0; k < downEdges.size(); k++)
+            idx[downEdges[k]->GetEdgeId()] = k;
+
+        for (unsigned k = 0; k < downEdges.size(); k++) {
+            Node* toNode = downEdges[k]->GetToNode();
+            if (toNode->isLeaf()) {
+                leafEdge[((LeafNode*)toNode)->GetLeafId()] = k;
+                continue;
+            }
+            const std::vector<DirectedEdge*> &edges = ((InternalNode*)toNode)->GetEdges();
+            for (unsigned e = 0; e < edges.size(); e++)
+                if (edges[e] != downEdges[k]->GetBackEdge())
+                    parent[idx[edges[e]->GetEdgeId()]] = k;
+        }
+    }
+
+    /*
+     * sums[leafId] += sum of weights[edgeId] over all edges whose subtree contains the leaf.
+     *
+     * A leaf is in the subtree of every edge pointing away from the root on the path from the
+     * root to the leaf, and in the subtree of every edge pointing towards the root except the
+     * ones on that path.
+     */
+    void Add(const std::vector<long> &weights, std::vector<long> &sums) {
+        long upSum = 0;
+        for (unsigned k = 0; k < downEdges.size(); k++) {
+            long down = weights[downEdges[k]->GetEdgeId()];
+            long up = weights[downEdges[k]->GetBackEdge()->GetEdgeId()];
+            upSum += up;
+            //the down edges are in preorder, so the parent sum is ready
+            pathSums[k] = (parent[k] == -1 ? 0 : pathSums[parent[k]]) + down - up;
+        }
+        for (unsigned leaf = 0; leaf < leafEdge.size(); leaf++)
+            sums[leaf] += upSum + (leafEdge[leaf] == -1 ? 0 : pathSums[leafEdge[leaf]]);
+    }
+
+private:
+    std::vector<DirectedEdge*> downEdges;
+    std::vector<int> parent;
+    std::vector<int> leafEdge;
+    std::vector<long> pathSums;
+};
 
 
 ////////////////////////////////////////////////////////////////////////////////////////////
@@ -17,17 +128,53 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff);
 //   A sub-cubic time algorithm for computing the quartet distance between two general trees
 //   by Thomas Mailund, Jesper Nielsen and Christian N.S. Pedersen
 ////////////////////////////////////////////////////////////////////////////////////////////
-long SubCubicQDist(Tree* t1, Tree* t2, long &b1, long &b2, long &shared, long &diff) {
+long SubCubicQDist(Tree* t1, Tree* t2, long &b1, long &b2, long &shared, long &diff,
+                   const QDistOptions &options) {
+
+    QDistBreakdown* breakdown = options.breakdown;
+    std::vector<long> butterflyTerms1, butterflyTerms2, sharedTerms, leafWeights;
 
     // 1. B
-    b1 = CountButterflies(t1);
+    b1 = CountButterflies(t1, breakdown ? &butterflyTerms1 : NULL);
 
     // 2. B'
-    b2 = CountButterflies(t2);
+    b2 = CountButterflies(t2, breakdown ? &butterflyTerms2 : NULL);
 
     // 3. shared_B(T,T') and 
     // 4. diff_B(T,T')
-    Count(t1, t2, shared, diff);
+    //the width of the shared leaf set sizes is picked once here, not in the counting loops
+    if (options.narrowSharedLeafSetTable && t1->NumLeafNodes() < MAX_NARROW_LEAVES)
+        Count<uint16_t>(t1, t2, shared, diff, options,
+                        breakdown ? &sharedTerms : NULL,
+                        breakdown ? &leafWeights : NULL);
+    else
+        Count<uint32_t>(t1, t2, shared, diff, options,
+                        breakdown ? &sharedTerms : NULL,
+                        breakdown ? &leafWeights : NULL);
+
+    if (breakdown) {
+        //every butterfly is counted twice at each of its two anchors
+        breakdown->edgeQuartets.resize(t1->NumEdges());
+        for (int e = 0; e < t1->NumEdges(); e++)
+            breakdown->edgeQuartets[e] = (butterflyTerms1[e] - sharedTerms[e]) / 2;
+
+        //leafWeights holds -4*shared_B(x) - 2*diff_B(x) for each leaf x. Adding 2*B(x) and
+        //2*B'(x) gives twice the number of differing quartets containing x.
+        for (int tree = 0; tree < 2; tree++) {
+            Tree* t = tree == 0 ? t1 : t2;
+            std::vector<long> &terms = tree == 0 ? butterflyTerms1 : butterflyTerms2;
+            std::vector<int> leafSetSizes = TreeUtil::SubtreeLeafSetSizes(t);
+            //a butterfly term of an edge counts each leaf of its subtree 2*terms/size times
+            for (int e = 0; e < t->NumEdges(); e++)
+                if (terms[e] != 0)
+                    terms[e] = 2 * terms[e] / leafSetSizes[e];
+            EdgeSumsOverLeaves(t).Add(terms, leafWeights);
+        }
+
+        breakdown->leafQuartets.resize(t1->NumLeafNodes());
+        for (int leaf = 0; leaf < t1->NumLeafNodes(); leaf++)
+            breakdown->leafQuartets[leaf] = leafWeights[leaf] / 2;
+    }
 
     // qdist(T,T') = B + B' - 2*shared_B(T,T') - diff_B(T,T')
     long qdist = b1 + b2 - 2*shared - diff;
@@ -37,16 +184,25 @@ long SubCubicQDist(Tree* t1, Tree* t2, long &b1, long &b2, long &shared, long &d
 
 
 
+long NumButterflies(Tree* t) {
+    return CountButterflies(t);
+}
+
 /*
- * Calculates the total number of butterflies in tree.
+ * Calculates the total number of butterflies in tree. If edgeTerms is given, it receives the
+ * contribution of each directed edge, i.e. four times the number of butterflies anchored at
+ * the edge.
  */
-static long CountButterflies(Tree *t) {
+static long CountButterflies(Tree *t, std::vector<long> *edgeTerms) {
 
     //find leaf set sizes
     std::vector< int > leafSetSizes = TreeUtil::SubtreeLeafSetSizes(t);
 
     long butterflies = 0;
 
+    if (edgeTerms)
+        edgeTerms->assign(t->NumEdges(), 0);
+
 
 
     //count for every inner node
@@ -73,8 +229,11 @@ static long CountButterflies(Tree *t) {
         for(int i = 0; i < numSubtrees; ++i)
         {
             long subtreeLeaves = leafSetSizes[edges[i]->GetEdgeId()];
-            butterflies += Util::Choose2(subtreeLeaves)
+            long term = Util::Choose2(subtreeLeaves)
                 * (S*S - S2 - 2*S*subtreeLeaves + 2*subtreeLeaves*subtreeLeaves);
+            butterflies += term;
+            if (edgeTerms)
+                (*edgeTerms)[edges[i]->GetEdgeId()] = term;
         }
     }
 
@@ -84,27 +243,297 @@ static long CountButterflies(Tree *t) {
 
 
 
+/*
+ * The matrix I of a node pair holding only its nonzero entries, both row by row and column
+ * by column, together with the scratch space used to build and evaluate it.
+ */
+class SparseI {
+public:
+    //entries of row i are [rowStart[i], rowStart[i+1]) in rowCols/rowVals
+    std::vector<int> rowStart;
+    std::vector<int> rowCols;
+    std::vector<long> rowVals;
+    //entries of column j are [colStart[j], colStart[j+1]) in colRows/colVals
+    std::vector<int> colStart;
+    std::vector<int> colRows;
+    std::vector<long> colVals;
+
+    std::vector<long> R, C, Rmark, Cmark, Rmarkmark, Cmarkmark, Rmarkmarkmark, Cmarkmarkmark;
+
+    std::vector<int> branchOfLeaf2;
+    std::vector<char> isInternal2;
+    std::vector<long> rowCounts;
+    std::vector<long> gram;
+    std::vector<int> touched;
+};
+
+/*
+ * Group the leaves by the subtree of iNode they are in, read off the leaf spans of its edges.
+ * The leaves of subtree i are leaves[branchStart[i]] up to leaves[branchStart[i+1]].
+ */
+static void LeavesByBranch(const LeafIntervals &intervals, InternalNode* iNode, std::vector<int> &leaves,
+                           std::vector<int> &branchStart) {
+    const std::vector<DirectedEdge*> &edges = iNode->GetEdges();
+    leaves.clear();
+    branchStart.assign(1, 0);
+    for (unsigned i = 0; i < edges.size(); i++) {
+        for (LeafNode* const* leaf = intervals.Begin(edges[i]); leaf != intervals.End(edges[i]); leaf++)
+            leaves.push_back((*leaf)->GetLeafId());
+        branchStart.push_back(leaves.size());
+    }
+}
+
+/*
+ * Count shared and different butterflies for a pair of inner nodes from the nonzero entries
+ * of I only. This gives the same result as the dense computation in Count, but in time
+ * proportional to the number of leaves and nonzero entries rather than to the size of I,
+ * which matters for nodes of very high degree.
+ */
+static void CountSparse(InternalNode* iNode1, const std::vector<int> &leaves1, const std::vector<int> &branchStart1,
+                        InternalNode* iNode2, const LeafIntervals &intervals2, long M,
+                        SparseI &S, long &tmpShared, long &tmpDiff) {
+    const std::vector<DirectedEdge*> &edges2 = iNode2->GetEdges();
+    const int rows = iNode1->GetEdges().size();
+    const int cols = edges2.size();
+
+    //the subtree of iNode2 each leaf is in
+    S.branchOfLeaf2.resize(M);
+    for (int j = 0; j < cols; j++)
+        for (LeafNode* const* leaf = intervals2.Begin(edges2[j]); leaf != intervals2.End(edges2[j]); leaf++)
+            S.branchOfLeaf2[(*leaf)->GetLeafId()] = j;
+
+    //build the rows of I, along with the row sums R and column sums C
+    S.rowStart.assign(1, 0);
+    S.rowCols.clear();
+    S.rowVals.clear();
+    S.R.assign(rows, 0);
+    S.C.assign(cols, 0);
+    S.rowCounts.assign(cols, 0);
+    for (int i = 0; i < rows; i++) {
+        S.touched.clear();
+        for (int k = branchStart1[i]; k < branchStart1[i+1]; k++) {
+            int j = S.branchOfLeaf2[leaves1[k]];
+            if (S.rowCounts[j]++ == 0)
+                S.touched.push_back(j);
+        }
+        for (unsigned t = 0; t < S.touched.size(); t++) {
+            int j = S.touched[t];
+            S.rowCols.push_back(j);
+            S.rowVals.push_back(S.rowCounts[j]);
+            S.R[i] += S.rowCounts[j];
+            S.C[j] += S.rowCounts[j];
+            S.rowCounts[j] = 0;
+        }
+        S.rowStart.push_back(S.rowCols.size());
+    }
+
+    //the same entries column by column
+    const int nonzeros = S.rowCols.size();
+    S.colStart.assign(cols + 1, 0);
+    for (int e = 0; e < nonzeros; e++)
+        S.colStart[S.rowCols[e] + 1]++;
+    for (int j = 0; j < cols; j++)
+        S.colStart[j+1] += S.colStart[j];
+    S.colRows.resize(nonzeros);
+    S.colVals.resize(nonzeros);
+    S.touched.assign(S.colStart.begin(), S.colStart.end() - 1);
+    for (int i = 0; i < rows; i++)
+        for (int e = S.rowStart[i]; e < S.rowStart[i+1]; e++) {
+            int pos = S.touched[S.rowCols[e]]++;
+            S.colRows[pos] = i;
+            S.colVals[pos] = S.rowVals[e];
+        }
+
+    //R', C', M', R'', C'', R''' and C''' only get contributions from nonzero entries
+    S.Rmark.assign(rows, 0);
+    S.Cmark.assign(cols, 0);
+    S.Rmarkmark.assign(rows, 0);
+    S.Cmarkmark.assign(cols, 0);
+    S.Rmarkmarkmark.assign(rows, 0);
+    S.Cmarkmarkmark.assign(cols, 0);
+    long Mmark = 0;
+    for (int i = 0; i < rows; i++)
+        for (int e = S.rowStart[i]; e < S.rowStart[i+1]; e++) {
+            int j = S.rowCols[e];
+            long Iij = S.rowVals[e];
+            long tmp = Iij * (M - S.R[i] - S.C[j] + Iij);
+            S.Rmark[i] += tmp;
+            S.Cmark[j] += tmp;
+            Mmark += tmp;
+            S.Rmarkmark[i] += Iij * (S.C[j] - Iij);
+            S.Cmarkmark[j] += Iij * (S.R[i] - Iij);
+            S.Rmarkmarkmark[i] += Iij * Iij;
+            S.Cmarkmarkmark[j] += Iij * Iij;
+        }
+
+    S.isInternal2.assign(cols, 0);
+    const std::vector<unsigned> &iEdgesIdxs2 = iNode2->GetInternalEdgesIdxs();
+    for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++)
+        S.isInternal2[iEdgesIdxs2[tj]] = 1;
+
+    S.gram.assign(rows, 0);
+
+    //both counts only get contributions from nonzero entries of I between internal edges
+    const std::vector<unsigned> &iEdgesIdxs1 = iNode1->GetInternalEdgesIdxs();
+    for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
+        int i = iEdgesIdxs1[ti];
+
+        bool gramComputed = false;
+
+        for (int e = S.rowStart[i]; e < S.rowStart[i+1]; e++) {
+            int j = S.rowCols[e];
+            if (!S.isInternal2[j])
+                continue;
+
+            long Iij = S.rowVals[e];
+            long Ri = S.R[i];
+            long Cj = S.C[j];
+
+            if (Iij >= 2) {
+                long Imark = Iij * (M - Ri - Cj + Iij);
+                tmpShared += Util::Choose2(Iij) *
+                    (Mmark - S.Rmark[i] - S.Cmark[j] + Imark
+                     + (Iij - Ri - Cj) * (M - Ri - Cj + Iij)
+                     + S.Rmarkmark[i] - Iij * (Cj - Iij)
+                     + S.Cmarkmark[j] - Iij * (Ri - Iij));
+            }
+
+            //row i of I*I^T, needed for entry (i,j) of I*I^T*I
+            if (!gramComputed) {
+                S.touched.clear();
+                for (int f = S.rowStart[i]; f < S.rowStart[i+1]; f++) {
+                    int l = S.rowCols[f];
+                    long Iil = S.rowVals[f];
+                    for (int g = S.colStart[l]; g < S.colStart[l+1]; g++) {
+                        int k = S.colRows[g];
+                        if (S.gram[k] == 0)
+                            S.touched.push_back(k);
+                        S.gram[k] += Iil * S.colVals[g];
+                    }
+                }
+                gramComputed = true;
+            }
+
+            long IItI = 0;
+            for (int g = S.colStart[j]; g < S.colStart[j+1]; g++)
+                IItI += S.gram[S.colRows[g]] * S.colVals[g];
+
+            tmpDiff += Iij * ((M - Ri - Cj + Iij) * (Ri - Iij) * (Cj - Iij)
+                              + (Ri - Iij) * (Iij * (Ri - Iij) - S.Cmarkmark[j])
+                              + (Cj - Iij) * (Iij * (Cj - Iij) - S.Rmarkmark[i])
+                              + IItI - Iij * S.Rmarkmarkmark[i] - Iij * (S.Cmarkmarkmark[j] - Iij * Iij));
+        }
+
+        if (gramComputed)
+            for (unsigned t = 0; t < S.touched.size(); t++)
+                S.gram[S.touched[t]] = 0;
+    }
+}
+
+/*
+ * For each internal node of a tree, the index in its edge list of the edge pointing towards
+ * the root, or -1 for the root.
+ */
+static std::vector<int> RootwardEdgeIdxs(Tree* t) {
+    std::vector<char> pointsDown(t->NumEdges(), 0);
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(t);
+    for (unsigned k = 0; k < downEdges.size(); k++)
+        pointsDown[downEdges[k]->GetEdgeId()] = 1;
+
+    std::vector<int> rootward(t->NumInternalNodes(), -1);
+    for (int n = 0; n < t->NumInternalNodes(); n++) {
+        const std::vector<DirectedEdge*> &edges = t->GetInternalNode(n)->GetEdges();
+        for (unsigned i = 0; i < edges.size(); i++)
+            if (pointsDown[edges[i]->GetBackEdge()->GetEdgeId()])
+                rootward[n] = i;
+    }
+    return rootward;
+}
+
+/*
+ * Whether a pair of inner nodes provably adds no butterflies, checked before I is built.
+ *
+ * That is the case if a subtree u of iNode1 and a subtree v of iNode2 hold all the leaves
+ * between them, i.e. if |u| + |v| - I(u,v) is the number of leaves. Every leaf outside u is
+ * then in v and every leaf outside v is in u, so the nonzero entries of I lie in row u and
+ * column v. A butterfly needs two of its leaves in rows other than that of the other two,
+ * and in columns other than theirs, which no four leaves of such an I are.
+ *
+ * Only the pairs with u or v the subtree pointing towards the root are tried. They cover the
+ * nodes whose clades are disjoint or nested in a single subtree of the other node, which is
+ * most pairs of nodes in trees that are alike, with numSubtrees1 + numSubtrees2 lookups.
+ */
+template<typename Size>
+static bool ContributesNothing(const std::vector<DirectedEdge*> &edges1, int rootward1, const std::vector<int> &sizes1,
+                               const std::vector<DirectedEdge*> &edges2, int rootward2, const std::vector<int> &sizes2,
+                               SharedLeafSetTable<Size> &sharedLeafSetSizes, long numLeaves) {
+    if (rootward2 != -1) {
+        int v = edges2[rootward2]->GetEdgeId();
+        for (unsigned i = 0; i < edges1.size(); i++) {
+            int u = edges1[i]->GetEdgeId();
+            if (sizes1[u] + sizes2[v] - long(sharedLeafSetSizes[u][v]) == numLeaves)
+                return true;
+        }
+    }
+    if (rootward1 != -1) {
+        int u = edges1[rootward1]->GetEdgeId();
+        for (unsigned j = 0; j < edges2.size(); j++) {
+            int v = edges2[j]->GetEdgeId();
+            if (sizes1[u] + sizes2[v] - long(sharedLeafSetSizes[u][v]) == numLeaves)
+                return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Save the sums of Count() over the internal nodes of t1 before nextNode.
+ */
+static void SaveCountCheckpoint(Checkpoint* checkpoint, int nextNode, long sharedButterflies,
+                                long differentButterflies, std::vector<long> *sharedEdgeTerms,
+                                std::vector<long> *leafWeights) {
+    checkpoint->Set("node", nextNode);
+    checkpoint->Set("shared", sharedButterflies);
+    checkpoint->Set("diff", differentButterflies);
+    if (leafWeights != NULL) {
+        checkpoint->Set("edgeTerms", *sharedEdgeTerms);
+        checkpoint->Set("leafWeights", *leafWeights);
+    }
+    checkpoint->Save();
+}
+
 /*
  * Calculates either shared butterflies or both shared and different butterflies.
+ *
+ * If sharedEdgeTerms and leafWeights are given, they receive the breakdown: for each edge of
+ * t1 its contribution to the shared butterfly sum, i.e. four times the number of shared
+ * butterflies anchored at the edge, and for each leaf x the value -4*shared_B(x) - 2*diff_B(x),
+ * where shared_B(x) and diff_B(x) count the shared and different butterflies containing x.
+ *
+ * Size is the type of the entries of the shared leaf set size table.
  */
-static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
+template<typename Size>
+static void Count(Tree* t1, Tree* t2, long &shared, long &diff, const QDistOptions &options,
+                  std::vector<long> *sharedEdgeTerms, std::vector<long> *leafWeights) {
 
     //find shared leaf set sizes
-    std::vector< std::vector<int> > sharedLeafSetSizes = TreeUtil::CalcSharedLeafSetSizes(t1, t2);
+    SharedLeafSetTable<Size> sharedLeafSetSizes(t1, t2, options.sharedLeafSetTableDirectory);
+    TreeUtil::CalcSharedLeafSetSizes(t1, t2, &sharedLeafSetSizes, options.sharedLeafSetEngine);
+    sharedLeafSetSizes.BeginScan();
 
     //shared_B(T,T')
-    double sharedButterflies = 0;
+    long sharedButterflies = 0;
     //diff_B(T,T')
-    double differentButterflies = 0;
+    long differentButterflies = 0;
 
 
 
-    Matrix<double> I;
+    Matrix<long> I;
     Matrix<long> Imark;
-    Matrix<double> I1markmark;
-    Matrix<double> I1markmarkmark;
-    Matrix<double> I2markmark;
-    Matrix<double> I2markmarkmark;
+    Matrix<long> Irows;
+    Matrix<long> IcolsT;
+    Matrix<long> Ipartial;
+    Matrix<long> Itriple;
     std::vector<long> R;
     std::vector<long> C;
     std::vector<long> Rmark;
@@ -114,10 +543,58 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
     std::vector<long> Cmarkmarkmark;
     std::vector<long> Rmarkmarkmark;
 
+    //sparse handling of I for nodes of high degree
+    const long numLeaves = t1->NumLeafNodes();
+    SparseI sparseI;
+    //the leaf spans of both trees, built when the first pair is counted sparsely
+    LeafIntervals* t1Intervals = NULL;
+    LeafIntervals* t2Intervals = NULL;
+    std::vector<int> leaves1;
+    std::vector<int> branchStart1;
+
+    //pairs of nodes that provably add nothing are skipped, see ContributesNothing
+    const std::vector<int> sizes1 = TreeUtil::SubtreeLeafSetSizes(t1);
+    const std::vector<int> sizes2 = TreeUtil::SubtreeLeafSetSizes(t2);
+    const std::vector<int> rootward1 = RootwardEdgeIdxs(t1);
+    const std::vector<int> rootward2 = RootwardEdgeIdxs(t2);
+    long nodePairs = 0;
+    long prunedPairs = 0;
+
+    //the breakdown. Contributions to leafWeights are collected per edge pair in rowWeights,
+    //one row per internal edge of the current t1 node, and spread out over the leaves
+    //shared by the two edges once the node is done.
+    const bool breakdown = leafWeights != NULL;
+    const int numEdges2 = t2->NumEdges();
+    EdgeSumsOverLeaves* t2Sums = NULL;
+    std::vector<long> rowWeights;
+    std::vector<long> rowSums;
+    if (breakdown) {
+        sharedEdgeTerms->assign(t1->NumEdges(), 0);
+        leafWeights->assign(numLeaves, 0);
+        t2Sums = new EdgeSumsOverLeaves(t2);
+        t1Intervals = new LeafIntervals(t1);
+    }
 
+    //continue from the sums saved after some of the nodes of t1
+    int firstNode = 0;
+    Checkpoint* checkpoint = NULL;
+    if (!options.checkpointFilename.empty()) {
+        uint64_t fingerprint = Util::MixHash(TreeUtil::Fingerprint(t1)) ^ TreeUtil::Fingerprint(t2) ^ breakdown;
+        checkpoint = new Checkpoint(options.checkpointFilename, fingerprint, options.checkpointInterval);
+        if (options.resume && checkpoint->Load()) {
+            firstNode = checkpoint->Get("node");
+            sharedButterflies = checkpoint->Get("shared");
+            differentButterflies = checkpoint->Get("diff");
+            if (breakdown) {
+                *sharedEdgeTerms = checkpoint->GetList("edgeTerms");
+                *leafWeights = checkpoint->GetList("leafWeights");
+            }
+        }
+    }
+    Progress* progress = options.progress ? new Progress("qdist nodes", t1->NumInternalNodes(), firstNode) : NULL;
 
     //count for every pair of inner nodes
-    for (int n1i = 0; n1i < t1->NumInternalNodes(); n1i++) {
+    for (int n1i = firstNode; n1i < t1->NumInternalNodes(); n1i++) {
         InternalNode* iNode1 = t1->GetInternalNode(n1i);
         const std::vector<DirectedEdge*> &edges1 = iNode1->GetEdges();
         const int numSubtrees1 = edges1.size();
@@ -127,6 +604,15 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
 
         const std::vector<unsigned> &iEdgesIdxs1 = iNode1->GetInternalEdgesIdxs();
 
+        //read ahead the rows of the table for the next node
+        if (n1i + 1 < t1->NumInternalNodes())
+            sharedLeafSetSizes.WillNeed(t1->GetInternalNode(n1i + 1));
+
+        bool leavesGrouped = false;
+
+        if (breakdown)
+            rowWeights.assign(iEdgesIdxs1.size() * numEdges2, 0);
+
 
 
         for (int n2i = 0; n2i < t2->NumInternalNodes(); n2i++) {
@@ -139,6 +625,34 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
 
             const std::vector<unsigned> &iEdgesIdxs2 = iNode2->GetInternalEdgesIdxs();
 
+            nodePairs++;
+            if (ContributesNothing(edges1, rootward1[n1i], sizes1, edges2, rootward2[n2i], sizes2,
+                                   sharedLeafSetSizes, numLeaves)) {
+                prunedPairs++;
+                continue;
+            }
+
+            //I is mostly zero for nodes of high degree, so count from its nonzero entries
+            if (!breakdown
+                && std::max(numSubtrees1, numSubtrees2) >= options.sparseDegreeThreshold
+                && long(numSubtrees1) * numSubtrees2 >= options.sparseMinEntriesPerLeaf * numLeaves) {
+                if (t2Intervals == NULL) {
+                    t2Intervals = new LeafIntervals(t2);
+                    if (t1Intervals == NULL)
+                        t1Intervals = new LeafIntervals(t1);
+                }
+                if (!leavesGrouped) {
+                    LeavesByBranch(*t1Intervals, iNode1, leaves1, branchStart1);
+                    leavesGrouped = true;
+                }
+                long tmpShared = 0;
+                long tmpDiff = 0;
+                CountSparse(iNode1, leaves1, branchStart1, iNode2, *t2Intervals, numLeaves, sparseI, tmpShared, tmpDiff);
+                sharedButterflies += tmpShared;
+                differentButterflies += tmpDiff;
+                continue;
+            }
+
 
             //matrix containing shared leaf set sizes for subtrees associated with the two inner nodes
             I.resize(numSubtrees1, numSubtrees2);
@@ -163,24 +677,12 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
                     M += numSharedLeaves;
                 }
 
-            //I'
-            Imark.resize(numSubtrees1, numSubtrees2);
-            //R'
-            Rmark.clear();
-            Rmark.resize(numSubtrees1, 0);
-            //C'
-            Cmark.clear();
-            Cmark.resize(numSubtrees2, 0);
-            long Mmark = 0;
-
-            for (i = 0; i < numSubtrees1; i++)
-                for (j = 0; j < numSubtrees2; j++) {
-                    long tmp = long(I(i,j)) * (M - R[i] - C[j] + long(I(i,j)));
-                    Imark(i, j) = tmp;
-                    Rmark[i] += tmp;
-                    Cmark[j] += tmp;
-                    Mmark += tmp;
-                }
+            //shared butterflies need an entry of at least 2 at a pair of internal edges, and
+            //I', R' and C' are only used to count them
+            bool sharesPairs = false;
+            for (unsigned ti = 0; ti < iEdgesIdxs1.size() && !sharesPairs; ti++)
+                for (unsigned tj = 0; tj < iEdgesIdxs2.size() && !sharesPairs; tj++)
+                    sharesPairs = I(iEdgesIdxs1[ti], iEdgesIdxs2[tj]) >= 2;
 
             //R''
             Rmarkmark.resize(numSubtrees1);
@@ -203,20 +705,48 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
             //count shared butterflies for this pair of inner nodes
             long tmpShared = 0;
 
-            //that means for all pairs of edges going to the inner nodes
-            for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
-                i = iEdgesIdxs1[ti];
+            if (sharesPairs) {
+                //I'
+                Imark.resize(numSubtrees1, numSubtrees2);
+                //R'
+                Rmark.clear();
+                Rmark.resize(numSubtrees1, 0);
+                //C'
+                Cmark.clear();
+                Cmark.resize(numSubtrees2, 0);
+                long Mmark = 0;
 
-                for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++) {
-                    j = iEdgesIdxs2[tj];
+                for (i = 0; i < numSubtrees1; i++)
+                    for (j = 0; j < numSubtrees2; j++) {
+                        long tmp = long(I(i,j)) * (M - R[i] - C[j] + long(I(i,j)));
+                        Imark(i, j) = tmp;
+                        Rmark[i] += tmp;
+                        Cmark[j] += tmp;
+                        Mmark += tmp;
+                    }
+
+                //that means for all pairs of edges going to the inner nodes
+                for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
+                    i = iEdgesIdxs1[ti];
+
+                    for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++) {
+                        j = iEdgesIdxs2[tj];
 
-                    if (I(i,j) >= 2) {
-                        long tmp = Util::Choose2(long(I(i,j))) *
-                            (Mmark - Rmark[i] - Cmark[j] + Imark(i,j)
-                             + (long(I(i,j)) - R[i] - C[j]) * (M - R[i] - C[j] + long(I(i,j)))
-                             + Rmarkmark[i] - long(I(i,j)) * (C[j] - long(I(i,j))) 
-                             + Cmarkmark[j] - long(I(i,j)) * (R[i] - long(I(i,j))));
-                        tmpShared += tmp;
+                        if (I(i,j) >= 2) {
+                            //the number of ways to pick the other pair of the butterfly
+                            long otherPairs = Mmark - Rmark[i] - Cmark[j] + Imark(i,j)
+                                 + (long(I(i,j)) - R[i] - C[j]) * (M - R[i] - C[j] + long(I(i,j)))
+                                 + Rmarkmark[i] - long(I(i,j)) * (C[j] - long(I(i,j))) 
+                                 + Cmarkmark[j] - long(I(i,j)) * (R[i] - long(I(i,j)));
+                            long tmp = Util::Choose2(long(I(i,j))) * otherPairs;
+                            tmpShared += tmp;
+
+                            if (breakdown) {
+                                //each shared leaf is in I(i,j)-1 of the pairs
+                                rowWeights[ti * numEdges2 + edges2[j]->GetEdgeId()] -= 2 * (long(I(i,j)) - 1) * otherPairs;
+                                (*sharedEdgeTerms)[edges1[i]->GetEdgeId()] += tmp;
+                            }
+                        }
                     }
                 }
             }
@@ -229,103 +759,255 @@ static void Count(Tree* t1, Tree* t2, long &shared, long &diff) {
             //THIS PART FOR DIFF BUTTS
             ////////////////////////////
                 
-            //number of rows and columns in I
-            int rows = numSubtrees1;
-            int cols = numSubtrees2;
-
             //count different butterflies for this pair of inner nodes
             long tmpDiff = 0;
 
-
-            //there are two ways to calculate and it depends on the shape of I
-            //SOLUTION 1: if I is wide and low
-            if (rows < cols) {
-
-                //C'''
-                Cmarkmarkmark.resize(numSubtrees2);
+            //R''' and C'''
+            Rmarkmarkmark.assign(numSubtrees1, 0);
+            Cmarkmarkmark.assign(numSubtrees2, 0);
+            for (i = 0; i < numSubtrees1; i++)
                 for (j = 0; j < numSubtrees2; j++) {
-                    long sum = 0;
-                    for (i = 0; i < numSubtrees1; i++)
-                        sum += long(I(i,j) * I(i,j));
-                    Cmarkmarkmark[j] = sum;
+                    Rmarkmarkmark[i] += long(I(i,j) * I(i,j));
+                    Cmarkmarkmark[j] += long(I(i,j) * I(i,j));
                 }
 
-                //I1'''
-                I1markmark.resize(numSubtrees1, numSubtrees1);
-                Matrix<double>::Mult(I, Matrix<double>::NO_TRANSPOSE,
-                                     I, Matrix<double>::TRANSPOSE,
-                                     I1markmark);
-                I1markmarkmark.resize(numSubtrees1, numSubtrees2);
-                Matrix<double>::Mult(I1markmark, I, I1markmarkmark);
+            //I*I^T*I is only needed at the internal edges of both nodes, which are usually
+            //few at a polytomy, so only those rows and columns of the products are computed.
+            //Irows holds the rows of I at the internal edges of iNode1, and IcolsT the
+            //columns at those of iNode2.
+            const int internal1 = iEdgesIdxs1.size();
+            const int internal2 = iEdgesIdxs2.size();
+            Irows.resize(internal1, numSubtrees2);
+            for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++)
+                for (j = 0; j < numSubtrees2; j++)
+                    Irows(ti, j) = I(iEdgesIdxs1[ti], j);
+            IcolsT.resize(internal2, numSubtrees1);
+            for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++)
+                for (i = 0; i < numSubtrees1; i++)
+                    IcolsT(tj, i) = I(i, iEdgesIdxs2[tj]);
+
+            //there are two ways to calculate, and the cheaper depends on the shape of I and
+            //the numbers of internal edges
+            long multAdds1 = long(internal1) * numSubtrees1 * numSubtrees2 + long(internal1) * internal2 * numSubtrees1;
+            long multAdds2 = long(internal2) * numSubtrees1 * numSubtrees2 + long(internal1) * internal2 * numSubtrees2;
+            Itriple.resize(internal1, internal2);
+            if (multAdds1 <= multAdds2) {
+                //the rows of I*I^T, times the columns of I
+                Ipartial.resize(internal1, numSubtrees1);
+                Matrix<long>::Mult(Irows, Matrix<long>::NO_TRANSPOSE,
+                                   I, Matrix<long>::TRANSPOSE,
+                                   Ipartial);
+                Matrix<long>::Mult(Ipartial, Matrix<long>::NO_TRANSPOSE,
+                                   IcolsT, Matrix<long>::TRANSPOSE,
+                                   Itriple);
+            }
+            else {
+                //the rows of I, times the columns of I^T*I
+                Ipartial.resize(internal2, numSubtrees2);
+                Matrix<long>::Mult(IcolsT, Matrix<long>::NO_TRANSPOSE,
+                                   I, Matrix<long>::NO_TRANSPOSE,
+                                   Ipartial);
+                Matrix<long>::Mult(Irows, Matrix<long>::NO_TRANSPOSE,
+                                   Ipartial, Matrix<long>::TRANSPOSE,
+                                   Itriple);
+            }
 
+            //count different butterflies for this pair of inner nodes
+            //that means for all pairs of edges going to the inner nodes
+            for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
+                i = iEdgesIdxs1[ti];
 
-                //count different butterflies for this pair of inner nodes
-                //that means for all pairs of edges going to the inner nodes
-                for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
-                    i = iEdgesIdxs1[ti];
+                for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++) {
+                    j = iEdgesIdxs2[tj];
 
-                    for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++) {
-                        j = iEdgesIdxs2[tj];
+                    //the number of different butterflies for each shared leaf
+                    long perLeaf = (M - R[i] - C[j] + long(I(i,j))) * (R[i] - long(I(i,j))) * (C[j] - long(I(i,j)))
+                                   + (R[i] - long(I(i,j))) * (long(I(i,j)) * (R[i] - long(I(i,j))) - Cmarkmark[j])
+                                   + (C[j] - long(I(i,j))) * (long(I(i,j)) * (C[j] - long(I(i,j))) - Rmarkmark[i])
+                                   + long(Itriple(ti,tj)) - long(I(i,j)) * (Rmarkmarkmark[i] + Cmarkmarkmark[j] - long(I(i,j) * I(i,j)));
+                    long tmp = long(I(i,j)) * perLeaf;
 
-                        long tmp = long(I(i,j)) * ((M - R[i] - C[j] + long(I(i,j))) * (R[i] - long(I(i,j))) * (C[j] - long(I(i,j))) 
-                                                   + (R[i] - long(I(i,j))) * (long(I(i,j)) * (R[i] - long(I(i,j))) - Cmarkmark[j])
-                                                   + (C[j] - long(I(i,j))) * (long(I(i,j)) * (C[j] - long(I(i,j))) - Rmarkmark[i])
-                                                   + long(I1markmarkmark(i,j)) - long(I(i,j)) * long(I1markmark(i,i)) - long(I(i,j)) * (Cmarkmarkmark[j] - long(I(i,j) * I(i,j))));
+                    tmpDiff += tmp;
 
-                        tmpDiff += tmp;
+                    if (breakdown && I(i,j) != 0)
+                        rowWeights[ti * numEdges2 + edges2[j]->GetEdgeId()] -= 2 * perLeaf;
 
-                    }
                 }
             }
 
-            //SOLUTION 1: if I is wide and low
-            else {
+            //add contribution to overall count
+            differentButterflies += tmpDiff;
+        }
 
-                //R'''
-                Rmarkmarkmark.resize(numSubtrees1);
-                for (i = 0; i < numSubtrees1; i++) {
-                    long sum = 0;
-                    for (j = 0; j < numSubtrees2; j++)
-                        sum += long(I(i,j) * I(i,j));
-                    Rmarkmarkmark[i] = sum;
+        //every leaf shared by a subtree of iNode1 and a subtree of some t2 node gets the
+        //weight of the edge pair
+        if (breakdown) {
+            std::vector<long> row(numEdges2);
+            for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
+                std::copy(rowWeights.begin() + ti * numEdges2, rowWeights.begin() + (ti + 1) * numEdges2, row.begin());
+                rowSums.assign(numLeaves, 0);
+                t2Sums->Add(row, rowSums);
+
+                DirectedEdge* edge1 = edges1[iEdgesIdxs1[ti]];
+                for (LeafNode* const* leaf = t1Intervals->Begin(edge1); leaf != t1Intervals->End(edge1); leaf++) {
+                    int leafId = (*leaf)->GetLeafId();
+                    (*leafWeights)[leafId] += rowSums[leafId];
                 }
+            }
+        }
 
-                //I2'''
-                I2markmark.resize(numSubtrees2, numSubtrees2);
-                Matrix<double>::Mult(I, Matrix<double>::TRANSPOSE,
-                                     I, Matrix<double>::NO_TRANSPOSE,
-                                     I2markmark);
-                I2markmarkmark.resize(numSubtrees1, numSubtrees2);
-                Matrix<double>::Mult(I, I2markmark, I2markmarkmark);
+        sharedLeafSetSizes.DontNeed(iNode1);
 
-                //count different butterflies for this pair of inner nodes
-                //that means for all pairs of edges going to the inner nodes
-                for (unsigned ti = 0; ti < iEdgesIdxs1.size(); ti++) {
-                    i = iEdgesIdxs1[ti];
+        if (progress)
+            progress->Update(n1i + 1);
+        if (checkpoint && checkpoint->Due())
+            SaveCountCheckpoint(checkpoint, n1i + 1, sharedButterflies, differentButterflies,
+                                sharedEdgeTerms, leafWeights);
+    }
 
-                    for (unsigned tj = 0; tj < iEdgesIdxs2.size(); tj++) {
-                        j = iEdgesIdxs2[tj];
+    if (checkpoint)
+        SaveCountCheckpoint(checkpoint, t1->NumInternalNodes(), sharedButterflies, differentButterflies,
+                            sharedEdgeTerms, leafWeights);
+    if (progress) {
+        progress->Finish();
+        std::cerr << "qdist skipped " << prunedPairs << " of " << nodePairs
+                  << " node pairs that add no butterflies" << std::endl;
+    }
+    if (options.prunedPairs)
+        *options.prunedPairs = prunedPairs;
+
+    delete checkpoint;
+    delete progress;
+    delete t2Sums;
+    delete t1Intervals;
+    delete t2Intervals;
 
-                        long tmp = long(I(i,j)) * ((M - R[i] - C[j] + long(I(i,j))) * (R[i] - long(I(i,j))) * (C[j] - long(I(i,j)))
-                                                   + (R[i] - long(I(i,j))) * (long(I(i,j)) * (R[i] - long(I(i,j))) - Cmarkmark[j])
-                                                   + (C[j] - long(I(i,j))) * (long(I(i,j)) * (C[j] - long(I(i,j))) - Rmarkmark[i])
-                                                   + long(I2markmarkmark(i,j)) - long(I(i,j)) * long(I2markmark(j,j)) - long(I(i,j)) * (Rmarkmarkmark[i] - long(I(i,j) * I(i,j))));
+    //make the result permanent
+    //divide shared butterflies by four because of symmetry.
+    shared = sharedButterflies / 4;
+    //divide different butterflies by four because of multiple pairs of edges
+    diff = differentButterflies / 4;
+}
 
-                        tmpDiff += tmp;
 
+
+
+////////////////////////////////////////////////////////////////////////////////////////////
+// The brute-force quartic algorithm for quartet distance
+//
+// Enumerates every quartet and compares its induced topology in the two trees.
+// Far too slow for real use, but simple enough to serve as a reference for
+// validating the faster algorithms.
+////////////////////////////////////////////////////////////////////////////////////////////
+
+QuartetTopologies::QuartetTopologies(Tree* t)
+    : n(t->NumLeafNodes()),
+      centers((long)n * n * n, -1),
+      edgesTowards((long)n * n * n, -1)
+{
+    //the center of a, b and c is the node where c joins the path between a and b
+    std::vector<int> joins(n, -1);
+    std::vector<int> joinEdges(n, -1);
+    for (int a = 0; a < n; a++)
+        for (int b = a + 1; b < n; b++) {
+            Path* path = TreeUtil::FindPath(t->GetLeafNode(a), t->GetLeafNode(b));
+            const std::vector<DirectedEdge*> &edges = path->GetEdges();
+            for (unsigned i = 0; i + 1 < edges.size(); i++) {
+                InternalNode* node = (InternalNode*)edges[i]->GetToNode();
+                for (unsigned j = 0; j < node->GetEdges().size(); j++) {
+                    DirectedEdge* edge = node->GetEdges()[j];
+                    if (edge == edges[i]->GetBackEdge() || edge == edges[i + 1])
+                        continue;
+                    std::vector<LeafNode*> leaves = TreeUtil::CollectLeavesInSubtree(edge);
+                    for (unsigned l = 0; l < leaves.size(); l++) {
+                        joins[leaves[l]->GetLeafId()] = node->GetInternalId();
+                        joinEdges[leaves[l]->GetLeafId()] = edge->GetEdgeId();
                     }
                 }
             }
+            delete path;
 
-            //add contribution to overall count
-            differentButterflies += tmpDiff;
+            for (int c = 0; c < n; c++) {
+                centers[((long)a * n + b) * n + c] = joins[c];
+                edgesTowards[((long)a * n + b) * n + c] = joinEdges[c];
+            }
         }
-    }
+}
 
-    //make the result permanent
-    //divide shared butterflies by four because of symmetry.
-    shared = long(sharedButterflies / 4.0);
-    //divide different butterflies by four because of multiple pairs of edges
-    diff = long(differentButterflies / 4.0);
+int QuartetTopologies::EdgeTowards(int a, int b, int c) const {
+    return edgesTowards[((long)a * n + b) * n + c];
+}
+
+int QuartetTopologies::Topology(int a, int b, int c, int d) const {
+    int abc = centers[((long)a * n + b) * n + c];
+    int abd = centers[((long)a * n + b) * n + d];
+    int acd = centers[((long)a * n + c) * n + d];
+    int bcd = centers[((long)b * n + c) * n + d];
+
+    //the two pairs of a butterfly join the path between the other pair at the same node
+    if (abc == abd && abc != acd)
+        return 1;
+    if (abc == acd && abc != abd)
+        return 2;
+    if (abc == bcd && abc != abd)
+        return 3;
+    return 0;
 }
 
+long QuarticQDist(Tree* t1, Tree* t2, long &b1, long &b2, long &shared, long &diff,
+                  QDistBreakdown* breakdown) {
+    const int n = t1->NumLeafNodes();
+
+    QuartetTopologies topologies1(t1);
+    QuartetTopologies topologies2(t2);
+
+    b1 = 0;
+    b2 = 0;
+    shared = 0;
+    diff = 0;
+
+    if (breakdown) {
+        breakdown->leafQuartets.assign(n, 0);
+        breakdown->edgeQuartets.assign(t1->NumEdges(), 0);
+    }
+
+    for (int a = 0; a < n; a++)
+        for (int b = a + 1; b < n; b++)
+            for (int c = b + 1; c < n; c++)
+                for (int d = c + 1; d < n; d++) {
+                    int top1 = topologies1.Topology(a, b, c, d);
+                    int top2 = topologies2.Topology(a, b, c, d);
+
+                    if (top1 != 0)
+                        b1++;
+                    if (top2 != 0)
+                        b2++;
+                    if (top1 != 0 && top2 != 0) {
+                        if (top1 == top2)
+                            shared++;
+                        else
+                            diff++;
+                    }
+
+                    if (breakdown && top1 != top2) {
+                        breakdown->leafQuartets[a]++;
+                        breakdown->leafQuartets[b]++;
+                        breakdown->leafQuartets[c]++;
+                        breakdown->leafQuartets[d]++;
+
+                        if (top1 != 0) {
+                            //the pairs p1 p2 | q1 q2 of the butterfly in t1
+                            int p1 = a;
+                            int p2 = top1 == 1 ? b : (top1 == 2 ? c : d);
+                            int q1 = top1 == 1 ? c : b;
+                            int q2 = top1 == 3 ? c : d;
+
+                            //the edges pointing from the center of each pair towards the other pair
+                            breakdown->edgeQuartets[topologies1.EdgeTowards(q1, q2, p1)]++;
+                            breakdown->edgeQuartets[topologies1.EdgeTowards(p1, p2, q1)]++;
+                        }
+                    }
+                }
+
+    return b1 + b2 - 2*shared - diff;
+}
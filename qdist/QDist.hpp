@@ -2,10 +2,132 @@
 #define QDIST_H
 
 #include "Tree.hpp"
+#include "TreeUtil.hpp"
+
+#include <ostream>
+#include <string>
+#include <vector>
+
+/*
+ * Breakdown of the quartet distance by leaf and by edge of t1, filled in by SubCubicQDist
+ * when requested through QDistOptions::breakdown.
+ */
+class QDistBreakdown {
+public:
+    // For each leaf id, the number of quartets containing the leaf that have different
+    // topologies in the two trees.
+    std::vector<long> leafQuartets;
+
+    // For each edge id of t1, the number of butterflies of t1 anchored at the edge that do not
+    // have the same topology in t2. A butterfly ab|cd is anchored at the two ends of the path
+    // between its pairs: at the edge pointing from the center of c,d towards a and b, and at
+    // the edge pointing from the center of a,b towards c and d.
+    std::vector<long> edgeQuartets;
+
+    // Write the breakdown of t1 as TSV, a line per leaf and a line per non-trivial split of
+    // t1, in an order that does not depend on how t1 is rooted or numbered
+    void Write(std::ostream &out, Tree* t1) const;
+};
+
+/*
+ * Tuning parameters for SubCubicQDist. The defaults are the ones used by qdist.
+ */
+class QDistOptions {
+public:
+    QDistOptions()
+        : sparseDegreeThreshold(64),
+          sparseMinEntriesPerLeaf(16),
+          sharedLeafSetEngine(TreeUtil::BITSET_ENGINE),
+          sharedLeafSetTableDirectory(),
+          narrowSharedLeafSetTable(true),
+          breakdown(NULL),
+          checkpointFilename(),
+          checkpointInterval(60),
+          resume(false),
+          progress(false),
+          prunedPairs(NULL)
+    {}
+
+    // Node pairs where one of the nodes has at least sparseDegreeThreshold subtrees, and where
+    // I has at least sparseMinEntriesPerLeaf entries per leaf, are counted from a sparse
+    // representation of I. Building it takes time linear in the number of leaves, so it only
+    // pays off when the dense I is much larger than that.
+    int sparseDegreeThreshold;
+    long sparseMinEntriesPerLeaf;
+
+    // How the table of shared leaf set sizes is computed.
+    TreeUtil::SharedLeafSetEngine sharedLeafSetEngine;
+
+    // If not empty, the table of shared leaf set sizes is kept in a memory-mapped file in this
+    // directory rather than in memory, for comparisons where it does not fit in memory.
+    std::string sharedLeafSetTableDirectory;
+
+    // Whether the table of shared leaf set sizes uses 16-bit entries when there are few
+    // enough leaves. Otherwise it uses 32-bit entries.
+    bool narrowSharedLeafSetTable;
+
+    // If set, the per-leaf and per-edge breakdown is accumulated here in the same pass. Node
+    // pairs are then always counted from the dense I.
+    QDistBreakdown* breakdown;
+
+    // If not empty, the partial sums of the count are saved to this file every
+    // checkpointInterval seconds, after the internal node of t1 that is being counted, and
+    // when the count is done. See Checkpoint.hpp.
+    std::string checkpointFilename;
+    int checkpointInterval;
+
+    // Whether to continue from the sums saved in checkpointFilename, if the file exists. It
+    // must have been saved for the same two trees, numbered the same way.
+    bool resume;
+
+    // Whether to report the progress over the internal nodes of t1 on stderr.
+    bool progress;
+
+    // If set, receives the number of pairs of inner nodes that were skipped because they
+    // provably add no butterflies, without building their I. With progress, the number is
+    // reported on stderr as well.
+    long* prunedPairs;
+};
 
 long SubCubicQDist(Tree* t1, Tree* t2, 
                    long &b1, long &b2,
                    long &shared_butterflies,
-                   long &diff_butterflies);
+                   long &diff_butterflies,
+                   const QDistOptions &options = QDistOptions());
+
+// The number of butterfly quartets of a tree, B in SubCubicQDist
+long NumButterflies(Tree* t);
+
+/*
+ * The topologies a tree induces on its quartets, found by brute force from the centers of
+ * its triplets. The center of a, b and c is where c joins the path between a and b, found by
+ * TreeUtil::FindPath and CollectLeavesInSubtree, plain traversals that use no LcaIndex, so
+ * this is independent of the indexes behind the faster algorithms. QuarticQDist takes its
+ * topologies and breakdown edges from here, and faster quartet queries are checked against
+ * it. Takes time and space cubic in the number of leaves.
+ */
+class QuartetTopologies {
+public:
+    QuartetTopologies(Tree* t);
+
+    // For leaf ids a < b < c < d, 1 for ab|cd, 2 for ac|bd, 3 for ad|bc and 0 for a star
+    int Topology(int a, int b, int c, int d) const;
+
+    // For leaf ids a < b and a third leaf c, the id of the edge from the center of the
+    // triplet towards c
+    int EdgeTowards(int a, int b, int c) const;
+
+private:
+    int n;
+    //the center of each triplet a < b, c, at (a*n + b)*n + c, and the edge from it towards c
+    std::vector<int> centers;
+    std::vector<int> edgesTowards;
+};
+
+long QuarticQDist(Tree* t1, Tree* t2,
+                  long &b1, long &b2,
+                  long &shared_butterflies,
+                  long &diff_butterflies,
+                  QDistBreakdown* breakdown = NULL);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,417 @@
+#include "QDistBatch.hpp"
+#include "BoundedQueue.hpp"
+#include "NewickParser.hpp"
+#include "TreeCache.hpp"
+#include "TreeReader.hpp"
+#include "TreeUtil.hpp"
+#include "Util.hpp"
+#include "Checkpoint.hpp"
+#include "Progress.hpp"
+
+#include <sstream>
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <cstdlib>
+
+QDistBatch::QDistBatch(int numThreads, Format format, const QDistOptions &options)
+    : numThreads(numThreads),
+      format(format),
+      options(options),
+      batchOptions(options),
+      collection(),
+      loadedFiles(),
+      trees()
+{
+    //the checkpoints, progress and pruning count are of the whole batch, not of each comparison
+    this->options.checkpointFilename.clear();
+    this->options.resume = false;
+    this->options.progress = false;
+    this->options.prunedPairs = NULL;
+}
+
+QDistBatch::~QDistBatch() {
+    for (unsigned i = 0; i < collection.size(); i++)
+        TreeUtil::DeleteTree(collection[i]);
+    for (unsigned i = 0; i < loadedFiles.size(); i++)
+        TreeUtil::DeleteTree(loadedFiles[i]);
+}
+
+/*
+ * Prepare a tree for taking part in many comparisons.
+ */
+static void PrepareTree(Tree* tree) {
+    TreeUtil::RenumberTreeCanonically(tree);
+    TreeUtil::PrecomputeSubtreeData(tree);
+}
+
+void QDistBatch::LoadTreeCollection(const std::string &filename) {
+    std::vector<Tree*> trees = ParseTreeCollection(filename, numThreads);
+    collection.insert(collection.end(), trees.begin(), trees.end());
+}
+
+/*
+ * The reader splits the file into trees in a single cheap scan, while the parsing and
+ * preparing of the trees is shared out to the threads. Each thread takes the next tree from
+ * the reader along with its index, and parses it with its own parser, as a parser keeps the
+ * tree it is building in its members.
+ */
+std::vector<Tree*> QDistBatch::ParseTreeCollection(const std::string &filename, int numThreads) {
+    TreeReader reader(filename);
+    std::mutex mutex;
+    std::vector<Tree*> trees;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++)
+        threads.push_back(std::thread([&]() {
+            NewickParser parser;
+            std::string newick;
+            while (true) {
+                std::vector<Tree*>::size_type i;
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    if (!reader.Next(newick))
+                        break;
+                    i = trees.size();
+                    trees.push_back(NULL);
+                }
+
+                Tree* tree = reader.Parse(newick, parser);
+                PrepareTree(tree);
+
+                std::lock_guard<std::mutex> lock(mutex);
+                trees[i] = tree;
+            }
+        }));
+
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    return trees;
+}
+
+/*
+ * The tree of a name in the manifest, an index into the collection or a file name. Returns
+ * NULL for an index out of range.
+ */
+Tree* QDistBatch::FindTree(const std::string &name) {
+    std::map<std::string, Tree*>::iterator found = trees.find(name);
+    if (found != trees.end())
+        return found->second;
+
+    Tree* tree;
+    if (!collection.empty() && name.find_first_not_of("0123456789") == std::string::npos) {
+        unsigned long index = strtoul(name.c_str(), NULL, 10);
+        tree = index < collection.size() ? collection[index] : NULL;
+    }
+    else {
+        tree = TreeCache::LoadTreeFile(name);
+        PrepareTree(tree);
+        loadedFiles.push_back(tree);
+    }
+
+    trees[name] = tree;
+    return tree;
+}
+
+/*
+ * Quote a string for JSON.
+ */
+static std::string JsonString(const std::string &string) {
+    std::ostringstream quoted;
+    quoted << '"';
+    for (std::string::size_type i = 0; i < string.size(); i++) {
+        char c = string[i];
+        if (c == '"' || c == '\\')
+            quoted << '\\' << c;
+        else if ((unsigned char)c < 0x20) {
+            const char* hex = "0123456789abcdef";
+            quoted << "\\u00" << hex[(c >> 4) & 0xf] << hex[c & 0xf];
+        }
+        else
+            quoted << c;
+    }
+    quoted << '"';
+    return quoted.str();
+}
+
+/*
+ * Compare two topologies. A topology compared with itself has all its butterflies shared.
+ */
+void QDistBatch::Compare(Comparison &comparison) {
+    Tree* t1 = comparison.t1;
+    Tree* t2 = comparison.t2;
+    comparison.sameLeaves = t1 == t2 || TreeUtil::HaveSameLeaves(t1, t2);
+    if (!comparison.sameLeaves)
+        return;
+
+    if (t1 == t2) {
+        comparison.b1 = comparison.b2 = comparison.shared = NumButterflies(t1);
+        comparison.diff = comparison.qdist = 0;
+    }
+    else
+        comparison.qdist = SubCubicQDist(t1, t2, comparison.b1, comparison.b2, comparison.shared,
+                                         comparison.diff, options);
+}
+
+std::string QDistBatch::FormatLine(const std::string &name1, const std::string &name2,
+                                   const Comparison* comparison, bool swapped) {
+    std::string error;
+    if (comparison == NULL)
+        error = "no tree " + (trees.find(name1)->second == NULL ? name1 : name2);
+    else if (!comparison->sameLeaves)
+        error = "the two trees do not have the same leaf sets";
+
+    std::ostringstream line;
+    if (!error.empty()) {
+        if (format == NDJSON_FORMAT)
+            line << "{\"tree1\":" << JsonString(name1) << ",\"tree2\":" << JsonString(name2)
+                 << ",\"error\":" << JsonString(error) << "}\n";
+        else
+            line << name1 << '\t' << name2 << "\tNA\tNA\tNA\tNA\tNA\tNA\tNA\tNA\n";
+        return line.str();
+    }
+
+    //the shared and different butterflies and the distance are the same both ways round
+    long b1 = swapped ? comparison->b2 : comparison->b1;
+    long b2 = swapped ? comparison->b1 : comparison->b2;
+    long shared = comparison->shared;
+    long diff = comparison->diff;
+    long qdist = comparison->qdist;
+
+    long n = comparison->t1->NumLeafNodes();
+    double normB = double(shared) / std::min(b1, b2);
+    double normQ = double(qdist) / Util::Choose(n, 4);
+
+    if (format == NDJSON_FORMAT)
+        line << "{\"tree1\":" << JsonString(name1) << ",\"tree2\":" << JsonString(name2)
+             << ",\"N\":" << n << ",\"B1\":" << b1 << ",\"B2\":" << b2 << ",\"S\":" << shared
+             << ",\"D\":" << diff << ",\"normB\":" << normB << ",\"Q\":" << qdist
+             << ",\"normQ\":" << normQ << "}\n";
+    else
+        line << name1 << '\t' << name2 << '\t' << n << '\t' << b1 << '\t' << b2 << '\t' << shared
+             << '\t' << diff << '\t' << normB << '\t' << qdist << '\t' << normQ << '\n';
+    return line.str();
+}
+
+/*
+ * A hash of the pairs and the trees they name, for checkpoints of the batch.
+ */
+uint64_t QDistBatch::Fingerprint(const std::vector<std::pair<std::string, std::string> > &pairs) {
+    uint64_t hash = Util::MixHash(format);
+    for (unsigned i = 0; i < pairs.size(); i++) {
+        Tree* t1 = trees.find(pairs[i].first)->second;
+        Tree* t2 = trees.find(pairs[i].second)->second;
+        hash = Util::MixHash(hash ^ Util::HashString(pairs[i].first) ^ (t1 == NULL ? 0 : TreeUtil::Fingerprint(t1)));
+        hash = Util::MixHash(hash ^ Util::HashString(pairs[i].second) ^ (t2 == NULL ? 0 : TreeUtil::Fingerprint(t2)));
+    }
+    return hash;
+}
+
+void QDistBatch::Run(std::istream &manifest, std::ostream &out) {
+    //read the pairs
+    std::vector<std::pair<std::string, std::string> > pairs;
+    std::string line;
+    while (std::getline(manifest, line)) {
+        std::istringstream fields(line);
+        std::string name1, name2;
+        if (!(fields >> name1) || name1[0] == '#')
+            continue;
+        if (!(fields >> name2)) {
+            std::cerr << "Manifest line without two trees: " << line << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        pairs.push_back(std::make_pair(name1, name2));
+    }
+
+    //load every tree once
+    for (unsigned i = 0; i < pairs.size(); i++) {
+        FindTree(pairs[i].first);
+        FindTree(pairs[i].second);
+    }
+
+    //continue after the pairs whose result lines were saved, writing those again first
+    Checkpoint* checkpoint = NULL;
+    long numSaved = 0;
+    if (!batchOptions.checkpointFilename.empty()) {
+        checkpoint = new Checkpoint(batchOptions.checkpointFilename, Fingerprint(pairs), batchOptions.checkpointInterval);
+        if (batchOptions.resume && checkpoint->Load())
+            numSaved = checkpoint->GetLines().size();
+    }
+    Progress* progress = batchOptions.progress ? new Progress("qdist pairs", pairs.size(), numSaved) : NULL;
+
+    if (format == TSV_FORMAT)
+        out << "tree1\ttree2\tN\tB1\tB2\tS\tD\tNorm B\tQ\tNorm Q" << std::endl;
+    for (long i = 0; i < numSaved; i++)
+        out << checkpoint->GetLines()[i] << '\n';
+    out << std::flush;
+
+    //collapse the trees to their topologies
+    std::vector<Tree*> distinct;
+    for (std::map<std::string, Tree*>::iterator it = trees.begin(); it != trees.end(); ++it)
+        if (it->second != NULL)
+            distinct.push_back(it->second);
+    std::sort(distinct.begin(), distinct.end());
+    distinct.erase(std::unique(distinct.begin(), distinct.end()), distinct.end());
+    std::vector<int> representatives = TreeUtil::FindDuplicateTopologies(distinct);
+    std::map<Tree*, Tree*> topologies;
+    for (unsigned i = 0; i < distinct.size(); i++)
+        topologies[distinct[i]] = distinct[representatives[i]];
+
+    //one comparison for each unordered pair of topologies among the remaining pairs
+    std::vector<Comparison> comparisons;
+    std::map<std::pair<Tree*, Tree*>, long> comparisonOf;
+    std::vector<long> pairComparisons(pairs.size(), -1);
+    std::vector<char> swapped(pairs.size(), 0);
+    for (unsigned i = numSaved; i < pairs.size(); i++) {
+        Tree* t1 = trees.find(pairs[i].first)->second;
+        Tree* t2 = trees.find(pairs[i].second)->second;
+        if (t1 == NULL || t2 == NULL)
+            continue;
+        t1 = topologies[t1];
+        t2 = topologies[t2];
+        swapped[i] = t2 < t1;
+        std::pair<Tree*, Tree*> key = swapped[i] ? std::make_pair(t2, t1) : std::make_pair(t1, t2);
+
+        std::map<std::pair<Tree*, Tree*>, long>::iterator found = comparisonOf.find(key);
+        if (found == comparisonOf.end()) {
+            Comparison comparison = {key.first, key.second, false, 0, 0, 0, 0, 0};
+            found = comparisonOf.insert(std::make_pair(key, (long)comparisons.size())).first;
+            comparisons.push_back(comparison);
+        }
+        pairComparisons[i] = found->second;
+    }
+
+    //compare on the threads, writing the results in order from here
+    std::vector<char> done(comparisons.size(), 0);
+    std::atomic<long> next(0);
+    std::mutex doneMutex;
+    std::condition_variable resultReady;
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < numThreads; t++)
+        threads.push_back(std::thread([&]() {
+            long c;
+            while ((c = next++) < (long)comparisons.size()) {
+                Compare(comparisons[c]);
+                std::lock_guard<std::mutex> lock(doneMutex);
+                done[c] = 1;
+                resultReady.notify_all();
+            }
+        }));
+
+    for (unsigned i = numSaved; i < pairs.size(); i++) {
+        const Comparison* comparison = NULL;
+        if (pairComparisons[i] != -1) {
+            std::unique_lock<std::mutex> lock(doneMutex);
+            while (!done[pairComparisons[i]])
+                resultReady.wait(lock);
+            comparison = &comparisons[pairComparisons[i]];
+        }
+        std::string result = FormatLine(pairs[i].first, pairs[i].second, comparison, swapped[i]);
+        out << result << std::flush;
+
+        if (progress)
+            progress->Update(i + 1);
+        if (checkpoint) {
+            checkpoint->AddLine(result.substr(0, result.size() - 1));
+            if (checkpoint->Due())
+                checkpoint->Save();
+        }
+    }
+
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    if (checkpoint)
+        checkpoint->Save();
+    if (progress)
+        progress->Finish();
+    delete checkpoint;
+    delete progress;
+}
+
+//how many trees each stage of RunAgainst may run ahead of the next, as newicks read and not
+//parsed, and as comparisons per compare thread waiting to be compared or written
+static const size_t READ_AHEAD = 16;
+static const size_t COMPARE_AHEAD = 2;
+
+/*
+ * Every stage has threads of its own and hands the trees on through BoundedQueues, with NULL
+ * for the end of the file. The k-th tree is dealt to compare thread k % numThreads and its
+ * result collected from that thread in the same turn, so every queue has one producer and
+ * one consumer, and the lines come out in file order without sorting.
+ */
+void QDistBatch::RunAgainst(const std::string &treeFilename, const std::string &collectionFilename, std::ostream &out) {
+    Tree* tree = TreeCache::LoadTreeFile(treeFilename);
+    PrepareTree(tree);
+    TreeReader reader(collectionFilename);
+
+    BoundedQueue<std::string*> newicks(READ_AHEAD);
+    std::vector<BoundedQueue<Comparison*>*> toCompare;
+    std::vector<BoundedQueue<Comparison*>*> compared;
+    for (int t = 0; t < numThreads; t++) {
+        toCompare.push_back(new BoundedQueue<Comparison*>(COMPARE_AHEAD));
+        compared.push_back(new BoundedQueue<Comparison*>(COMPARE_AHEAD));
+    }
+
+    std::vector<std::thread> threads;
+
+    //read and decompress
+    threads.push_back(std::thread([&]() {
+        std::string newick;
+        while (reader.Next(newick))
+            newicks.Push(new std::string(newick));
+        newicks.Push(NULL);
+    }));
+
+    //parse and prepare
+    threads.push_back(std::thread([&]() {
+        NewickParser parser;
+        std::string* newick;
+        for (long k = 0; (newick = newicks.Pop()) != NULL; k++) {
+            Comparison* comparison = new Comparison();
+            comparison->t1 = tree;
+            comparison->t2 = reader.Parse(*newick, parser);
+            delete newick;
+            PrepareTree(comparison->t2);
+            toCompare[k % numThreads]->Push(comparison);
+        }
+        for (int t = 0; t < numThreads; t++)
+            toCompare[t]->Push(NULL);
+    }));
+
+    //compare
+    for (int t = 0; t < numThreads; t++)
+        threads.push_back(std::thread([&, t]() {
+            Comparison* comparison;
+            while ((comparison = toCompare[t]->Pop()) != NULL) {
+                Compare(*comparison);
+                compared[t]->Push(comparison);
+            }
+            compared[t]->Push(NULL);
+        }));
+
+    //write, from here
+    if (format == TSV_FORMAT)
+        out << "tree1\ttree2\tN\tB1\tB2\tS\tD\tNorm B\tQ\tNorm Q" << std::endl;
+    Comparison* comparison;
+    for (long k = 0; (comparison = compared[k % numThreads]->Pop()) != NULL; k++) {
+        std::ostringstream index;
+        index << k;
+        out << FormatLine(treeFilename, index.str(), comparison, false) << std::flush;
+        TreeUtil::DeleteTree(comparison->t2);
+        delete comparison;
+    }
+
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+
+    for (int t = 0; t < numThreads; t++) {
+        delete toCompare[t];
+        delete compared[t];
+    }
+    TreeUtil::DeleteTree(tree);
+}
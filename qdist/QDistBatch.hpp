@@ -0,0 +1,93 @@
+#ifndef QDIST_BATCH_H
+#define QDIST_BATCH_H
+
+#include "Tree.hpp"
+#include "QDist.hpp"
+
+#include <iostream>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * Computes the quartet distances of a list of tree pairs read from a manifest.
+ *
+ * Each line of the manifest names two trees, separated by whitespace. A tree is named by a
+ * file, newick or tree cache, or, if a tree collection has been loaded, by its index in the
+ * collection, counting from 0. Empty lines and lines starting with # are skipped.
+ *
+ * Every distinct tree is loaded once. Trees with the same unrooted topology, such as the
+ * repeated samples of a posterior, are collapsed to the first of them, see
+ * TreeUtil::FindDuplicateTopologies, so each distinct pair of topologies is compared once,
+ * whichever way round and however many pairs name it, and a topology is never compared
+ * with itself. The comparisons run on several threads, and one result line per pair is
+ * written in the order of the manifest, as soon as it and all pairs before it are done.
+ *
+ * With QDistOptions::checkpointFilename set, the checkpoint holds the result lines written so
+ * far. A resumed run writes them again and compares only the remaining pairs. The progress
+ * is reported over the pairs.
+ *
+ * RunAgainst compares one tree with every tree of a collection file instead, as a pipeline
+ * of stages on threads of their own: reading and decompressing the file, parsing and
+ * preparing each tree, comparing on numThreads threads, and writing the results. The stages
+ * pass the trees on through BoundedQueues, so reading and parsing go on while the trees
+ * before are compared, and only a few trees are held at a time however long the file is.
+ */
+class QDistBatch {
+public:
+    enum Format {
+        TSV_FORMAT,
+        NDJSON_FORMAT
+    };
+
+    QDistBatch(int numThreads, Format format, const QDistOptions &options = QDistOptions());
+    ~QDistBatch();
+
+    // Load a file of several newick trees, separated by semicolons, for pairs to refer to
+    void LoadTreeCollection(const std::string &filename);
+
+    // Parse a file of several newick trees on several threads, renumbered canonically and
+    // with their subtree data precomputed for many comparisons. The trees are in file order.
+    static std::vector<Tree*> ParseTreeCollection(const std::string &filename, int numThreads = 1);
+
+    void Run(std::istream &manifest, std::ostream &out);
+
+    // Compare the tree of a file with each tree of a collection file, writing one result line
+    // per tree, in file order, named by its index. There are no checkpoints or progress, and
+    // repeated topologies are compared again.
+    void RunAgainst(const std::string &treeFilename, const std::string &collectionFilename, std::ostream &out);
+
+private:
+    QDistBatch(const QDistBatch &);
+    QDistBatch &operator=(const QDistBatch &);
+
+    // A comparison of two distinct topologies, or of one with itself
+    struct Comparison {
+        Tree* t1;
+        Tree* t2;
+        bool sameLeaves;
+        long b1, b2, shared, diff, qdist;
+    };
+
+    Tree* FindTree(const std::string &name);
+    uint64_t Fingerprint(const std::vector<std::pair<std::string, std::string> > &pairs);
+    void Compare(Comparison &comparison);
+    // The result line of a pair, from the comparison of its topologies, t1 and t2 swapped if
+    // swapped is set. comparison is NULL if a tree is missing.
+    std::string FormatLine(const std::string &name1, const std::string &name2,
+                           const Comparison* comparison, bool swapped);
+
+    int numThreads;
+    Format format;
+    //the options of each comparison, and of the batch as given
+    QDistOptions options;
+    QDistOptions batchOptions;
+
+    std::vector<Tree*> collection;
+    std::vector<Tree*> loadedFiles;
+    //trees by the name used in the manifest
+    std::map<std::string, Tree*> trees;
+};
+
+#endif
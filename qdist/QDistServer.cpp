@@ -0,0 +1,289 @@
+#include "QDistServer.hpp"
+#include "NewickParser.hpp"
+#include "TreeUtil.hpp"
+#include "Util.hpp"
+
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <csignal>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+QDistServer::QDistServer(int numWorkers, unsigned cacheSize, const QDistOptions &options)
+    : numWorkers(numWorkers),
+      cacheSize(cacheSize),
+      options(options)
+{}
+
+/*
+ * Accept connections on the socket and hand them to the workers.
+ */
+void QDistServer::Listen(const std::string &socketPath) {
+    //a client going away should not take the server with it
+    signal(SIGPIPE, SIG_IGN);
+
+    sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socketPath.size() >= sizeof(address.sun_path)) {
+        std::cerr << "Socket path too long: " << socketPath << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    strcpy(address.sun_path, socketPath.c_str());
+
+    int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    unlink(socketPath.c_str());
+    if (listener == -1
+        || bind(listener, (sockaddr*)&address, sizeof(address)) == -1
+        || listen(listener, 64) == -1) {
+        std::cerr << "Could not listen on " << socketPath << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::vector<std::thread> workers;
+    for (int i = 0; i < numWorkers; i++)
+        workers.push_back(std::thread(&QDistServer::Work, this));
+
+    while (true) {
+        int connection = accept(listener, NULL, NULL);
+        if (connection == -1) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            std::cerr << "Could not accept connection: " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        connections.push_back(connection);
+        connectionsReady.notify_one();
+    }
+}
+
+/*
+ * Worker loop, serving one connection at a time.
+ */
+void QDistServer::Work() {
+    while (true) {
+        int connection;
+        {
+            std::unique_lock<std::mutex> lock(connectionsMutex);
+            while (connections.empty())
+                connectionsReady.wait(lock);
+            connection = connections.front();
+            connections.pop_front();
+        }
+
+        FILE* in = fdopen(connection, "r");
+        FILE* out = fdopen(dup(connection), "w");
+        if (in != NULL && out != NULL)
+            Serve(in, out);
+        if (in != NULL)
+            fclose(in);
+        else
+            close(connection);
+        if (out != NULL)
+            fclose(out);
+    }
+}
+
+/*
+ * Read a line without its newline. Returns false at the end of the input.
+ */
+static bool ReadLine(FILE* in, std::string &line) {
+    line.clear();
+    int c;
+    while ((c = getc(in)) != EOF && c != '\n')
+        line += (char)c;
+    if (!line.empty() && line[line.size() - 1] == '\r')
+        line.erase(line.size() - 1);
+    return c != EOF || !line.empty();
+}
+
+void QDistServer::Serve(FILE* in, FILE* out) {
+    std::string line;
+    while (ReadLine(in, line)) {
+        if (line == "QUIT")
+            break;
+        std::string response = HandleRequest(line, in);
+        if (fputs(response.c_str(), out) == EOF || fflush(out) == EOF)
+            break;
+    }
+}
+
+/*
+ * Handle one request and return the response lines.
+ */
+std::string QDistServer::HandleRequest(const std::string &line, FILE* in) {
+    std::istringstream request(line);
+    std::string command;
+    request >> command;
+
+    if (command == "REGISTER") {
+        //the newick string is the rest of the line, whitespace and all
+        std::string newick;
+        if (!std::getline(request >> std::ws, newick))
+            return "ERROR\tREGISTER needs a newick string\n";
+        TreePtr tree;
+        std::string hash;
+        std::string error = Register(newick, true, tree, hash);
+        if (!error.empty())
+            return "ERROR\t" + error + "\n";
+        return "OK\t" + hash + "\n";
+    }
+
+    if (command == "COMPARE") {
+        std::string reference1, reference2;
+        if (!(request >> reference1 >> reference2))
+            return "ERROR\tCOMPARE needs two trees\n";
+        return Compare(reference1, reference2);
+    }
+
+    if (command == "BATCH") {
+        long count;
+        if (!(request >> count) || count < 0)
+            return "ERROR\tBATCH needs a count\n";
+
+        std::string responses;
+        std::string pair;
+        for (long i = 0; i < count && ReadLine(in, pair); i++) {
+            std::istringstream pairStream(pair);
+            std::string reference1, reference2;
+            if (pairStream >> reference1 >> reference2)
+                responses += Compare(reference1, reference2);
+            else
+                responses += "ERROR\tBATCH lines need two trees\n";
+        }
+        return responses;
+    }
+
+    return "ERROR\tunknown request " + command + "\n";
+}
+
+/*
+ * Helper function. The newick string a tree is kept by, without whitespace, which the parser
+ * skips, and ending with a semicolon.
+ */
+static std::string NormalizeNewick(const std::string &newick) {
+    std::string normalized;
+    normalized.reserve(newick.size() + 1);
+    for (std::string::size_type i = 0; i < newick.size(); i++)
+        if (newick[i] != ' ' && newick[i] != '\t' && newick[i] != '\r' && newick[i] != '\n')
+            normalized += newick[i];
+    if (normalized.empty() || normalized[normalized.size() - 1] != ';')
+        normalized += ';';
+    return normalized;
+}
+
+/*
+ * Parse and preprocess a newick string and keep the tree, unless it is kept already, with
+ * the registered trees or with the inline trees. hash receives the hash it is kept by.
+ * Returns an error message, or the empty string on success.
+ */
+std::string QDistServer::Register(const std::string &newick, bool registration, TreePtr &tree, std::string &hash) {
+    std::string normalized = NormalizeNewick(newick);
+    std::ostringstream hashStream;
+    hashStream << std::hex << Util::HashString(normalized);
+    hash = hashStream.str();
+
+    Cache &cache = registration ? registered : inlined;
+    bool collision;
+    tree = FindTree(cache, hash, collision, &normalized);
+    if (tree)
+        return "";
+    if (collision && registration)
+        return "the hash " + hash + " of the tree is taken by another registered tree";
+
+    //the parser gives up on the whole process for unbalanced parentheses, so check them first
+    int depth = 0;
+    for (std::string::size_type i = 0; i < normalized.size() && depth >= 0; i++)
+        depth += normalized[i] == '(' ? 1 : normalized[i] == ')' ? -1 : 0;
+    if (depth != 0 || normalized[0] != '(')
+        return "malformed newick string";
+
+    NewickParser parser;
+    tree = TreePtr(parser.Parse(normalized), TreeUtil::DeleteTree);
+
+    TreeUtil::RenumberTreeCanonically(tree.get());
+    for (int i = 1; i < tree->NumLeafNodes(); i++)
+        if (tree->GetLeafNode(i)->GetLabel() == tree->GetLeafNode(i - 1)->GetLabel())
+            return "leaf label " + tree->GetLeafNode(i)->GetLabel() + " occurs more than once";
+
+    TreeUtil::PrecomputeSubtreeData(tree.get());
+
+    //an inline tree whose hash is taken is used once and not kept
+    if (collision)
+        return "";
+
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    if (cache.trees.find(hash) == cache.trees.end()) {
+        cache.lru.push_front(hash);
+        CachedTree cached = {normalized, tree, cache.lru.begin()};
+        cache.trees[hash] = cached;
+        while (cache.trees.size() > cacheSize) {
+            cache.trees.erase(cache.lru.back());
+            cache.lru.pop_back();
+        }
+    }
+
+    return "";
+}
+
+/*
+ * Look up a tree by hash and mark it as recently used. If newick is given, the tree is only
+ * found if it was kept for that string, and collision tells whether the hash is taken by a
+ * tree of another string.
+ */
+QDistServer::TreePtr QDistServer::FindTree(Cache &cache, const std::string &hash, bool &collision,
+                                           const std::string* newick) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    collision = false;
+    std::map<std::string, CachedTree>::iterator found = cache.trees.find(hash);
+    if (found == cache.trees.end())
+        return TreePtr();
+    if (newick != NULL && found->second.newick != *newick) {
+        collision = true;
+        return TreePtr();
+    }
+
+    cache.lru.splice(cache.lru.begin(), cache.lru, found->second.used);
+    return found->second.tree;
+}
+
+/*
+ * Compare two trees, given by hash or inline, and return the response line.
+ */
+std::string QDistServer::Compare(const std::string &reference1, const std::string &reference2) {
+    TreePtr trees[2];
+    const std::string* references[2] = {&reference1, &reference2};
+    for (int t = 0; t < 2; t++) {
+        if ((*references[t])[0] == '(') {
+            std::string hash;
+            std::string error = Register(*references[t], false, trees[t], hash);
+            if (!error.empty())
+                return "ERROR\t" + error + "\n";
+        }
+        else {
+            bool collision;
+            trees[t] = FindTree(registered, *references[t], collision);
+            if (!trees[t])
+                return "ERROR\tunknown tree " + *references[t] + "\n";
+        }
+    }
+
+    if (!TreeUtil::HaveSameLeaves(trees[0].get(), trees[1].get()))
+        return "ERROR\tthe two trees do not have the same leaf sets\n";
+
+    long b1, b2, shared, diff;
+    long qdist = SubCubicQDist(trees[0].get(), trees[1].get(), b1, b2, shared, diff, options);
+
+    std::ostringstream response;
+    response << "OK\t" << trees[0]->NumLeafNodes() << '\t' << b1 << '\t' << b2 << '\t'
+             << shared << '\t' << diff << '\t' << qdist << std::endl;
+    return response.str();
+}
@@ -0,0 +1,93 @@
+#ifndef QDIST_SERVER_H
+#define QDIST_SERVER_H
+
+#include "Tree.hpp"
+#include "QDist.hpp"
+
+#include <cstdio>
+#include <condition_variable>
+#include <deque>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+/*
+ * A server computing quartet distances for clients on a Unix domain socket, so that a client
+ * comparing many trees pays for starting qdist and parsing each tree only once.
+ *
+ * PROTOCOL:
+ *
+ * Requests and responses are lines of text. A tree in a request is either the hash returned
+ * when it was registered, or an inline newick string without whitespace. REGISTER takes the
+ * rest of the line as the newick string.
+ *
+ *   REGISTER newick        -> OK <hash>
+ *   COMPARE tree1 tree2    -> OK <N> <B1> <B2> <S> <D> <Q>
+ *   BATCH count            -> followed by count lines "tree1 tree2", answered by one
+ *                             COMPARE response line per pair, in order
+ *   QUIT                   -> closes the connection
+ *
+ * Fields in responses are separated by tabs. A request that fails is answered by
+ * "ERROR <message>".
+ *
+ * Parsed trees are kept, with their leaves numbered by label and their subtree leaf set sizes
+ * precomputed, keyed by a hash of their newick string without whitespace and ending with a
+ * semicolon. Each tree is kept with that string, and a tree is only found by its hash if the
+ * strings match, so a hash collision never returns the wrong tree: REGISTER answers it with
+ * an error, and an inline tree that collides is parsed without being kept.
+ *
+ * Registered trees and inline trees are kept in two caches of cacheSize trees each, so inline
+ * trees never push out a registered tree whose hash a client holds. The least recently used
+ * tree of a cache is dropped when it is full. Connections are served by a pool of workers.
+ */
+class QDistServer {
+public:
+    QDistServer(int numWorkers, unsigned cacheSize, const QDistOptions &options = QDistOptions());
+
+    // Serve connections on the socket until the process is killed.
+    void Listen(const std::string &socketPath);
+
+    // Serve the requests of one connection.
+    void Serve(FILE* in, FILE* out);
+
+private:
+    typedef std::shared_ptr<Tree> TreePtr;
+
+    std::string HandleRequest(const std::string &line, FILE* in);
+    // A tree with its newick string, and its place in the order of use of its cache
+    struct CachedTree {
+        std::string newick;
+        TreePtr tree;
+        std::list<std::string>::iterator used;
+    };
+
+    // Trees by hash, with the most recently used hash first in lru
+    struct Cache {
+        std::list<std::string> lru;
+        std::map<std::string, CachedTree> trees;
+    };
+
+    std::string Register(const std::string &newick, bool registration, TreePtr &tree, std::string &hash);
+    std::string Compare(const std::string &reference1, const std::string &reference2);
+    TreePtr FindTree(Cache &cache, const std::string &hash, bool &collision, const std::string* newick = NULL);
+
+    void Work();
+
+    int numWorkers;
+    unsigned cacheSize;
+    QDistOptions options;
+
+    //the registered trees, and the trees given inline
+    std::mutex cacheMutex;
+    Cache registered;
+    Cache inlined;
+
+    //connections waiting for a worker
+    std::mutex connectionsMutex;
+    std::condition_variable connectionsReady;
+    std::deque<int> connections;
+};
+
+#endif
@@ -0,0 +1,75 @@
+#include "QuartetQuery.hpp"
+#include "LeafNode.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+QuartetQuery::QuartetQuery(Tree* tree)
+    : tree(tree),
+      index(tree)
+{}
+
+int QuartetQuery::Distance(int a, int b) const {
+    return index.Distance(tree->GetLeafNode(a), tree->GetLeafNode(b));
+}
+
+QuartetQuery::Topology QuartetQuery::Query(int a, int b, int c, int d) const {
+    int ab = Distance(a, b) + Distance(c, d);
+    int ac = Distance(a, c) + Distance(b, d);
+    int ad = Distance(a, d) + Distance(b, c);
+
+    if (ab < ac && ab < ad)
+        return AB_CD;
+    if (ac < ab && ac < ad)
+        return AC_BD;
+    if (ad < ab && ad < ac)
+        return AD_BC;
+    return STAR;
+}
+
+/*
+ * Run work(begin, end) over consecutive slices of [0,size) on numThreads threads.
+ */
+template<typename Work>
+static void ForEachSlice(long size, int numThreads, Work work) {
+    if (numThreads <= 1 || size < 2 * numThreads) {
+        work(0L, size);
+        return;
+    }
+
+    long sliceSize = (size + numThreads - 1) / numThreads;
+    std::vector<std::thread> threads;
+    for (long begin = 0; begin < size; begin += sliceSize)
+        threads.push_back(std::thread(work, begin, std::min(begin + sliceSize, size)));
+    for (unsigned t = 0; t < threads.size(); t++)
+        threads[t].join();
+}
+
+void QuartetQuery::Query(const std::vector<Quartet> &quartets, std::vector<Topology>* topologies,
+                         int numThreads) const {
+    topologies->resize(quartets.size());
+
+    ForEachSlice(quartets.size(), numThreads, [&](long begin, long end) {
+        for (long i = begin; i < end; i++) {
+            const Quartet &q = quartets[i];
+            (*topologies)[i] = Query(q.a, q.b, q.c, q.d);
+        }
+    });
+}
+
+long QuartetQuery::CountDisplayed(const std::vector<Quartet> &quartets, int numThreads) const {
+    std::atomic<long> total(0);
+
+    ForEachSlice(quartets.size(), numThreads, [&](long begin, long end) {
+        long count = 0;
+        for (long i = begin; i < end; i++) {
+            const Quartet &q = quartets[i];
+            if (Query(q.a, q.b, q.c, q.d) == AB_CD)
+                count++;
+        }
+        total += count;
+    });
+
+    return total;
+}
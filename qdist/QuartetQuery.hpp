@@ -0,0 +1,49 @@
+#ifndef QUARTET_QUERY_H
+#define QUARTET_QUERY_H
+
+#include "Tree.hpp"
+#include "LcaIndex.hpp"
+
+#include <vector>
+
+/*
+ * Answers which topology a tree induces on a quartet of leaves in constant time.
+ *
+ * The tree is preprocessed into an LcaIndex, which gives the distance between two leaves in
+ * constant time. By the four-point condition the topology of {a,b,c,d} is ab|cd when
+ * d(a,b) + d(c,d) is smaller than the other two pairings, which are then equal, and the
+ * quartet is a star when all three are equal.
+ */
+class QuartetQuery {
+public:
+    // the same numbering as the quartic algorithm uses
+    enum Topology {
+        STAR  = 0,
+        AB_CD = 1,
+        AC_BD = 2,
+        AD_BC = 3
+    };
+
+    // four leaf ids. In CountDisplayed the quartet is read as the butterfly ab|cd
+    struct Quartet {
+        int a, b, c, d;
+    };
+
+    QuartetQuery(Tree* tree);
+
+    Topology Query(int a, int b, int c, int d) const;
+
+    // the topologies of a batch of quartets, queried on numThreads threads
+    void Query(const std::vector<Quartet> &quartets, std::vector<Topology>* topologies,
+               int numThreads = 1) const;
+    // the number of the butterflies ab|cd in the batch that the tree displays
+    long CountDisplayed(const std::vector<Quartet> &quartets, int numThreads = 1) const;
+
+private:
+    int Distance(int a, int b) const;
+
+    Tree* tree;
+    LcaIndex index;
+};
+
+#endif
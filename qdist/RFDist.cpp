@@ -0,0 +1,28 @@
+#include "RFDist.hpp"
+#include "TreeUtil.hpp"
+
+#include <unordered_map>
+
+/*
+ * Count the distinct non-trivial splits of a tree by hash, into counts with the given sign.
+ */
+static long CountSplits(Tree* tree, int sign, std::unordered_map<uint64_t, long> &counts) {
+    std::vector<uint64_t> splits = TreeUtil::NontrivialSplitHashes(tree);
+    for (unsigned i = 0; i < splits.size(); i++)
+        counts[splits[i]] += sign;
+    return splits.size();
+}
+
+long RFDist(Tree* t1, Tree* t2, long &splits1, long &splits2) {
+    std::unordered_map<uint64_t, long> counts;
+    counts.reserve(t1->NumInternalNodes() + t2->NumInternalNodes());
+
+    splits1 = CountSplits(t1, 1, counts);
+    splits2 = CountSplits(t2, -1, counts);
+
+    //what is left are the splits of only one tree
+    long rf = 0;
+    for (std::unordered_map<uint64_t, long>::iterator it = counts.begin(); it != counts.end(); ++it)
+        rf += it->second < 0 ? -it->second : it->second;
+    return rf;
+}
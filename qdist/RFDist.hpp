@@ -0,0 +1,17 @@
+#ifndef RF_DIST_H
+#define RF_DIST_H
+
+#include "Tree.hpp"
+
+/*
+ * The Robinson-Foulds distance between two trees on the same leaf labels: the number of
+ * non-trivial splits found in only one of the trees. splits1 and splits2 receive the number
+ * of non-trivial splits of each tree, whose sum is the largest possible distance.
+ *
+ * Each split is identified by a 64-bit hash of its smaller-hashed side, see
+ * TreeUtil::SplitHashes, so the distance takes O(n) expected time. The leaves are matched by
+ * label, so the trees need not be renumbered first.
+ */
+long RFDist(Tree* t1, Tree* t2, long &splits1, long &splits2);
+
+#endif
@@ -0,0 +1,121 @@
+#include "SharedLeafSetTable.hpp"
+#include "InternalNode.hpp"
+#include "DirectedEdge.hpp"
+
+#include <algorithm>
+#include <iostream>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <sys/mman.h>
+#include <unistd.h>
+
+template<typename Size>
+SharedLeafSetTable<Size>::SharedLeafSetTable(Tree* t1, Tree* t2, const std::string &directory)
+    : data(NULL),
+      size(0),
+      numColumns(t2->NumEdges()),
+      mapped(false),
+      heap(),
+      rowOffset(t1->NumEdges(), -1),
+      nodeRowStart(t1->NumInternalNodes() + 1, 0)
+{
+    //rows in the order Count() visits them
+    long row = 0;
+    for (int n1i = 0; n1i < t1->NumInternalNodes(); n1i++) {
+        nodeRowStart[n1i] = row;
+        const std::vector<DirectedEdge*> &edges = t1->GetInternalNode(n1i)->GetEdges();
+        for (unsigned i = 0; i < edges.size(); i++)
+            rowOffset[edges[i]->GetEdgeId()] = row++ * numColumns;
+    }
+    nodeRowStart[t1->NumInternalNodes()] = row;
+    for (int e = 0; e < t1->NumEdges(); e++)
+        if (rowOffset[e] == -1)
+            rowOffset[e] = row++ * numColumns;
+
+    size = row * numColumns;
+
+    if (directory.empty()) {
+        heap.resize(size);
+        data = size > 0 ? &heap[0] : NULL;
+        return;
+    }
+
+    std::string filename = directory + "/qdist-table-XXXXXX";
+    std::vector<char> path(filename.begin(), filename.end());
+    path.push_back('\0');
+
+    int fd = mkstemp(&path[0]);
+    if (fd == -1) {
+        std::cerr << "Could not create table file in " << directory << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    unlink(&path[0]);
+
+    size_t bytes = std::max(size, 1L) * sizeof(Size);
+    if (ftruncate(fd, bytes) == -1) {
+        std::cerr << "Could not size table file in " << directory << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    void* address = mmap(NULL, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (address == MAP_FAILED) {
+        std::cerr << "Could not map table file in " << directory << ": " << strerror(errno) << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    close(fd);
+
+    data = (Size*)address;
+    mapped = true;
+}
+
+template<typename Size>
+SharedLeafSetTable<Size>::~SharedLeafSetTable() {
+    if (mapped)
+        munmap(data, std::max(size, 1L) * sizeof(Size));
+}
+
+/*
+ * The rows are read in order from here on.
+ */
+template<typename Size>
+void SharedLeafSetTable<Size>::BeginScan() {
+    Advise(0, size, MADV_SEQUENTIAL);
+}
+
+/*
+ * Start reading in the rows of the node ahead of time.
+ */
+template<typename Size>
+void SharedLeafSetTable<Size>::WillNeed(InternalNode* iNode1) {
+    int id = iNode1->GetInternalId();
+    Advise(nodeRowStart[id] * numColumns, nodeRowStart[id + 1] * numColumns, MADV_WILLNEED);
+}
+
+/*
+ * The rows of the node will not be read again, so their pages can be dropped. They stay in
+ * the file, so this is safe even if they are read after all.
+ */
+template<typename Size>
+void SharedLeafSetTable<Size>::DontNeed(InternalNode* iNode1) {
+    int id = iNode1->GetInternalId();
+    Advise(nodeRowStart[id] * numColumns, nodeRowStart[id + 1] * numColumns, MADV_DONTNEED);
+}
+
+/*
+ * madvise the pages overlapping the entries [begin,end).
+ */
+template<typename Size>
+void SharedLeafSetTable<Size>::Advise(long begin, long end, int advice) {
+    if (!mapped || begin >= end)
+        return;
+
+    const long pageSize = sysconf(_SC_PAGESIZE);
+    char* base = (char*)data;
+    long first = begin * sizeof(Size) / pageSize * pageSize;
+    long last = end * sizeof(Size);
+    madvise(base + first, last - first, advice);
+}
+
+template class SharedLeafSetTable<uint16_t>;
+template class SharedLeafSetTable<uint32_t>;
@@ -0,0 +1,66 @@
+#ifndef SHARED_LEAF_SET_TABLE_H
+#define SHARED_LEAF_SET_TABLE_H
+
+#include "Tree.hpp"
+
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+class InternalNode;
+
+// Trees with fewer leaves than this can use 16-bit shared leaf set sizes, as every size then fits.
+const int MAX_NARROW_LEAVES = 65536;
+
+/*
+ * The table of shared leaf set sizes, indexed by an edge id of t1 and an edge id of t2.
+ *
+ * The rows are laid out in the order Count() visits them: the edges out of the first internal
+ * node of t1, then the edges out of the second internal node, and so on, with the edges out of
+ * the leaves last. The rows read for one internal node of t1 are therefore contiguous, and the
+ * whole scan is sequential.
+ *
+ * The table is kept on the heap, or, if a directory is given, in a memory-mapped file in that
+ * directory, so that tables larger than the main memory can be paged to disk. The file is
+ * removed again as soon as it is mapped.
+ *
+ * The entries are of the unsigned type Size, uint16_t for trees with fewer than
+ * MAX_NARROW_LEAVES leaves and uint32_t otherwise, so smaller trees move half the memory.
+ */
+template<typename Size>
+class SharedLeafSetTable {
+public:
+    SharedLeafSetTable(Tree* t1, Tree* t2, const std::string &directory = "");
+    ~SharedLeafSetTable();
+
+    Size* operator[](int edgeId1)             { return data + rowOffset[edgeId1]; }
+    const Size* operator[](int edgeId1) const { return data + rowOffset[edgeId1]; }
+
+    int NumRows()    const { return rowOffset.size(); }
+    int NumColumns() const { return numColumns; }
+    bool IsMapped()  const { return mapped; }
+
+    // Hints for the file-backed table, about to scan it from the beginning, and about to
+    // read or done reading the rows of a node. They do nothing for a table on the heap.
+    void BeginScan();
+    void WillNeed(InternalNode* iNode1);
+    void DontNeed(InternalNode* iNode1);
+
+private:
+    SharedLeafSetTable(const SharedLeafSetTable &);
+    SharedLeafSetTable &operator=(const SharedLeafSetTable &);
+
+    void Advise(long begin, long end, int advice);
+
+    Size* data;
+    long size;
+    int numColumns;
+    bool mapped;
+    std::vector<Size> heap;
+    //offset of each row into data, by edge id of t1
+    std::vector<long> rowOffset;
+    //first row of the edges out of each internal node of t1, by internal id, and one past the last
+    std::vector<long> nodeRowStart;
+};
+
+#endif
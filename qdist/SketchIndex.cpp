@@ -0,0 +1,87 @@
+#include "SketchIndex.hpp"
+#include "TreeUtil.hpp"
+#include "Util.hpp"
+
+#include <algorithm>
+
+SketchIndex::SketchIndex(int numHashes, int bandSize)
+    : numHashes(numHashes),
+      bandSize(bandSize),
+      numTrees(0),
+      sketches(),
+      buckets(numHashes / bandSize)
+{}
+
+/*
+ * The MinHash sketch of the split set of a tree. The hash functions are the split hash mixed
+ * with a different seed for each position.
+ */
+std::vector<uint32_t> SketchIndex::Sketch(Tree* tree) const {
+    std::vector<uint64_t> splits = TreeUtil::NontrivialSplitHashes(tree);
+
+    std::vector<uint32_t> sketch(numHashes, 0xffffffffU);
+    for (int i = 0; i < numHashes; i++) {
+        uint64_t seed = Util::MixHash(i + 1);
+        uint64_t smallest = ~0ULL;
+        for (unsigned s = 0; s < splits.size(); s++)
+            smallest = std::min(smallest, (uint64_t)Util::MixHash(splits[s] ^ seed));
+        if (!splits.empty())
+            sketch[i] = smallest >> 32;
+    }
+    return sketch;
+}
+
+uint64_t SketchIndex::BandKey(const uint32_t* sketch, int band) const {
+    uint64_t key = band;
+    for (int i = band * bandSize; i < (band + 1) * bandSize; i++)
+        key = Util::MixHash(key ^ sketch[i]);
+    return key;
+}
+
+int SketchIndex::Add(Tree* tree) {
+    std::vector<uint32_t> sketch = Sketch(tree);
+    sketches.insert(sketches.end(), sketch.begin(), sketch.end());
+
+    for (unsigned band = 0; band < buckets.size(); band++)
+        buckets[band][BandKey(&sketch[0], band)].push_back(numTrees);
+
+    return numTrees++;
+}
+
+std::vector<int> SketchIndex::Candidates(Tree* query) const {
+    std::vector<uint32_t> sketch = Sketch(query);
+
+    std::vector<int> candidates;
+    for (unsigned band = 0; band < buckets.size(); band++) {
+        std::unordered_map<uint64_t, std::vector<int> >::const_iterator found =
+            buckets[band].find(BandKey(&sketch[0], band));
+        if (found != buckets[band].end())
+            candidates.insert(candidates.end(), found->second.begin(), found->second.end());
+    }
+    std::sort(candidates.begin(), candidates.end());
+    candidates.erase(std::unique(candidates.begin(), candidates.end()), candidates.end());
+
+    //most agreeing positions first
+    std::vector<std::pair<int, int> > ranked;
+    for (unsigned c = 0; c < candidates.size(); c++) {
+        const uint32_t* other = &sketches[(long)candidates[c] * numHashes];
+        int agree = 0;
+        for (int i = 0; i < numHashes; i++)
+            agree += sketch[i] == other[i];
+        ranked.push_back(std::make_pair(-agree, candidates[c]));
+    }
+    std::sort(ranked.begin(), ranked.end());
+
+    for (unsigned c = 0; c < ranked.size(); c++)
+        candidates[c] = ranked[c].second;
+    return candidates;
+}
+
+double SketchIndex::Similarity(Tree* query, int id) const {
+    std::vector<uint32_t> sketch = Sketch(query);
+    const uint32_t* other = &sketches[(long)id * numHashes];
+    int agree = 0;
+    for (int i = 0; i < numHashes; i++)
+        agree += sketch[i] == other[i];
+    return double(agree) / numHashes;
+}
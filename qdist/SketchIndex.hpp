@@ -0,0 +1,52 @@
+#ifndef SKETCH_INDEX_H
+#define SKETCH_INDEX_H
+
+#include "Tree.hpp"
+
+#include <unordered_map>
+#include <vector>
+#include <stdint.h>
+
+/*
+ * An index of MinHash sketches of the split sets of many trees, for finding trees that share
+ * many splits with a query in sublinear time.
+ *
+ * A sketch holds, for each of numHashes hash functions, the smallest hash of the non-trivial
+ * splits of a tree, truncated to 32 bits. The fraction of positions where two sketches agree
+ * estimates the Jaccard similarity of the two split sets. The sketches are cut into bands of
+ * bandSize positions, and every band is a key into a hash table of the trees with that band.
+ * Trees sharing a band with the query are the candidates, which are likely to be the ones with
+ * similar split sets and so small distances. They must be verified with an exact distance.
+ *
+ * Only the sketches are kept, numHashes * 4 bytes per tree, so the trees can be discarded
+ * once they are added.
+ */
+class SketchIndex {
+public:
+    SketchIndex(int numHashes = 64, int bandSize = 4);
+
+    // Sketch a tree and add it under the next id, counting from 0
+    int Add(Tree* tree);
+    int NumTrees() const { return numTrees; }
+
+    // The ids of the trees sharing a band with the query, most similar sketches first
+    std::vector<int> Candidates(Tree* query) const;
+
+    // The estimated Jaccard similarity of the split sets of the query and a tree
+    double Similarity(Tree* query, int id) const;
+
+private:
+    std::vector<uint32_t> Sketch(Tree* tree) const;
+    uint64_t BandKey(const uint32_t* sketch, int band) const;
+
+    int numHashes;
+    int bandSize;
+    int numTrees;
+
+    //the sketches of all trees, one after the other
+    std::vector<uint32_t> sketches;
+    //for each band, the trees by band key
+    std::vector<std::unordered_map<uint64_t, std::vector<int> > > buckets;
+};
+
+#endif
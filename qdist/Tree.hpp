@@ -27,7 +27,9 @@ public:
         : root(NULL),
           internalNodes(),
           leafNodes(),
-          edges()
+          edges(),
+          subtreeLeafSetSizes(),
+          downEdges()
     {}
 
     ~Tree()
@@ -61,11 +63,24 @@ public:
     const std::vector<DirectedEdge*> &GetEdges()
     { return edges; }
 
+    //precomputed results of TreeUtil::SubtreeLeafSetSizes and
+    //TreeUtil::CollectEdgesPointingAwayFromRoot, if the tree was loaded with them
+    void SetSubtreeLeafSetSizes(const std::vector<int> &subtreeLeafSetSizes)
+    { this->subtreeLeafSetSizes = subtreeLeafSetSizes; }
+    const std::vector<int> &GetSubtreeLeafSetSizes()
+    { return subtreeLeafSetSizes; }
+    void SetDownEdges(const std::vector<DirectedEdge*> &downEdges)
+    { this->downEdges = downEdges; }
+    const std::vector<DirectedEdge*> &GetDownEdges()
+    { return downEdges; }
+
 private:
     Node* root;
     std::vector<InternalNode*> internalNodes;
     std::vector<LeafNode*> leafNodes;
     std::vector<DirectedEdge*> edges;
+    std::vector<int> subtreeLeafSetSizes;
+    std::vector<DirectedEdge*> downEdges;
 };
 
 #endif
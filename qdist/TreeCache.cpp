@@ -0,0 +1,302 @@
+#include "TreeCache.hpp"
+#include "TreeUtil.hpp"
+#include "NewickParser.hpp"
+#include "TreeReader.hpp"
+
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <vector>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <stdint.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static const char MAGIC[8] = {'Q', 'D', 'I', 'S', 'T', 'T', 'R', 'E'};
+static const uint32_t BYTE_ORDER_MARK = 0x01020304;
+
+struct TreeCacheHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t byteOrder;
+    int32_t numInternalNodes;
+    int32_t numLeafNodes;
+    int32_t numEdges;
+    int32_t numDownEdges;
+    int32_t root;
+    int32_t numLabels;
+    int64_t labelBytes;
+};
+
+static void Fail(const std::string &filename, const std::string &message) {
+    std::cerr << "TreeCache ERROR: " << filename << ": " << message << std::endl;
+    exit(EXIT_FAILURE);
+}
+
+static int32_t NodeReference(Node* node) {
+    if (node->isLeaf())
+        return ~((LeafNode*)node)->GetLeafId();
+    return ((InternalNode*)node)->GetInternalId();
+}
+
+/*
+ * Check whether the file starts with the magic of a tree cache file.
+ */
+bool TreeCache::IsCacheFile(const std::string &filename) {
+    std::ifstream in(filename.c_str(), std::ios::binary);
+    char magic[sizeof(MAGIC)];
+    if (!in.read(magic, sizeof(magic)))
+        return false;
+    return memcmp(magic, MAGIC, sizeof(MAGIC)) == 0;
+}
+
+/*
+ * Write the tree to a file.
+ */
+void TreeCache::Write(Tree* tree, const std::string &filename) {
+    const int numInternalNodes = tree->NumInternalNodes();
+    const int numLeafNodes = tree->NumLeafNodes();
+    const int numEdges = tree->NumEdges();
+
+    std::vector<int32_t> edgeFrom(numEdges), edgeTo(numEdges), edgeBack(numEdges);
+    for (int e = 0; e < numEdges; e++) {
+        DirectedEdge* edge = tree->GetEdge(e);
+        edgeFrom[e] = NodeReference(edge->GetFromNode());
+        edgeTo[e] = NodeReference(edge->GetToNode());
+        edgeBack[e] = edge->GetBackEdge()->GetEdgeId();
+    }
+
+    //intern the labels
+    std::map<std::string, int32_t> labelIndex;
+    std::vector<int32_t> labelStart(1, 0);
+    std::string labelChars;
+    std::vector<int32_t> internalLabel(numInternalNodes), leafLabel(numLeafNodes);
+
+    std::vector<int32_t> adjacencyStart(1, 0), adjacency;
+    for (int i = 0; i < numInternalNodes; i++) {
+        InternalNode* node = tree->GetInternalNode(i);
+        const std::vector<DirectedEdge*> &edges = node->GetEdges();
+        for (unsigned k = 0; k < edges.size(); k++)
+            adjacency.push_back(edges[k]->GetEdgeId());
+        adjacencyStart.push_back(adjacency.size());
+
+        std::map<std::string, int32_t>::iterator found = labelIndex.find(node->GetLabel());
+        if (found == labelIndex.end()) {
+            found = labelIndex.insert(std::make_pair(node->GetLabel(), (int32_t)labelStart.size() - 1)).first;
+            labelChars += node->GetLabel();
+            labelStart.push_back(labelChars.size());
+        }
+        internalLabel[i] = found->second;
+    }
+
+    std::vector<int32_t> leafEdge(numLeafNodes);
+    for (int l = 0; l < numLeafNodes; l++) {
+        LeafNode* leaf = tree->GetLeafNode(l);
+        //a tree of a single leaf has no edges
+        leafEdge[l] = leaf->GetEdge() != NULL ? leaf->GetEdge()->GetEdgeId() : -1;
+
+        std::map<std::string, int32_t>::iterator found = labelIndex.find(leaf->GetLabel());
+        if (found == labelIndex.end()) {
+            found = labelIndex.insert(std::make_pair(leaf->GetLabel(), (int32_t)labelStart.size() - 1)).first;
+            labelChars += leaf->GetLabel();
+            labelStart.push_back(labelChars.size());
+        }
+        leafLabel[l] = found->second;
+    }
+
+    std::vector<int> sizes = TreeUtil::SubtreeLeafSetSizes(tree);
+    std::vector<int32_t> subtreeLeafSetSizes(sizes.begin(), sizes.end());
+    std::vector<DirectedEdge*> edges = TreeUtil::CollectEdgesPointingAwayFromRoot(tree);
+    std::vector<int32_t> downEdges(edges.size());
+    for (unsigned k = 0; k < edges.size(); k++)
+        downEdges[k] = edges[k]->GetEdgeId();
+
+    TreeCacheHeader header;
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.version = VERSION;
+    header.byteOrder = BYTE_ORDER_MARK;
+    header.numInternalNodes = numInternalNodes;
+    header.numLeafNodes = numLeafNodes;
+    header.numEdges = numEdges;
+    header.numDownEdges = downEdges.size();
+    header.root = NodeReference(tree->GetRoot());
+    header.numLabels = labelStart.size() - 1;
+    header.labelBytes = labelChars.size();
+
+    std::ofstream out(filename.c_str(), std::ios::binary);
+    if (!out)
+        Fail(filename, "could not open file for writing");
+
+    out.write((const char*)&header, sizeof(header));
+    const std::vector<int32_t>* arrays[] = {
+        &edgeFrom, &edgeTo, &edgeBack, &adjacencyStart, &adjacency, &leafEdge,
+        &internalLabel, &leafLabel, &subtreeLeafSetSizes, &downEdges, &labelStart
+    };
+    for (unsigned a = 0; a < sizeof(arrays) / sizeof(arrays[0]); a++)
+        if (!arrays[a]->empty())
+            out.write((const char*)&(*arrays[a])[0], arrays[a]->size() * sizeof(int32_t));
+    out.write(labelChars.data(), labelChars.size());
+
+    if (!out)
+        Fail(filename, "could not write file");
+}
+
+/*
+ * Load a tree from a file. The file is mapped into memory and the tree built directly from
+ * the arrays in it.
+ */
+Tree* TreeCache::Load(const std::string &filename) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd == -1)
+        Fail(filename, strerror(errno));
+
+    struct stat status;
+    if (fstat(fd, &status) == -1)
+        Fail(filename, strerror(errno));
+    const size_t fileSize = status.st_size;
+    if (fileSize < sizeof(TreeCacheHeader))
+        Fail(filename, "file too small to be a tree cache file");
+
+    void* address = mmap(NULL, fileSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (address == MAP_FAILED)
+        Fail(filename, strerror(errno));
+    close(fd);
+
+    const TreeCacheHeader* header = (const TreeCacheHeader*)address;
+    if (memcmp(header->magic, MAGIC, sizeof(MAGIC)) != 0)
+        Fail(filename, "not a tree cache file");
+    if (header->version != VERSION)
+        Fail(filename, "unsupported tree cache version");
+    if (header->byteOrder != BYTE_ORDER_MARK)
+        Fail(filename, "tree cache file written with a different byte order");
+
+    const int numInternalNodes = header->numInternalNodes;
+    const int numLeafNodes = header->numLeafNodes;
+    const int numEdges = header->numEdges;
+    const int numDownEdges = header->numDownEdges;
+    const int numLabels = header->numLabels;
+    if (numInternalNodes < 0 || numLeafNodes < 0 || numEdges < 0 || numDownEdges < 0 || numLabels < 0
+        || header->labelBytes < 0)
+        Fail(filename, "corrupt header");
+
+    //locate the arrays
+    const int32_t* next = (const int32_t*)(header + 1);
+    const char* end = (const char*)address + fileSize;
+    #define TAKE(name, count)                                                                  \
+        if ((end - (const char*)next) / (long)sizeof(int32_t) < (long)(count))                \
+            Fail(filename, "file truncated");                                                  \
+        const int32_t* name = next;                                                            \
+        next += (count);
+
+    TAKE(edgeFrom, numEdges);
+    TAKE(edgeTo, numEdges);
+    TAKE(edgeBack, numEdges);
+    TAKE(adjacencyStart, numInternalNodes + 1);
+    if (adjacencyStart[0] != 0 || adjacencyStart[numInternalNodes] < 0)
+        Fail(filename, "corrupt adjacency");
+    TAKE(adjacency, adjacencyStart[numInternalNodes]);
+    TAKE(leafEdge, numLeafNodes);
+    TAKE(internalLabel, numInternalNodes);
+    TAKE(leafLabel, numLeafNodes);
+    TAKE(subtreeLeafSetSizes, numEdges);
+    TAKE(downEdges, numDownEdges);
+    TAKE(labelStart, numLabels + 1);
+    #undef TAKE
+
+    const char* labelChars = (const char*)next;
+    if (end - labelChars != header->labelBytes)
+        Fail(filename, "file size does not match header");
+
+    //check every reference before following it
+    for (int e = 0; e < numEdges; e++)
+        if (edgeFrom[e] >= numInternalNodes || ~edgeFrom[e] >= numLeafNodes
+            || edgeTo[e] >= numInternalNodes || ~edgeTo[e] >= numLeafNodes
+            || edgeBack[e] < 0 || edgeBack[e] >= numEdges)
+            Fail(filename, "corrupt edge");
+    for (int i = 0; i < numInternalNodes; i++)
+        if (adjacencyStart[i] > adjacencyStart[i + 1] || internalLabel[i] < 0 || internalLabel[i] >= numLabels)
+            Fail(filename, "corrupt internal node");
+    for (int k = 0; k < adjacencyStart[numInternalNodes]; k++)
+        if (adjacency[k] < 0 || adjacency[k] >= numEdges)
+            Fail(filename, "corrupt adjacency");
+    for (int l = 0; l < numLeafNodes; l++)
+        if (leafEdge[l] < -1 || leafEdge[l] >= numEdges || leafLabel[l] < 0 || leafLabel[l] >= numLabels)
+            Fail(filename, "corrupt leaf node");
+    for (int k = 0; k < numDownEdges; k++)
+        if (downEdges[k] < 0 || downEdges[k] >= numEdges)
+            Fail(filename, "corrupt down edges");
+    for (int k = 0; k < numLabels; k++)
+        if (labelStart[k] < 0 || labelStart[k] > labelStart[k + 1] || labelStart[k + 1] > header->labelBytes)
+            Fail(filename, "corrupt label table");
+    if (header->root >= numInternalNodes || ~header->root >= numLeafNodes)
+        Fail(filename, "corrupt root");
+
+    //build the tree
+    std::vector<InternalNode*> internalNodes(numInternalNodes);
+    for (int i = 0; i < numInternalNodes; i++) {
+        int label = internalLabel[i];
+        internalNodes[i] = new InternalNode(std::string(labelChars + labelStart[label], labelChars + labelStart[label + 1]), i);
+    }
+    std::vector<LeafNode*> leafNodes(numLeafNodes);
+    for (int l = 0; l < numLeafNodes; l++) {
+        int label = leafLabel[l];
+        leafNodes[l] = new LeafNode(std::string(labelChars + labelStart[label], labelChars + labelStart[label + 1]), l);
+    }
+
+    #define NODE(reference) \
+        ((reference) >= 0 ? (Node*)internalNodes[(reference)] : (Node*)leafNodes[~(reference)])
+
+    std::vector<DirectedEdge*> edges(numEdges);
+    for (int e = 0; e < numEdges; e++)
+        edges[e] = new DirectedEdge(e);
+    for (int e = 0; e < numEdges; e++) {
+        edges[e]->SetFromNode(NODE(edgeFrom[e]));
+        edges[e]->SetToNode(NODE(edgeTo[e]));
+        edges[e]->SetBackEdge(edges[edgeBack[e]]);
+    }
+    for (int i = 0; i < numInternalNodes; i++)
+        for (int k = adjacencyStart[i]; k < adjacencyStart[i + 1]; k++)
+            internalNodes[i]->AddEdge(edges[adjacency[k]]);
+    for (int l = 0; l < numLeafNodes; l++)
+        if (leafEdge[l] != -1)
+            leafNodes[l]->AddEdge(edges[leafEdge[l]]);
+
+    Tree* tree = new Tree();
+    tree->SetRoot(NODE(header->root));
+    #undef NODE
+
+    tree->SetInternalNodeList(internalNodes);
+    tree->SetLeafNodeList(leafNodes);
+    tree->SetEdgeList(edges);
+    tree->SetSubtreeLeafSetSizes(std::vector<int>(subtreeLeafSetSizes, subtreeLeafSetSizes + numEdges));
+    std::vector<DirectedEdge*> treeDownEdges(numDownEdges);
+    for (int k = 0; k < numDownEdges; k++)
+        treeDownEdges[k] = edges[downEdges[k]];
+    tree->SetDownEdges(treeDownEdges);
+
+    munmap(address, fileSize);
+
+    return tree;
+}
+
+/*
+ * Load a tree from a file in either format, telling them apart by the magic.
+ */
+Tree* TreeCache::LoadTreeFile(const std::string &filename) {
+    if (IsCacheFile(filename))
+        return Load(filename);
+
+    TreeReader reader(filename);
+    std::string newick;
+    if (!reader.Next(newick) && reader.IsNexus()) {
+        std::cerr << "No trees in " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    NewickParser parser;
+    return reader.Parse(newick, parser);
+}
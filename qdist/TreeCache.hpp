@@ -0,0 +1,51 @@
+#ifndef TREE_CACHE_H
+#define TREE_CACHE_H
+
+#include <string>
+
+#include "Tree.hpp"
+
+/*
+ * A binary file format for parsed trees, so trees that are compared again and again need
+ * not be parsed again. A file holds the adjacency of the tree in flat arrays of edge and node
+ * ids, the node labels interned in a table, and the precomputed subtree leaf set sizes and
+ * edges pointing away from the root.
+ *
+ * FORMAT (version 1, all integers in the byte order of the machine that wrote the file):
+ *
+ *   magic              8 chars, "QDISTTRE"
+ *   version            uint32
+ *   byte order mark    uint32, 0x01020304
+ *   numInternalNodes, numLeafNodes, numEdges, numDownEdges, root, numLabels
+ *                      int32 each
+ *   labelBytes         int64
+ *
+ * followed by int32 arrays, where a node is referred to by its internal id, or by the bitwise
+ * complement of its leaf id:
+ *
+ *   edgeFrom, edgeTo, edgeBack         numEdges each
+ *   adjacencyStart                     numInternalNodes + 1
+ *   adjacency                          adjacencyStart[numInternalNodes], edge ids in order
+ *   leafEdge                           numLeafNodes
+ *   internalLabel                      numInternalNodes, index into the label table
+ *   leafLabel                          numLeafNodes, index into the label table
+ *   subtreeLeafSetSizes                numEdges
+ *   downEdges                          numDownEdges, in preorder
+ *   labelStart                         numLabels + 1, offsets into the label chars
+ *
+ * and finally the labelBytes chars of the labels.
+ */
+
+class TreeCache {
+public:
+    static const unsigned VERSION = 1;
+
+    static bool IsCacheFile(const std::string &filename);
+    static void Write(Tree* tree, const std::string &filename);
+    static Tree* Load(const std::string &filename);
+
+    // Load a tree from a tree cache file, or parse it from a newick file
+    static Tree* LoadTreeFile(const std::string &filename);
+};
+
+#endif
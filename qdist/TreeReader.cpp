@@ -0,0 +1,355 @@
+#include "TreeReader.hpp"
+
+#include <iostream>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <cerrno>
+#include <strings.h>
+
+#ifdef QDIST_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QDIST_USE_ZSTD
+#include <zstd.h>
+#endif
+
+static const char NEXUS_MAGIC[] = "#NEXUS";
+static const size_t MAGIC_SIZE = sizeof(NEXUS_MAGIC) - 1;
+
+TreeReader::TreeReader(const std::string &filename, size_t chunkSize)
+    : filename(filename),
+      compression(DetectCompression(filename)),
+      file(NULL),
+      gzipFile(NULL),
+      zstdStream(NULL),
+      zstdFrameComplete(false),
+      input(),
+      inputStart(0),
+      inputEnd(0),
+      chunk(std::max(chunkSize, sizeof(NEXUS_MAGIC))),
+      chunkStart(0),
+      chunkEnd(0),
+      parenthesesDepth(0),
+      nexus(false),
+      inTreesBlock(false),
+      numTrees(0),
+      nexusParser()
+{
+    if (compression == GZIP_COMPRESSION) {
+#ifdef QDIST_USE_ZLIB
+        gzFile gz = gzopen(filename.c_str(), "rb");
+        if (gz == NULL) {
+            std::cerr << "Could not open file: " << filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        gzbuffer(gz, chunkSize);
+        gzipFile = gz;
+#else
+        std::cerr << filename << " is compressed with gzip, but qdist was built without zlib" << std::endl;
+        exit(EXIT_FAILURE);
+#endif
+    }
+    else {
+        file = fopen(filename.c_str(), "rb");
+        if (file == NULL) {
+            std::cerr << "Could not open file: " << filename << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    if (compression == ZSTD_COMPRESSION) {
+#ifdef QDIST_USE_ZSTD
+        ZSTD_DStream* stream = ZSTD_createDStream();
+        ZSTD_initDStream(stream);
+        zstdStream = stream;
+        input.resize(ZSTD_DStreamInSize());
+#else
+        std::cerr << filename << " is compressed with zstd, but qdist was built without zstd" << std::endl;
+        exit(EXIT_FAILURE);
+#endif
+    }
+
+    //a NEXUS file starts with #NEXUS, which is no part of any command
+    size_t read;
+    while (chunkEnd < MAGIC_SIZE && (read = Read(&chunk[chunkEnd], chunk.size() - chunkEnd)) > 0)
+        chunkEnd += read;
+    if (chunkEnd >= MAGIC_SIZE && strncasecmp(&chunk[0], NEXUS_MAGIC, MAGIC_SIZE) == 0) {
+        nexus = true;
+        chunkStart = MAGIC_SIZE;
+    }
+}
+
+TreeReader::~TreeReader() {
+#ifdef QDIST_USE_ZLIB
+    if (gzipFile != NULL)
+        gzclose((gzFile)gzipFile);
+#endif
+#ifdef QDIST_USE_ZSTD
+    if (zstdStream != NULL)
+        ZSTD_freeDStream((ZSTD_DStream*)zstdStream);
+#endif
+    if (file != NULL)
+        fclose(file);
+}
+
+/*
+ * Tell the compression of a file from its first bytes, 1f 8b for gzip and 28 b5 2f fd for
+ * zstd.
+ */
+TreeReader::Compression TreeReader::DetectCompression(const std::string &filename) {
+    unsigned char magic[4] = {0, 0, 0, 0};
+    FILE* file = fopen(filename.c_str(), "rb");
+    if (file == NULL) {
+        std::cerr << "Could not open file: " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    size_t size = fread(magic, 1, sizeof(magic), file);
+    fclose(file);
+
+    if (size >= 2 && magic[0] == 0x1f && magic[1] == 0x8b)
+        return GZIP_COMPRESSION;
+    if (size == 4 && magic[0] == 0x28 && magic[1] == 0xb5 && magic[2] == 0x2f && magic[3] == 0xfd)
+        return ZSTD_COMPRESSION;
+    return NO_COMPRESSION;
+}
+
+size_t TreeReader::Read(char* bytes, size_t size) {
+    if (compression == NO_COMPRESSION) {
+        size_t read = fread(bytes, 1, size, file);
+        if (read == 0 && ferror(file)) {
+            std::cerr << "Could not read file: " << filename << ": " << strerror(errno) << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return read;
+    }
+
+#ifdef QDIST_USE_ZLIB
+    if (compression == GZIP_COMPRESSION) {
+        int read = gzread((gzFile)gzipFile, bytes, size);
+        //a stream cut short ends with no bytes read and Z_BUF_ERROR, not with a failed read
+        int error = Z_OK;
+        const char* message = read <= 0 ? gzerror((gzFile)gzipFile, &error) : NULL;
+        if (read < 0 || error != Z_OK) {
+            std::cerr << "Could not decompress file: " << filename << ": " << message << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        return read;
+    }
+#endif
+
+#ifdef QDIST_USE_ZSTD
+    if (compression == ZSTD_COMPRESSION) {
+        ZSTD_outBuffer out = {bytes, size, 0};
+        //decompress until some bytes come out, refilling the input as it runs dry. At the end
+        //of the input the stream may still hold bytes for the output, and after those the
+        //last frame must be complete, or the file was cut short.
+        while (out.pos == 0) {
+            if (inputStart == inputEnd) {
+                inputStart = 0;
+                inputEnd = fread(&input[0], 1, input.size(), file);
+                if (inputEnd == 0 && ferror(file)) {
+                    std::cerr << "Could not read file: " << filename << ": " << strerror(errno) << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                if (inputEnd == 0 && zstdFrameComplete)
+                    break;
+            }
+            ZSTD_inBuffer in = {&input[0], inputEnd, inputStart};
+            size_t result = ZSTD_decompressStream((ZSTD_DStream*)zstdStream, &out, &in);
+            if (ZSTD_isError(result)) {
+                std::cerr << "Could not decompress file: " << filename << ": " << ZSTD_getErrorName(result) << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            inputStart = in.pos;
+            zstdFrameComplete = result == 0;
+            if (inputEnd == 0 && out.pos == 0 && !zstdFrameComplete) {
+                std::cerr << "Could not decompress file: " << filename << ": unexpected end of file" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        return out.pos;
+    }
+#endif
+
+    return 0;
+}
+
+bool TreeReader::FillChunk() {
+    if (chunkStart == chunkEnd) {
+        chunkStart = 0;
+        chunkEnd = Read(&chunk[0], chunk.size());
+    }
+    return chunkEnd > 0;
+}
+
+bool TreeReader::Next(std::string &tree) {
+    return nexus ? NextNexus(tree) : NextNewick(tree);
+}
+
+Tree* TreeReader::Parse(const std::string &tree, NewickParser &parser) const {
+    return nexus ? nexusParser.Parse(tree) : parser.Parse(tree);
+}
+
+bool TreeReader::NextNewick(std::string &newick) {
+    newick.clear();
+
+    while (FillChunk()) {
+        //scan the chunk up to the end of the tree, copying the runs between line breaks
+        const char* bytes = &chunk[0];
+        size_t run = chunkStart;
+        for (size_t index = chunkStart; index < chunkEnd; index++) {
+            char c = bytes[index];
+            if (c == '(')
+                parenthesesDepth++;
+            else if (c == ')')
+                parenthesesDepth--;
+            else if (c == '\n') {
+                newick.append(bytes + run, index - run);
+                run = index + 1;
+            }
+            else if (c == ';' && parenthesesDepth == 0) {
+                newick.append(bytes + run, index + 1 - run);
+                chunkStart = index + 1;
+                return true;
+            }
+        }
+        newick.append(bytes + run, chunkEnd - run);
+        chunkStart = chunkEnd;
+    }
+
+    return newick.find_first_not_of(" \t\r") != std::string::npos;
+}
+
+bool TreeReader::NextNexusCommand(std::string &command) {
+    command.clear();
+    int commentDepth = 0;
+    bool quoted = false;
+
+    while (FillChunk()) {
+        const char* bytes = &chunk[0];
+        size_t run = chunkStart;
+        for (size_t index = chunkStart; index < chunkEnd; index++) {
+            char c = bytes[index];
+            if (commentDepth > 0) {
+                //comments nest, and everything in them is skipped
+                if (c == '[')
+                    commentDepth++;
+                else if (c == ']' && --commentDepth == 0)
+                    run = index + 1;
+            }
+            else if (c == '\'')
+                quoted = !quoted;
+            else if (quoted)
+                continue;
+            else if (c == '[') {
+                command.append(bytes + run, index - run);
+                commentDepth = 1;
+            }
+            else if (c == '\n' || c == '\r' || c == '\t') {
+                command.append(bytes + run, index - run);
+                command += ' ';
+                run = index + 1;
+            }
+            else if (c == ';') {
+                command.append(bytes + run, index - run);
+                chunkStart = index + 1;
+                return true;
+            }
+        }
+        if (commentDepth == 0)
+            command.append(bytes + run, chunkEnd - run);
+        chunkStart = chunkEnd;
+    }
+
+    return command.find_first_not_of(' ') != std::string::npos;
+}
+
+/*
+ * Helper function. Read the word of a NEXUS command at index, quoted or up to the next
+ * whitespace or comma, and move index past it.
+ */
+static std::string NexusWord(const std::string &command, std::string::size_type &index) {
+    index = command.find_first_not_of(' ', index);
+    if (index == std::string::npos) {
+        index = command.size();
+        return "";
+    }
+
+    std::string word;
+    if (command[index] == '\'') {
+        for (index++; index < command.size(); index++) {
+            if (command[index] == '\'') {
+                if (index + 1 < command.size() && command[index + 1] == '\'')
+                    index++;
+                else {
+                    index++;
+                    break;
+                }
+            }
+            word += command[index];
+        }
+        return word;
+    }
+
+    std::string::size_type start = index;
+    while (index < command.size() && command[index] != ' ' && command[index] != ',')
+        index++;
+    return command.substr(start, index - start);
+}
+
+static std::string Lowercase(std::string word) {
+    std::transform(word.begin(), word.end(), word.begin(), ::tolower);
+    return word;
+}
+
+bool TreeReader::NextNexus(std::string &description) {
+    std::string command;
+    while (NextNexusCommand(command)) {
+        std::string::size_type index = 0;
+        std::string word = Lowercase(NexusWord(command, index));
+
+        if (word == "begin")
+            inTreesBlock = Lowercase(NexusWord(command, index)) == "trees";
+        else if (word == "end" || word == "endblock")
+            inTreesBlock = false;
+        else if (!inTreesBlock)
+            continue;
+        else if (word == "translate") {
+            //token label pairs, separated by commas
+            NexusParser table;
+            while (index < command.size()) {
+                std::string token = NexusWord(command, index);
+                std::string label = NexusWord(command, index);
+                if (token.empty())
+                    break;
+                table.AddTranslation(token, label);
+                index = command.find(',', index);
+                if (index == std::string::npos)
+                    break;
+                index++;
+            }
+
+            //trees already read may be parsed with the table by other threads, so once there
+            //are trees it cannot change, nor be assigned
+            if (numTrees == 0)
+                nexusParser = table;
+            else if (!(table == nexusParser)) {
+                std::cerr << "NEXUS file " << filename << " translates leaves differently after some trees" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+        }
+        else if (word == "tree" || word == "utree") {
+            std::string::size_type equals = command.find('=', index);
+            if (equals == std::string::npos) {
+                std::cerr << "NEXUS tree command without =: " << command << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            description = command.substr(equals + 1) + ";";
+            numTrees++;
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,94 @@
+#ifndef TREE_READER_H
+#define TREE_READER_H
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "Tree.hpp"
+#include "NewickParser.hpp"
+#include "NexusParser.hpp"
+
+/*
+ * Reads the trees of a newick or NEXUS file one at a time, so a large file of trees is never
+ * held in memory as a whole.
+ *
+ * Files compressed with gzip or zstd are recognised by their magic bytes and decompressed
+ * as they are read, if qdist is built with zlib (QDIST_USE_ZLIB) or zstd (QDIST_USE_ZSTD).
+ * A compressed file that ends before its stream does is an error, not a shorter collection.
+ * The decompressed bytes are scanned once, a chunk at a time. In a newick file a tree ends at
+ * a semicolon outside of parentheses, as in NewickParser::SplitTrees, and line breaks are
+ * dropped, as by Util::LoadFileToString.
+ *
+ * A file starting with #NEXUS is read as NEXUS instead. The trees are those of the TREE
+ * commands of its TREES blocks, and the TRANSLATE table names their leaves. Bracketed
+ * comments, such as the [&...] metadata on every node, are dropped in the same scan, so
+ * they are never copied.
+ */
+class TreeReader {
+public:
+    TreeReader(const std::string &filename, size_t chunkSize = 1 << 18);
+    ~TreeReader();
+
+    // Read the next tree, ending with its semicolon. Text after the last semicolon of a
+    // newick file is a tree of its own, unless it is only whitespace. Returns false when
+    // there are no more trees.
+    bool Next(std::string &tree);
+
+    // Parse a tree read by Next, with the given parser for newick files, and with the
+    // TRANSLATE table for NEXUS files. The table does not change once a tree has been read,
+    // so several threads may parse the trees of one reader while it reads on.
+    Tree* Parse(const std::string &tree, NewickParser &parser) const;
+
+    bool IsNexus() const { return nexus; }
+
+private:
+    TreeReader(const TreeReader &);
+    TreeReader &operator=(const TreeReader &);
+
+    enum Compression {
+        NO_COMPRESSION,
+        GZIP_COMPRESSION,
+        ZSTD_COMPRESSION
+    };
+
+    static Compression DetectCompression(const std::string &filename);
+    // Read up to size decompressed bytes, returning how many, 0 at the end of the file
+    size_t Read(char* bytes, size_t size);
+    // Make sure there are unscanned bytes in the chunk. Returns false at the end of the file.
+    bool FillChunk();
+
+    bool NextNewick(std::string &newick);
+    bool NextNexus(std::string &description);
+    // Read the next NEXUS command up to its semicolon, without comments and with line
+    // breaks as spaces. Returns false at the end of the file.
+    bool NextNexusCommand(std::string &command);
+
+    std::string filename;
+    Compression compression;
+    FILE* file;
+    //a gzFile or a ZSTD_DStream*, kept opaque so users of this header need neither library
+    void* gzipFile;
+    void* zstdStream;
+    //whether the last zstd frame decompressed so far is complete, as it must be at the end
+    bool zstdFrameComplete;
+
+    //compressed bytes read for zstd, and the part of them not yet decompressed
+    std::vector<char> input;
+    size_t inputStart;
+    size_t inputEnd;
+
+    //decompressed bytes, and the part of them not yet scanned
+    std::vector<char> chunk;
+    size_t chunkStart;
+    size_t chunkEnd;
+
+    int parenthesesDepth;
+
+    bool nexus;
+    bool inTreesBlock;
+    long numTrees;
+    NexusParser nexusParser;
+};
+
+#endif
@@ -0,0 +1,241 @@
+#include "TreeSearch.hpp"
+
+#include <algorithm>
+#include <numeric>
+#include <cstdlib>
+#include <atomic>
+#include <queue>
+#include <thread>
+
+TreeSearch::TreeSearch(const std::vector<Tree*> &trees, int numPivots, int numThreads,
+                       const QDistOptions &options, const std::vector<long> &multiplicities)
+    : trees(trees),
+      multiplicities(multiplicities.empty() ? std::vector<long>(trees.size(), 1) : multiplicities),
+      butterflies(trees.size()),
+      numThreads(std::max(numThreads, 1)),
+      options(options),
+      pivots(),
+      pivotRows(),
+      numComparisons(0)
+{
+    const int n = trees.size();
+    for (int x = 0; x < n; x++)
+        butterflies[x] = NumButterflies(trees[x]);
+
+    //farthest-first: the next pivot is the tree farthest from the pivots so far
+    std::vector<long> nearestPivot(n, -1);
+    int next = 0;
+    for (int p = 0; p < std::min(numPivots, n); p++) {
+        //the distances to the pivots so far are in their rows already
+        std::vector<int> others;
+        for (int x = 0; x < n; x++)
+            if (std::find(pivots.begin(), pivots.end(), x) == pivots.end())
+                others.push_back(x);
+        std::vector<long> distances = Distances(trees[next], others);
+        std::vector<long> row(n);
+        for (unsigned q = 0; q < pivots.size(); q++)
+            row[pivots[q]] = pivotRows[q][next];
+        for (unsigned i = 0; i < others.size(); i++)
+            row[others[i]] = distances[i];
+
+        pivots.push_back(next);
+        pivotRows.push_back(row);
+
+        for (int x = 0; x < n; x++)
+            if (nearestPivot[x] == -1 || row[x] < nearestPivot[x])
+                nearestPivot[x] = row[x];
+        next = std::max_element(nearestPivot.begin(), nearestPivot.end()) - nearestPivot.begin();
+        if (nearestPivot[next] == 0)
+            break;
+    }
+}
+
+std::vector<long> TreeSearch::Distances(Tree* t, const std::vector<int> &indices) {
+    std::vector<long> distances(indices.size());
+    std::atomic<long> next(0);
+    std::atomic<long> computed(0);
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < std::min(numThreads, (int)indices.size()); i++)
+        threads.push_back(std::thread([&]() {
+            long k;
+            while ((k = next++) < (long)indices.size()) {
+                if (t == trees[indices[k]]) {
+                    distances[k] = 0;
+                    continue;
+                }
+                long b1, b2, shared, diff;
+                distances[k] = SubCubicQDist(t, trees[indices[k]], b1, b2, shared, diff, options);
+                computed++;
+            }
+        }));
+    for (unsigned i = 0; i < threads.size(); i++)
+        threads[i].join();
+
+    numComparisons += computed;
+    return distances;
+}
+
+std::vector<std::pair<long, int> > TreeSearch::NearestNeighbours(Tree* query, int k) {
+    const int n = trees.size();
+    k = std::min((long)k, std::accumulate(multiplicities.begin(), multiplicities.end(), 0L));
+
+    std::vector<long> queryRow = Distances(query, pivots);
+    long queryButterflies = NumButterflies(query);
+
+    //lower bounds, exact for the pivots
+    std::vector<long> lower(n);
+    std::vector<char> exact(n, 0);
+    for (int x = 0; x < n; x++)
+        lower[x] = std::abs(queryButterflies - butterflies[x]);
+    for (unsigned p = 0; p < pivots.size(); p++) {
+        for (int x = 0; x < n; x++)
+            lower[x] = std::max(lower[x], std::abs(queryRow[p] - pivotRows[p][x]));
+        lower[pivots[p]] = queryRow[p];
+        exact[pivots[p]] = 1;
+    }
+
+    std::vector<int> order(n);
+    for (int x = 0; x < n; x++)
+        order[x] = x;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return lower[a] < lower[b] || (lower[a] == lower[b] && a < b);
+    });
+
+    //the best trees so far, worst on top, standing for at least k trees once there are enough
+    std::priority_queue<std::pair<long, int> > best;
+    long bestTrees = 0;
+    auto add = [&](long distance, int x) {
+        best.push(std::make_pair(distance, x));
+        bestTrees += multiplicities[x];
+        while (bestTrees - multiplicities[best.top().second] >= k) {
+            bestTrees -= multiplicities[best.top().second];
+            best.pop();
+        }
+    };
+
+    unsigned i = 0;
+    while (i < order.size()) {
+        if (bestTrees >= k && lower[order[i]] >= best.top().first)
+            break;
+
+        //the next candidates that may still beat the k-th best, computed together
+        std::vector<int> batch;
+        for (; i < order.size() && (int)batch.size() < numThreads; i++) {
+            int x = order[i];
+            if (bestTrees >= k && lower[x] >= best.top().first)
+                break;
+            if (exact[x])
+                add(lower[x], x);
+            else
+                batch.push_back(x);
+        }
+
+        std::vector<long> distances = Distances(query, batch);
+        for (unsigned b = 0; b < batch.size(); b++)
+            add(distances[b], batch[b]);
+    }
+
+    std::vector<std::pair<long, int> > result;
+    for (; !best.empty(); best.pop())
+        result.push_back(best.top());
+    std::reverse(result.begin(), result.end());
+    return result;
+}
+
+std::pair<int, long> TreeSearch::Medoid() {
+    const long n = trees.size();
+    if (n == 0)
+        return std::make_pair(-1, 0L);
+
+    //the butterfly bound summed over all trees, from the sorted butterfly counts and the
+    //prefix sums of the multiplicities and of the butterflies they stand for
+    std::vector<long> lower(n, 0);
+    std::vector<std::pair<long, long> > sorted(n);
+    for (long x = 0; x < n; x++)
+        sorted[x] = std::make_pair(butterflies[x], multiplicities[x]);
+    std::sort(sorted.begin(), sorted.end());
+    std::vector<long> prefixTrees(n + 1, 0);
+    std::vector<long> prefix(n + 1, 0);
+    for (long i = 0; i < n; i++) {
+        prefixTrees[i + 1] = prefixTrees[i] + sorted[i].second;
+        prefix[i + 1] = prefix[i] + sorted[i].first * sorted[i].second;
+    }
+    const long numTrees = prefixTrees[n];
+    for (long x = 0; x < n; x++) {
+        long below = std::lower_bound(sorted.begin(), sorted.end(), std::make_pair(butterflies[x], 0L)) - sorted.begin();
+        lower[x] = butterflies[x] * prefixTrees[below] - prefix[below]
+                 + (prefix[n] - prefix[below]) - butterflies[x] * (numTrees - prefixTrees[below]);
+    }
+
+    //the rows of distances computed so far, by tree, or -1
+    std::vector<std::vector<long> > rows;
+    std::vector<int> rowOf(n, -1);
+    int bestTree = -1;
+    long bestSum = 0;
+
+    //a tree x with the sum E(x) bounds the sum of every other tree z: E(z) >= |E(x) - N*d(x,z)|,
+    //N the number of trees
+    auto addRow = [&](int x, const std::vector<long> &row) {
+        long sum = 0;
+        for (long y = 0; y < n; y++)
+            sum += multiplicities[y] * row[y];
+        for (long z = 0; z < n; z++)
+            lower[z] = std::max(lower[z], std::abs(sum - numTrees * row[z]));
+        lower[x] = sum;
+        rowOf[x] = rows.size();
+        rows.push_back(row);
+        if (bestTree == -1 || sum < bestSum) {
+            bestTree = x;
+            bestSum = sum;
+        }
+    };
+
+    for (unsigned p = 0; p < pivots.size(); p++)
+        addRow(pivots[p], pivotRows[p]);
+
+    //summing the pivot bounds of each pair separately is tighter than bounding the sums
+    if (!pivots.empty())
+        for (long z = 0; z < n; z++) {
+            if (rowOf[z] != -1)
+                continue;
+            long sum = 0;
+            for (long y = 0; y < n; y++) {
+                long pair = std::abs(butterflies[z] - butterflies[y]);
+                for (unsigned p = 0; p < pivots.size(); p++)
+                    pair = std::max(pair, std::abs(pivotRows[p][y] - pivotRows[p][z]));
+                sum += multiplicities[y] * pair;
+            }
+            lower[z] = std::max(lower[z], sum);
+        }
+
+    std::vector<int> order(n);
+    for (long x = 0; x < n; x++)
+        order[x] = x;
+    std::sort(order.begin(), order.end(), [&](int a, int b) {
+        return lower[a] < lower[b] || (lower[a] == lower[b] && a < b);
+    });
+
+    for (long i = 0; i < n; i++) {
+        int x = order[i];
+        if (rowOf[x] != -1 || (bestTree != -1 && lower[x] >= bestSum))
+            continue;
+
+        //the distances to the trees with rows are known already
+        std::vector<long> row(n, 0);
+        std::vector<int> missing;
+        for (long y = 0; y < n; y++) {
+            if (rowOf[y] != -1)
+                row[y] = rows[rowOf[y]][x];
+            else if (y != x)
+                missing.push_back(y);
+        }
+        std::vector<long> distances = Distances(trees[x], missing);
+        for (unsigned m = 0; m < missing.size(); m++)
+            row[missing[m]] = distances[m];
+
+        addRow(x, row);
+    }
+
+    return std::make_pair(bestTree, bestSum);
+}
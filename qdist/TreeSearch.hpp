@@ -0,0 +1,69 @@
+#ifndef TREE_SEARCH_H
+#define TREE_SEARCH_H
+
+#include "Tree.hpp"
+#include "QDist.hpp"
+
+#include <utility>
+#include <vector>
+
+/*
+ * Exact nearest neighbour and medoid search over a collection of trees on the same leaves,
+ * computing as few quartet distances as possible.
+ *
+ * The quartet distance is a metric, so the distances to a few pivot trees bound every other
+ * distance by the triangle inequality, |d(q,p) - d(p,x)| <= d(q,x). So does the number of
+ * butterflies, |B(q) - B(x)| <= d(q,x), since every butterfly of one tree that is not a
+ * butterfly of the other is a quartet with different topologies. The pivots are picked
+ * farthest-first, and their distances to all trees computed up front.
+ *
+ * A k-nearest-neighbour query visits the trees by increasing lower bound and stops once the
+ * bound reaches the k-th best distance found. The medoid search bounds the sum of distances
+ * of every tree the same way, from the pivots and from every tree whose sum it computes in
+ * full, and skips the trees whose bound is no better than the best sum found.
+ *
+ * A tree may stand for several trees of the same topology, given by its multiplicity. The
+ * sums of the medoid search and the k of a query then count every tree it stands for, so
+ * a collection collapsed to its distinct topologies is searched as a whole.
+ *
+ * The trees must have been renumbered canonically, see TreeUtil::RenumberTreeCanonically.
+ * Distances are computed on numThreads threads.
+ */
+class TreeSearch {
+public:
+    // multiplicities is empty, or the number of trees each tree stands for
+    TreeSearch(const std::vector<Tree*> &trees, int numPivots, int numThreads,
+               const QDistOptions &options = QDistOptions(),
+               const std::vector<long> &multiplicities = std::vector<long>());
+
+    // The trees closest to query, as pairs of distance and index, closest first, enough of
+    // them to stand for k trees
+    std::vector<std::pair<long, int> > NearestNeighbours(Tree* query, int k);
+
+    // The tree with the smallest sum of distances to all trees, as its index and the sum
+    std::pair<int, long> Medoid();
+
+    // The number of quartet distances computed so far, pivots included
+    long NumComparisons() const { return numComparisons; }
+
+private:
+    TreeSearch(const TreeSearch &);
+    TreeSearch &operator=(const TreeSearch &);
+
+    // the distances of the pairs (t, trees[indices[i]]), on the threads
+    std::vector<long> Distances(Tree* t, const std::vector<int> &indices);
+
+    std::vector<Tree*> trees;
+    std::vector<long> multiplicities;
+    std::vector<long> butterflies;
+    int numThreads;
+    QDistOptions options;
+
+    std::vector<int> pivots;
+    //distances from each pivot to every tree
+    std::vector<std::vector<long> > pivotRows;
+
+    long numComparisons;
+};
+
+#endif
@@ -1,9 +1,13 @@
 #include "TreeUtil.hpp"
+#include "Util.hpp"
 #include <iostream>
 #include <string>
 #include <assert.h>
 #include <utility>
 #include <algorithm>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
 
 TreeUtil::TreeUtil() {
 }
@@ -28,28 +32,40 @@ void TreeUtil::PrintTree(Tree* tree) {
 
 // helper function - prints a (sub)tree
 void TreeUtil::PrintSubtree(Node* node, Node* fromNode=NULL, int indent=0) {
-    for (int i = 0; i < indent; i++)
-        std::cout << " ";
+    //nodes still to print, with the node they were reached from and their indentation
+    struct Entry { Node* node; Node* fromNode; int indent; };
+    std::vector<Entry> stack;
+    Entry first = {node, fromNode, indent};
+    stack.push_back(first);
 
-    std::cout << node->GetLabel();
+    while (!stack.empty()) {
+        Entry entry = stack.back();
+        stack.pop_back();
 
-    if (node->isLeaf()) {
-        LeafNode* leaf = (LeafNode*)node;
-        std::cout << "leaf_id=" << leaf->GetLeafId();
-    }
+        for (int i = 0; i < entry.indent; i++)
+            std::cout << " ";
 
-    std::cout << std::endl;
+        std::cout << entry.node->GetLabel();
 
-    if (node->isInternal()) {
-        InternalNode* internal = (InternalNode*)node;
-        std::string::size_type i;
-        for (i = 0; i < internal->GetEdges().size(); i++) {
-            Node* neighbor = internal->GetEdges()[i]->GetToNode();
-            if (neighbor != fromNode)
-                TreeUtil::PrintSubtree(neighbor, internal, indent+1);
+        if (entry.node->isLeaf()) {
+            LeafNode* leaf = (LeafNode*)entry.node;
+            std::cout << "leaf_id=" << leaf->GetLeafId();
         }
-    }
 
+        std::cout << std::endl;
+
+        if (entry.node->isInternal()) {
+            InternalNode* internal = (InternalNode*)entry.node;
+            //push in reverse, so the neighbors are printed in order
+            for (std::vector<DirectedEdge*>::size_type i = internal->GetEdges().size(); i-- > 0; ) {
+                Node* neighbor = internal->GetEdges()[i]->GetToNode();
+                if (neighbor != entry.fromNode) {
+                    Entry next = {neighbor, internal, entry.indent + 1};
+                    stack.push_back(next);
+                }
+            }
+        }
+    }
 }
 
 /*
@@ -78,46 +94,52 @@ void TreeUtil::CheckTree(Tree* tree) {
 
 // helper function for the CheckTree function - checks a subtree
 void TreeUtil::CheckSubtree(Node* node, Node* fromNode=NULL) {
-    if (node->isInternal()) {
-        InternalNode* internal = (InternalNode*)node;
-        std::string::size_type i;
-        for (i = 0; i < internal->GetEdges().size(); i++) {
-            DirectedEdge* edge = internal->GetEdges()[i];
+    //nodes still to check, with the node they were reached from
+    std::vector<std::pair<Node*, Node*> > stack;
+    stack.push_back(std::make_pair(node, fromNode));
+
+    while (!stack.empty()) {
+        node = stack.back().first;
+        fromNode = stack.back().second;
+        stack.pop_back();
+
+        if (node->isInternal()) {
+            InternalNode* internal = (InternalNode*)node;
+            std::string::size_type i;
+            for (i = 0; i < internal->GetEdges().size(); i++) {
+                DirectedEdge* edge = internal->GetEdges()[i];
+                Node* thisNode = edge->GetFromNode();
+                Node* neighbor = edge->GetToNode();
+
+                //check stuff
+                assert(thisNode != NULL);
+                assert(thisNode == internal);
+                assert(neighbor != NULL);
+
+                //continue checking
+                if (neighbor != fromNode)
+                    stack.push_back(std::make_pair(neighbor, (Node*)internal));
+            }
+        }
+        else if (node->isLeaf()) {
+            LeafNode* leaf = (LeafNode*)node;
+            DirectedEdge* edge = leaf->GetEdge();
+
+            //check stuff
+            assert(edge != NULL);
+
             Node* thisNode = edge->GetFromNode();
             Node* neighbor = edge->GetToNode();
 
             //check stuff
             assert(thisNode != NULL);
-            assert(thisNode == internal);
+            assert(thisNode == leaf);
             assert(neighbor != NULL);
-
-            //continue checking
-            if (neighbor != fromNode)
-                TreeUtil::CheckSubtree(neighbor, internal);
+            assert(neighbor == fromNode);
         }
-        //std::cout << "CHECKED InternalNode: " << internal->GetLabel() << std::endl;
-    }
-    else if (node->isLeaf()) {
-        LeafNode* leaf = (LeafNode*)node;
-        DirectedEdge* edge = leaf->GetEdge();
-
-        //check stuff
-        assert(edge != NULL);
-
-        Node* thisNode = edge->GetFromNode();
-        Node* neighbor = edge->GetToNode();
-
-        //check stuff
-        assert(thisNode != NULL);
-        assert(thisNode == leaf);
-        assert(neighbor != NULL);
-        assert(neighbor == fromNode);
-
-        //std::cout << "CHECKED LeafNode: " << leaf->GetLabel() << std::endl;
     }
 }
 
-
 /*
  * Renumber the leaves in one tree such that both trees have the same leaf-label-leaf-id correspondance
  */
@@ -142,6 +164,59 @@ void TreeUtil::RenumberTreeAccordingToOther(Tree* tree, Tree* other) {
     tree->SetLeafNodeList(newOrderLeaves);
 }
 
+static bool LeafLabelLess(const LeafNode* a, const LeafNode* b) {
+    return a->GetLabel() < b->GetLabel();
+}
+
+/*
+ * Renumber the leaves by the order of their labels. Trees over the same leaf labels then have
+ * the same leaf-label-leaf-id correspondance without renumbering one after the other.
+ */
+void TreeUtil::RenumberTreeCanonically(Tree* tree) {
+    std::vector<LeafNode*> newOrderLeaves = tree->GetLeafNodes();
+    std::sort(newOrderLeaves.begin(), newOrderLeaves.end(), LeafLabelLess);
+
+    for (unsigned i = 0; i < newOrderLeaves.size(); i++)
+        newOrderLeaves[i]->SetLeafId(i);
+
+    tree->SetLeafNodeList(newOrderLeaves);
+}
+
+/*
+ * Check that two trees have the same leaf labels at every leaf id, as two canonically
+ * numbered trees over the same leaves do.
+ */
+bool TreeUtil::HaveSameLeaves(Tree* t1, Tree* t2) {
+    if (t1->NumLeafNodes() != t2->NumLeafNodes())
+        return false;
+    for (int i = 0; i < t1->NumLeafNodes(); i++)
+        if (t1->GetLeafNode(i)->GetLabel() != t2->GetLeafNode(i)->GetLabel())
+            return false;
+    return true;
+}
+
+/*
+ * Store the subtree leaf set sizes and the edges pointing away from the root in the tree,
+ * for a tree that takes part in many comparisons.
+ */
+void TreeUtil::PrecomputeSubtreeData(Tree* tree) {
+    tree->SetSubtreeLeafSetSizes(TreeUtil::SubtreeLeafSetSizes(tree));
+    tree->SetDownEdges(TreeUtil::CollectEdgesPointingAwayFromRoot(tree));
+}
+
+/*
+ * Delete the tree with all its nodes and edges.
+ */
+void TreeUtil::DeleteTree(Tree* tree) {
+    for (int i = 0; i < tree->NumInternalNodes(); i++)
+        delete tree->GetInternalNode(i);
+    for (int i = 0; i < tree->NumLeafNodes(); i++)
+        delete tree->GetLeafNode(i);
+    for (int i = 0; i < tree->NumEdges(); i++)
+        delete tree->GetEdge(i);
+    delete tree;
+}
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Subtree Leaf Set Size
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -151,62 +226,238 @@ void TreeUtil::RenumberTreeAccordingToOther(Tree* tree, Tree* other) {
  * identified by the edge.
  */
 std::vector<int> TreeUtil::SubtreeLeafSetSizes(Tree* tree) {
-    std::vector<int> subtreeLeafSetSizes(tree->NumEdges(), -1);
+    if (!tree->GetSubtreeLeafSetSizes().empty())
+        return tree->GetSubtreeLeafSetSizes();
 
-    TreeUtil::CountLeavesDownwards(tree->GetRoot(), NULL, &subtreeLeafSetSizes);
-    TreeUtil::CalcLeavesUpwards(tree, &subtreeLeafSetSizes);
+    //the sizes are the lengths of the leaf spans
+    LeafIntervals intervals(tree);
+    std::vector<int> subtreeLeafSetSizes(tree->NumEdges());
+    for (int i = 0; i < tree->NumEdges(); i++)
+        subtreeLeafSetSizes[i] = intervals.Size(tree->GetEdge(i));
 
     return subtreeLeafSetSizes;
 }
 
+////////////////////////////////////////////////////////////////////////////////////////////////////
+// Split hashes
+////////////////////////////////////////////////////////////////////////////////////////////////////
+
 /*
- * Helper function for SubtreeLeafSetSizes.
- * Recursively count the number of leaves in each subtree denoted by an
- * edge pointing away from the root.
+ * A random-looking 64-bit hash of a leaf label, the same in every tree.
  */
-int TreeUtil::CountLeavesDownwards(Node* node, Node* fromNode, std::vector<int>* subtreeLeafSetSizes) {
-    int count = 0;
-    if (node->isInternal()) {
-        InternalNode* internal = (InternalNode*)node;
+static uint64_t LeafHash(const std::string &label) {
+    return Util::MixHash(Util::HashString(label));
+}
 
-        const std::vector<DirectedEdge*> &edges = internal->GetEdges();
-        for (std::vector<DirectedEdge*>::size_type i = 0; i < edges.size(); i++) {
-            DirectedEdge* edge = edges[i];
-            Node* toNode = edge->GetToNode();
-
-            if (toNode != fromNode) {
-                int tmpCount = TreeUtil::CountLeavesDownwards(toNode, internal, subtreeLeafSetSizes);
-                //store the count for the subtree identified by edge
-                (*subtreeLeafSetSizes)[edge->GetEdgeId()] = tmpCount;
-                //add to the overall count
-                count += tmpCount;
-            }
+/*
+ * Calculate for each directed edge a hash of the leaf set of the subtree identified by the
+ * edge, the XOR of the hashes of its leaves. The two edges of a split get complementary
+ * hashes, whose XOR is the hash of all leaves. The hashes depend only on the leaf labels, so
+ * equal leaf sets in different trees get equal hashes.
+ */
+std::vector<uint64_t> TreeUtil::SplitHashes(Tree* tree) {
+    std::vector<uint64_t> hashes(tree->NumEdges(), 0);
+
+    uint64_t allLeaves = 0;
+    for (int i = 0; i < tree->NumLeafNodes(); i++)
+        allLeaves ^= LeafHash(tree->GetLeafNode(i)->GetLabel());
+
+    //in reverse preorder the subtrees below an edge are done before the edge itself
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(tree);
+    for (std::vector<DirectedEdge*>::size_type k = downEdges.size(); k-- > 0; ) {
+        DirectedEdge* edge = downEdges[k];
+        Node* toNode = edge->GetToNode();
+
+        uint64_t hash = 0;
+        if (toNode->isLeaf())
+            hash = LeafHash(toNode->GetLabel());
+        else {
+            const std::vector<DirectedEdge*> &edges = ((InternalNode*)toNode)->GetEdges();
+            for (std::vector<DirectedEdge*>::size_type i = 0; i < edges.size(); i++)
+                if (edges[i] != edge->GetBackEdge())
+                    hash ^= hashes[edges[i]->GetEdgeId()];
+        }
 
-            //clean up
-            edge = 0;
-            toNode = 0;
+        hashes[edge->GetEdgeId()] = hash;
+        hashes[edge->GetBackEdge()->GetEdgeId()] = hash ^ allLeaves;
+    }
+
+    return hashes;
+}
+
+/*
+ * One hash for each distinct non-trivial split of the tree, the smaller of the hashes of its
+ * two sides, in no particular order. A node of degree two, e.g. the root of a rooted tree,
+ * has the same split on both of its edges, which is only listed once. Duplicates are dropped
+ * with a hash set, so this takes O(n) expected time.
+ */
+std::vector<uint64_t> TreeUtil::NontrivialSplitHashes(Tree* tree) {
+    std::vector<uint64_t> hashes = TreeUtil::SplitHashes(tree);
+    std::vector<int> sizes = TreeUtil::SubtreeLeafSetSizes(tree);
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(tree);
+
+    std::unordered_set<uint64_t> seen;
+    seen.reserve(downEdges.size());
+    std::vector<uint64_t> splits;
+    splits.reserve(downEdges.size());
+    for (unsigned k = 0; k < downEdges.size(); k++) {
+        DirectedEdge* edge = downEdges[k];
+        //a split with a single leaf on one side is trivial
+        int size = sizes[edge->GetEdgeId()];
+        if (size < 2 || size > tree->NumLeafNodes() - 2)
+            continue;
+
+        uint64_t hash = std::min(hashes[edge->GetEdgeId()], hashes[edge->GetBackEdge()->GetEdgeId()]);
+        if (seen.insert(hash).second)
+            splits.push_back(hash);
+    }
+    return splits;
+}
+
+/*
+ * Helper function. The hash of all leaves of a tree, the XOR of the leaf hashes.
+ */
+static uint64_t LeafSetHash(Tree* tree) {
+    uint64_t hash = 0;
+    for (int i = 0; i < tree->NumLeafNodes(); i++)
+        hash ^= LeafHash(tree->GetLeafNode(i)->GetLabel());
+    return hash;
+}
+
+/*
+ * A hash of the unrooted topology of a tree and its leaf labels, the same however the tree
+ * is rooted, numbered or ordered: the hash of the leaf set chained with the non-trivial split
+ * hashes, sorted so their order does not matter.
+ */
+uint64_t TreeUtil::TopologyHash(Tree* tree) {
+    std::vector<uint64_t> splits = TreeUtil::NontrivialSplitHashes(tree);
+    std::sort(splits.begin(), splits.end());
+
+    uint64_t hash = Util::MixHash(LeafSetHash(tree));
+    for (unsigned i = 0; i < splits.size(); i++)
+        hash = Util::MixHash(hash ^ splits[i]);
+    return hash;
+}
+
+/*
+ * Helper function. An id of the unrooted topology of a tree and its leaf labels, equal for
+ * two trees exactly when they have the same leaves and splits. The tree is hung from the
+ * leaf with the smallest label, and each subtree below it gets an id from the sorted ids of
+ * its children, with the shape ids shared by all trees numbered in shapes. A leaf is -1 minus
+ * the number of its label in labels, and a node with a single child, e.g. a root of degree
+ * two, is its child. The subtrees are visited with an explicit stack, as trees may be deep.
+ */
+static int TopologyId(Tree* tree, std::map<std::string, int> &labels, std::map<std::vector<int>, int> &shapes) {
+    LeafNode* first = tree->GetLeafNode(0);
+    for (int i = 1; i < tree->NumLeafNodes(); i++)
+        if (tree->GetLeafNode(i)->GetLabel() < first->GetLabel())
+            first = tree->GetLeafNode(i);
+    std::map<std::string, int>::iterator label = labels.insert(std::make_pair(first->GetLabel(), (int)labels.size())).first;
+    std::vector<int> top(1, -1 - label->second);
+    if (first->GetEdge() == NULL)
+        return shapes.insert(std::make_pair(top, (int)shapes.size())).first->second;
+
+    std::vector<int> ids(tree->NumEdges());
+    std::vector<std::pair<DirectedEdge*, bool> > stack(1, std::make_pair(first->GetEdge(), false));
+    while (!stack.empty()) {
+        DirectedEdge* edge = stack.back().first;
+        bool childrenDone = stack.back().second;
+        stack.pop_back();
+        Node* node = edge->GetToNode();
+
+        if (node->isLeaf()) {
+            label = labels.insert(std::make_pair(node->GetLabel(), (int)labels.size())).first;
+            ids[edge->GetEdgeId()] = -1 - label->second;
+            continue;
+        }
+
+        const std::vector<DirectedEdge*> &edges = ((InternalNode*)node)->GetEdges();
+        if (!childrenDone) {
+            stack.push_back(std::make_pair(edge, true));
+            for (unsigned i = 0; i < edges.size(); i++)
+                if (edges[i] != edge->GetBackEdge())
+                    stack.push_back(std::make_pair(edges[i], false));
+            continue;
         }
 
-        internal = 0;
+        std::vector<int> children;
+        for (unsigned i = 0; i < edges.size(); i++)
+            if (edges[i] != edge->GetBackEdge())
+                children.push_back(ids[edges[i]->GetEdgeId()]);
+        std::sort(children.begin(), children.end());
+        ids[edge->GetEdgeId()] = children.size() == 1 ? children[0]
+                               : shapes.insert(std::make_pair(children, (int)shapes.size())).first->second;
     }
-    else if (node->isLeaf()) {
-        count = 1;
+
+    top.push_back(ids[first->GetEdge()->GetEdgeId()]);
+    return shapes.insert(std::make_pair(top, (int)shapes.size())).first->second;
+}
+
+/*
+ * For each tree the index of the first tree with the same leaves and unrooted topology, its
+ * own index if there is none before it. Trees are grouped by their topology hashes, and a
+ * tree whose hash matches is compared exactly with the trees of its group by TopologyId, so
+ * a hash collision never merges two different topologies.
+ */
+std::vector<int> TreeUtil::FindDuplicateTopologies(const std::vector<Tree*> &trees) {
+    std::vector<int> representatives(trees.size());
+    std::unordered_map<uint64_t, std::vector<int> > byHash;
+
+    //the exact ids, only computed for trees whose hashes match
+    std::map<std::string, int> labels;
+    std::map<std::vector<int>, int> shapes;
+    std::vector<int> ids(trees.size());
+    std::vector<bool> haveId(trees.size(), false);
+
+    for (unsigned i = 0; i < trees.size(); i++) {
+        representatives[i] = i;
+        std::vector<int> &group = byHash[TreeUtil::TopologyHash(trees[i])];
+        for (unsigned g = 0; g < group.size(); g++) {
+            int j = group[g];
+            if (trees[j]->NumLeafNodes() != trees[i]->NumLeafNodes())
+                continue;
+            if (!haveId[i]) {
+                ids[i] = TopologyId(trees[i], labels, shapes);
+                haveId[i] = true;
+            }
+            if (!haveId[j]) {
+                ids[j] = TopologyId(trees[j], labels, shapes);
+                haveId[j] = true;
+            }
+            if (ids[i] == ids[j]) {
+                representatives[i] = j;
+                break;
+            }
+        }
+        if (representatives[i] == (int)i)
+            group.push_back(i);
     }
-    
-    return count;
+
+    return representatives;
 }
 
 /*
- * Helper function for SubtreeLeafSetSizes.
- * Calculate the number of leaves in subtrees pointing towards the root.
+ * A hash of the tree as numbered: its leaf labels by leaf id, and the edges out of each
+ * internal node by edge id and the node they point to. Computations that visit the nodes or
+ * edges by id, like Count(), see the same tree exactly when the fingerprints agree.
  */
-void TreeUtil::CalcLeavesUpwards(Tree* tree, std::vector<int>* subtreeLeafSetSizes) {
-    for (int i = 0; i < tree->NumEdges(); i++) {
-        if ((*subtreeLeafSetSizes)[i] == -1) {
-            int backEdgeId = tree->GetEdge(i)->GetBackEdge()->GetEdgeId();
-            (*subtreeLeafSetSizes)[i] = tree->NumLeafNodes() - (*subtreeLeafSetSizes)[backEdgeId];
+uint64_t TreeUtil::Fingerprint(Tree* tree) {
+    uint64_t hash = Util::MixHash(tree->NumLeafNodes());
+    for (int i = 0; i < tree->NumLeafNodes(); i++)
+        hash = Util::MixHash(hash ^ Util::HashString(tree->GetLeafNode(i)->GetLabel()));
+
+    for (int n = 0; n < tree->NumInternalNodes(); n++) {
+        const std::vector<DirectedEdge*> &edges = tree->GetInternalNode(n)->GetEdges();
+        hash = Util::MixHash(hash ^ edges.size());
+        for (unsigned i = 0; i < edges.size(); i++) {
+            Node* toNode = edges[i]->GetToNode();
+            long to = toNode->isLeaf() ? ~((LeafNode*)toNode)->GetLeafId() : ((InternalNode*)toNode)->GetInternalId();
+            hash = Util::MixHash(hash ^ edges[i]->GetEdgeId());
+            hash = Util::MixHash(hash ^ to);
         }
     }
+
+    return hash;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -215,9 +466,11 @@ void TreeUtil::CalcLeavesUpwards(Tree* tree, std::vector<int>* subtreeLeafSetSiz
 
 /*
  * Calculate, for each pair of directed edges, the number of leaves common to the two subtrees
- * identified by the two edges.
+ * identified by the two edges. The result is written to sharedLeafSetSizes.
  */
-std::vector< std::vector<int> > TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree* t2) {
+template<typename Size>
+void TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree* t2, SharedLeafSetTable<Size>* sharedLeafSetSizes,
+                                      SharedLeafSetEngine engine) {
     //calculate the sizes of each subtree in the two trees
     std::vector<int> t1LeafSetSizes = TreeUtil::SubtreeLeafSetSizes(t1);
     std::vector<int> t2LeafSetSizes = TreeUtil::SubtreeLeafSetSizes(t2);
@@ -226,15 +479,12 @@ std::vector< std::vector<int> > TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree*
     std::vector<DirectedEdge*> t1DownEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(t1);
     std::vector<DirectedEdge*> t2DownEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(t2);
 
-    //a matrix to hold the result. initially filled with -1 in each entry
-    std::vector< std::vector<int> > sharedLeafSetSizes(t1->NumEdges(), std::vector<int>(t2->NumEdges(), -1));
-
-
     //calculate shared leaf set sizes for all down-down pairs of edges
-    for (std::vector<DirectedEdge*>::size_type i = 0; i < t1DownEdges.size(); i++) {
-        for (std::vector<DirectedEdge*>::size_type j = 0; j < t2DownEdges.size(); j++) {
-            TreeUtil::CalcSharedLeafSetSizesDownDown(t1DownEdges[i], t2DownEdges[j], &sharedLeafSetSizes);
-        }
+    if (engine == BITSET_ENGINE) {
+        TreeUtil::CalcSharedLeafSetSizesDownDownBitset(t1, t2, t1DownEdges, t2DownEdges, sharedLeafSetSizes);
+    }
+    else {
+        TreeUtil::CalcSharedLeafSetSizesDownDown(t1DownEdges, t2DownEdges, sharedLeafSetSizes);
     }
 
     //calculate shared leaf set sizes for remaining pairs of edges
@@ -244,80 +494,163 @@ std::vector< std::vector<int> > TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree*
             int t1UpEdgeId = t1DownEdges[i]->GetBackEdge()->GetEdgeId();
             int t2DownEdgeId = t2DownEdges[j]->GetEdgeId();
             int t2UpEdgeId = t2DownEdges[j]->GetBackEdge()->GetEdgeId();
+            int downDown = (*sharedLeafSetSizes)[t1DownEdgeId][t2DownEdgeId];
 
             //up-down
-            sharedLeafSetSizes[t1UpEdgeId][t2DownEdgeId] = t2LeafSetSizes[t2DownEdgeId] - sharedLeafSetSizes[t1DownEdgeId][t2DownEdgeId];
+            (*sharedLeafSetSizes)[t1UpEdgeId][t2DownEdgeId] = t2LeafSetSizes[t2DownEdgeId] - downDown;
             //down-up
-            sharedLeafSetSizes[t1DownEdgeId][t2UpEdgeId] = t1LeafSetSizes[t1DownEdgeId] - sharedLeafSetSizes[t1DownEdgeId][t2DownEdgeId];
+            (*sharedLeafSetSizes)[t1DownEdgeId][t2UpEdgeId] = t1LeafSetSizes[t1DownEdgeId] - downDown;
             //up-up
-            sharedLeafSetSizes[t1UpEdgeId][t2UpEdgeId] = t1->NumLeafNodes() - (t1LeafSetSizes[t1DownEdgeId] + t2LeafSetSizes[t2DownEdgeId] - sharedLeafSetSizes[t1DownEdgeId][t2DownEdgeId]);
+            (*sharedLeafSetSizes)[t1UpEdgeId][t2UpEdgeId] = t1->NumLeafNodes() - (t1LeafSetSizes[t1DownEdgeId] + t2LeafSetSizes[t2DownEdgeId] - downDown);
 
         }
     }
-
-    return sharedLeafSetSizes;
 }
 
 /*
  * Helper function for CalcSharedLeafSetSizes.
- * Recursively calculate the shared leaf set sizes for all pairs of subtrees in the two subtrees given
+ * Calculate the shared leaf set sizes for all pairs of edges pointing away from the roots.
+ *
+ * Both lists of edges are in preorder, so going through them backwards visits the edges below
+ * an edge before the edge itself. The size of a pair is then the sum of already calculated
+ * sizes: over the edges below e1, or, if e1 points to a leaf, over the edges below e2.
  */
-void TreeUtil::CalcSharedLeafSetSizesDownDown(DirectedEdge* e1, DirectedEdge* e2, std::vector< std::vector<int> >* sharedLeafSetSizes) {
+template<typename Size>
+void TreeUtil::CalcSharedLeafSetSizesDownDown(const std::vector<DirectedEdge*> &t1DownEdges,
+                                              const std::vector<DirectedEdge*> &t2DownEdges,
+                                              SharedLeafSetTable<Size>* sharedLeafSetSizes) {
 
-    Node* n1 = e1->GetToNode();
-    Node* n2 = e2->GetToNode();
-
-    int e1_id = e1->GetEdgeId();
-    int e2_id = e2->GetEdgeId();
-
-    //shared leaf set size not yet calculated
-    if ((*sharedLeafSetSizes)[e1_id][e2_id] == -1) {
+    for (std::vector<DirectedEdge*>::size_type i = t1DownEdges.size(); i-- > 0; ) {
+        DirectedEdge* e1 = t1DownEdges[i];
+        Node* n1 = e1->GetToNode();
+        Size* row = (*sharedLeafSetSizes)[e1->GetEdgeId()];
 
         //first is a leaf
         if (n1->isLeaf()) {
-            LeafNode* leaf1 = (LeafNode*)n1;
+            int leafId1 = ((LeafNode*)n1)->GetLeafId();
 
-            //second is also leaf
-            if (n2->isLeaf()) {
-                LeafNode* leaf2 = (LeafNode*)n2;
+            for (std::vector<DirectedEdge*>::size_type j = t2DownEdges.size(); j-- > 0; ) {
+                DirectedEdge* e2 = t2DownEdges[j];
+                Node* n2 = e2->GetToNode();
 
-                //compare them
-                if (leaf1->GetLeafId() == leaf2->GetLeafId())
-                    (*sharedLeafSetSizes)[e1_id][e2_id] = 1; //same leaves
-                else
-                    (*sharedLeafSetSizes)[e1_id][e2_id] = 0; //diff leaves
-            }
-            //second is internal. recurse
-            else {
-                InternalNode* internal2 = (InternalNode*)n2;
-                int sum = 0;
-                for (std::vector<DirectedEdge*>::size_type i = 0; i < internal2->GetEdges().size(); i++) {
-                    DirectedEdge* e2sub = internal2->GetEdges()[i];
-                    if (e2sub != e2->GetBackEdge()) { //ensure that the edge points downwards
-                        CalcSharedLeafSetSizesDownDown(e1, e2sub, sharedLeafSetSizes);
-                        sum += (*sharedLeafSetSizes)[e1_id][e2sub->GetEdgeId()];
-                    }
+                //second is also leaf, compare them
+                if (n2->isLeaf()) {
+                    row[e2->GetEdgeId()] = ((LeafNode*)n2)->GetLeafId() == leafId1 ? 1 : 0;
+                }
+                //second is internal, sum over the edges below it
+                else {
+                    const std::vector<DirectedEdge*> &edges2 = ((InternalNode*)n2)->GetEdges();
+                    int sum = 0;
+                    for (std::vector<DirectedEdge*>::size_type k = 0; k < edges2.size(); k++)
+                        if (edges2[k] != e2->GetBackEdge()) //ensure that the edge points downwards
+                            sum += row[edges2[k]->GetEdgeId()];
+                    row[e2->GetEdgeId()] = sum;
                 }
-                (*sharedLeafSetSizes)[e1_id][e2_id] = sum;
             }
         }
-        //first is internal. recurse
+        //first is internal, sum the rows of the edges below it
         else {
-            InternalNode* internal1 = (InternalNode*)n1;
-            int sum = 0;
-            for (std::vector<DirectedEdge*>::size_type i = 0; i < internal1->GetEdges().size(); i++) {
-                DirectedEdge* e1sub = internal1->GetEdges()[i];
-                if (e1sub != e1->GetBackEdge()) { //ensure that the edge points downwards
-                    CalcSharedLeafSetSizesDownDown(e1sub, e2, sharedLeafSetSizes);
-                    sum += (*sharedLeafSetSizes)[e1sub->GetEdgeId()][e2_id];
+            const std::vector<DirectedEdge*> &edges1 = ((InternalNode*)n1)->GetEdges();
+            bool first = true;
+            for (std::vector<DirectedEdge*>::size_type k = 0; k < edges1.size(); k++) {
+                if (edges1[k] == e1->GetBackEdge()) //ensure that the edge points downwards
+                    continue;
+
+                const Size* subRow = (*sharedLeafSetSizes)[edges1[k]->GetEdgeId()];
+                for (std::vector<DirectedEdge*>::size_type j = 0; j < t2DownEdges.size(); j++) {
+                    int e2_id = t2DownEdges[j]->GetEdgeId();
+                    row[e2_id] = first ? subRow[e2_id] : Size(row[e2_id] + subRow[e2_id]);
                 }
+                first = false;
+            }
+        }
+    }
+
+}
+
+/*
+ * Helper function for CalcSharedLeafSetSizes.
+ * Calculate the shared leaf set sizes for all pairs of edges pointing away from the roots
+ * with bitsets.
+ *
+ * The leaves are numbered in the order a depth-first traversal of t1 meets them, so the leaves
+ * below any down edge of t1 form an interval [lo,hi) of positions. Each down edge of t2 gets a
+ * bitset over these positions together with the number of bits set before each word, and the
+ * shared leaf set size is then the number of bits set in the interval, i.e. two popcounts.
+ * The bitsets are laid out word by word across all t2 edges, so computing a row of the table
+ * streams through two contiguous words arrays.
+ */
+template<typename Size>
+void TreeUtil::CalcSharedLeafSetSizesDownDownBitset(Tree* t1, Tree* t2,
+                                                    const std::vector<DirectedEdge*> &t1DownEdges,
+                                                    const std::vector<DirectedEdge*> &t2DownEdges,
+                                                    SharedLeafSetTable<Size>* sharedLeafSetSizes) {
+    const int n = t1->NumLeafNodes();
+    const int numT2Edges = t2DownEdges.size();
+    //one extra word so the end of an interval always has a word to look in
+    const int numWords = n / 64 + 1;
+
+    //the leaves below each t1 down edge are an interval of positions
+    LeafIntervals t1Intervals(t1);
+
+    //bitsets of the t2 down edges, built bottom-up in reverse preorder
+    std::vector<int> t2Index(t2->NumEdges(), -1);
+    for (int k = 0; k < numT2Edges; k++)
+        t2Index[t2DownEdges[k]->GetEdgeId()] = k;
+
+    std::vector<unsigned long> words((long)numWords * numT2Edges, 0);
+    for (int k = numT2Edges - 1; k >= 0; k--) {
+        Node* toNode = t2DownEdges[k]->GetToNode();
+        if (toNode->isLeaf()) {
+            int p = t1Intervals.Position(((LeafNode*)toNode)->GetLeafId());
+            words[(long)(p >> 6) * numT2Edges + k] |= 1UL << (p & 63);
+        }
+        else {
+            const std::vector<DirectedEdge*> &edges = ((InternalNode*)toNode)->GetEdges();
+            for (unsigned e = 0; e < edges.size(); e++) {
+                if (edges[e] == t2DownEdges[k]->GetBackEdge())
+                    continue;
+                int child = t2Index[edges[e]->GetEdgeId()];
+                for (int w = 0; w < numWords; w++)
+                    words[(long)w * numT2Edges + k] |= words[(long)w * numT2Edges + child];
             }
-            (*sharedLeafSetSizes)[e1_id][e2_id] = sum;
         }
     }
 
+    //number of bits set before each word
+    std::vector<int> ranks((long)numWords * numT2Edges, 0);
+    for (int w = 1; w < numWords; w++)
+        for (int k = 0; k < numT2Edges; k++)
+            ranks[(long)w * numT2Edges + k] = ranks[(long)(w - 1) * numT2Edges + k]
+                + __builtin_popcountl(words[(long)(w - 1) * numT2Edges + k]);
+
+    std::vector<int> t2EdgeIds(numT2Edges);
+    for (int k = 0; k < numT2Edges; k++)
+        t2EdgeIds[k] = t2DownEdges[k]->GetEdgeId();
+
+    for (unsigned i = 0; i < t1DownEdges.size(); i++) {
+        Size* row = (*sharedLeafSetSizes)[t1DownEdges[i]->GetEdgeId()];
+        const int lo = t1Intervals.Lo(t1DownEdges[i]);
+        const int hi = t1Intervals.Hi(t1DownEdges[i]);
+
+        const unsigned long* loWords = &words[(long)(lo >> 6) * numT2Edges];
+        const int* loRanks = &ranks[(long)(lo >> 6) * numT2Edges];
+        const unsigned long loMask = (1UL << (lo & 63)) - 1;
+        const unsigned long* hiWords = &words[(long)(hi >> 6) * numT2Edges];
+        const int* hiRanks = &ranks[(long)(hi >> 6) * numT2Edges];
+        const unsigned long hiMask = (1UL << (hi & 63)) - 1;
+
+        for (int k = 0; k < numT2Edges; k++)
+            row[t2EdgeIds[k]] = (hiRanks[k] + __builtin_popcountl(hiWords[k] & hiMask))
+                              - (loRanks[k] + __builtin_popcountl(loWords[k] & loMask));
+    }
 }
 
+template void TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree* t2, SharedLeafSetTable<uint16_t>* sharedLeafSetSizes,
+                                               SharedLeafSetEngine engine);
+template void TreeUtil::CalcSharedLeafSetSizes(Tree* t1, Tree* t2, SharedLeafSetTable<uint32_t>* sharedLeafSetSizes,
+                                               SharedLeafSetEngine engine);
+
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 // Finding paths
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -326,47 +659,66 @@ void TreeUtil::CalcSharedLeafSetSizesDownDown(DirectedEdge* e1, DirectedEdge* e2
  * Find a path between two leaves by a full traversal of the tree
  */
 Path* TreeUtil::FindPath(LeafNode* fromNode, LeafNode* toNode) {
-    std::vector<DirectedEdge*>* edges = new std::vector<DirectedEdge*>();
-    edges->reserve(100);
-    bool success = TreeUtil::FindPathRecursive(fromNode->GetEdge(), toNode, edges);
-    assert(success);
-    std::reverse(edges->begin(), edges->end());
+    //depth-first search with an explicit stack. The stack holds the edges from fromNode to the
+    //current node, each with the index of the next edge out of its to-node to try
+    std::vector<std::pair<DirectedEdge*, unsigned> > stack;
+    stack.push_back(std::make_pair(fromNode->GetEdge(), 0u));
+
+    while (!stack.empty()) {
+        DirectedEdge* currentEdge = stack.back().first;
+        Node* node = currentEdge->GetToNode();
+
+        if (node->isLeaf()) {
+            if (node == toNode)
+                break;
+            stack.pop_back();
+            continue;
+        }
+
+        InternalNode* internal = (InternalNode*) node;
+        const std::vector<DirectedEdge*> &edges = internal->GetEdges();
+        unsigned &i = stack.back().second;
+        //don't go backwards
+        if (i < edges.size() && edges[i] == currentEdge->GetBackEdge())
+            i++;
+        if (i < edges.size())
+            stack.push_back(std::make_pair(edges[i++], 0u));
+        else
+            stack.pop_back();
+    }
+    assert(!stack.empty());
+
+    std::vector<DirectedEdge*> edges;
+    edges.reserve(stack.size());
+    for (unsigned i = 0; i < stack.size(); i++)
+        edges.push_back(stack[i].first);
 
     //create the path
-    Path* path = new Path(fromNode, toNode, *edges);
+    Path* path = new Path(fromNode, toNode, edges);
     return path;
 }
 
 /*
- * Helper function for the FindPath function
+ * Find a path between two leaves by walking up from both to their lowest common ancestor,
+ * in time linear in the length of the path
  */
-bool TreeUtil::FindPathRecursive(DirectedEdge* currentEdge, LeafNode* endNode, std::vector<DirectedEdge*>* path) {
-    Node* toNode = currentEdge->GetToNode();
-    if (toNode->isLeaf()) {
-        LeafNode* leaf = (LeafNode*) toNode;
-        if (leaf == endNode) {
-            path->push_back(currentEdge);
-            return true;
-        }
-        else
-            return false;
-    }    
-    else {
-        InternalNode* internal = (InternalNode*) toNode;
-        const std::vector<DirectedEdge*> &edges = internal->GetEdges();
-        for (unsigned i = 0; i < edges.size(); i++) {
-            DirectedEdge* tmpEdge = edges[i];
-            //don't go backwards
-            if (tmpEdge == currentEdge->GetBackEdge())
-                continue;
-            bool success = TreeUtil::FindPathRecursive(tmpEdge, endNode, path);
-            if (success) {
-                path->push_back(currentEdge);
-                return true;
-            }
-        }
-        return false;
-    }
+Path* TreeUtil::FindPath(const LcaIndex &index, LeafNode* fromNode, LeafNode* toNode) {
+    Node* lca = index.Lca(fromNode, toNode);
+
+    std::vector<DirectedEdge*> edges(index.Distance(fromNode, toNode));
+    std::vector<DirectedEdge*>::size_type up = 0, down = edges.size();
+
+    //edges up from fromNode, in order
+    for (Node* node = fromNode; node != lca; node = index.ParentEdge(node)->GetFromNode())
+        edges[up++] = index.ParentEdge(node)->GetBackEdge();
+    //edges down to toNode, from the back
+    for (Node* node = toNode; node != lca; node = index.ParentEdge(node)->GetFromNode())
+        edges[--down] = index.ParentEdge(node);
+    assert(up == down);
+
+    //create the path
+    Path* path = new Path(fromNode, toNode, edges);
+    return path;
 }
 
 ////////////////////////////////////////////////////////////////////////////////////////////////////
@@ -374,7 +726,9 @@ bool TreeUtil::FindPathRecursive(DirectedEdge* currentEdge, LeafNode* endNode, s
 ////////////////////////////////////////////////////////////////////////////////////////////////////
 
 /*
- * Find the center of the triplet (a,b,c)
+ * Find the center of the triplet (a,b,c) from the paths between its leaves, each found by a
+ * traversal of the tree, in linear time and without an LcaIndex. For many queries build the
+ * index once and use the other FindCenter.
  */
 Center TreeUtil::FindCenter(Tree* tree, LeafNode* a, LeafNode* b, LeafNode* c) {
     //find each path between pairs of leaves
@@ -484,11 +838,31 @@ Center TreeUtil::FindCenter(Tree* tree, LeafNode* a, LeafNode* b, LeafNode* c) {
     return Center(centerNode, aEdge, bEdge, cEdge);
 }
 
+/*
+ * Find the center of the triplet (a,b,c) in constant time. Of the three pairwise lowest
+ * common ancestors, two coincide and the third, the deepest, is the center.
+ */
+Center TreeUtil::FindCenter(const LcaIndex &index, LeafNode* a, LeafNode* b, LeafNode* c) {
+    Node* centerNode = index.Lca(a, b);
+    Node* bc = index.Lca(b, c);
+    Node* ca = index.Lca(c, a);
+    if (index.Depth(bc) > index.Depth(centerNode))
+        centerNode = bc;
+    if (index.Depth(ca) > index.Depth(centerNode))
+        centerNode = ca;
+
+    assert(centerNode->isInternal());
+
+    return Center(centerNode, index.EdgeTowards(centerNode, a), index.EdgeTowards(centerNode, b),
+                  index.EdgeTowards(centerNode, c));
+}
+
 /*
  * Construct an array holding every center found on the given path
  */
 std::vector<Center> TreeUtil::MakeCenterArrayFromPath(Tree* tree, Path* path) {
     std::vector<Center> centers(tree->NumLeafNodes());
+    LeafIntervals intervals(tree);
 
     //traverse the path
     for (unsigned i = 0; i < path->GetEdges().size(); i++) { //don't consider last edge as it points to end leaf
@@ -508,14 +882,9 @@ std::vector<Center> TreeUtil::MakeCenterArrayFromPath(Tree* tree, Path* path) {
                 DirectedEdge* edge = internal->GetEdges()[j];
                 //not including Ta and Tb
                 if (edge != backEdge && edge != forwardEdge) {
-                    //find all leaves in the subtree
-                    std::vector<LeafNode*> leaves = TreeUtil::CollectLeavesInSubtree(edge);
-                    
                     //construct centers for a, b and every leaf in the subtree
-                    for (unsigned k = 0; k < leaves.size(); k++) {
-                        LeafNode* leaf = leaves[k];
-                        centers[leaf->GetLeafId()] = Center(internal, backEdge, forwardEdge, edge);
-                    }
+                    for (LeafNode* const* leaf = intervals.Begin(edge); leaf != intervals.End(edge); leaf++)
+                        centers[(*leaf)->GetLeafId()] = Center(internal, backEdge, forwardEdge, edge);
                 }
             }
         }        
@@ -534,58 +903,59 @@ std::vector<Center> TreeUtil::MakeCenterArrayFromPath(Tree* tree, Path* path) {
 std::vector<LeafNode*> TreeUtil::CollectLeavesInSubtree(DirectedEdge* subtreeEdge) {
     std::vector<LeafNode*> leaves;
     leaves.reserve(100);
-    TreeUtil::CollectLeavesRecursive(subtreeEdge, &leaves);
-    return leaves;
-}
 
-/*
- * Helper routine for CollectLeavesInSubtree
- */
-void TreeUtil::CollectLeavesRecursive(DirectedEdge* subtreeEdge, std::vector<LeafNode*>* leaves) {
-    Node* toNode = subtreeEdge->GetToNode();
-    if (toNode->isLeaf()) {
-        leaves->push_back((LeafNode*) toNode);
-    }    
-    else {
-        InternalNode* internal = (InternalNode*) toNode;
-        const std::vector<DirectedEdge*> &edges = internal->GetEdges();
-        for (unsigned i = 0; i < edges.size(); i++) {
-            DirectedEdge* tmpEdge = edges[i];
-            //don't go backwards
-            if (tmpEdge == subtreeEdge->GetBackEdge())
-                continue;
-            else
-                TreeUtil::CollectLeavesRecursive(tmpEdge, leaves);
+    //edges still to visit, pushed in reverse so the leaves come out in depth-first order
+    std::vector<DirectedEdge*> stack(1, subtreeEdge);
+    while (!stack.empty()) {
+        DirectedEdge* edge = stack.back();
+        stack.pop_back();
+
+        Node* toNode = edge->GetToNode();
+        if (toNode->isLeaf()) {
+            leaves.push_back((LeafNode*) toNode);
+        }
+        else {
+            InternalNode* internal = (InternalNode*) toNode;
+            const std::vector<DirectedEdge*> &edges = internal->GetEdges();
+            for (unsigned i = edges.size(); i-- > 0; ) {
+                //don't go backwards
+                if (edges[i] != edge->GetBackEdge())
+                    stack.push_back(edges[i]);
+            }
         }
     }
-}
 
-/*
- * Collect all directed edges pointing downwards from the root in the given tree
- */
-std::vector<DirectedEdge*> TreeUtil::CollectEdgesPointingAwayFromRoot(Tree* tree) {
-    std::vector<DirectedEdge*> downEdges;
-    TreeUtil::CollectEdgesRecursive(tree->GetRoot(), NULL, &downEdges);
-
-    return downEdges;
+    return leaves;
 }
 
 /*
- * Helper routine for CollectEdgesPointingAwayFromRoot
+ * Collect all directed edges pointing downwards from the root in the given tree, in preorder
  */
-void TreeUtil::CollectEdgesRecursive(Node* node, Node* fromNode, std::vector<DirectedEdge*>* downEdges) {
-    if (node->isInternal()) {
-        InternalNode* internal = (InternalNode*)node;
-
-        const std::vector<DirectedEdge*> &edges = internal->GetEdges();
-        for (std::vector<DirectedEdge*>::size_type i = 0; i < edges.size(); i++) {
-            DirectedEdge* edge = edges[i];
-            Node* toNode = edge->GetToNode();
+std::vector<DirectedEdge*> TreeUtil::CollectEdgesPointingAwayFromRoot(Tree* tree) {
+    if (!tree->GetDownEdges().empty())
+        return tree->GetDownEdges();
 
-            if (toNode != fromNode) {
-                downEdges->push_back(edge);
-                TreeUtil::CollectEdgesRecursive(toNode, internal, downEdges);
-            }
+    std::vector<DirectedEdge*> downEdges;
+    if (!tree->GetRoot()->isInternal())
+        return downEdges;
+    downEdges.reserve(tree->NumEdges() / 2);
+
+    //edges still to visit, pushed in reverse so they come out in preorder
+    InternalNode* root = (InternalNode*)tree->GetRoot();
+    std::vector<DirectedEdge*> stack(root->GetEdges().rbegin(), root->GetEdges().rend());
+    while (!stack.empty()) {
+        DirectedEdge* edge = stack.back();
+        stack.pop_back();
+        downEdges.push_back(edge);
+
+        Node* toNode = edge->GetToNode();
+        if (toNode->isInternal()) {
+            const std::vector<DirectedEdge*> &edges = ((InternalNode*)toNode)->GetEdges();
+            for (std::vector<DirectedEdge*>::size_type i = edges.size(); i-- > 0; )
+                if (edges[i] != edge->GetBackEdge())
+                    stack.push_back(edges[i]);
         }
     }
+
+    return downEdges;
 }
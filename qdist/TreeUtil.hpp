@@ -5,6 +5,11 @@
 #include "InternalNode.hpp"
 #include "LeafNode.hpp"
 #include "DirectedEdge.hpp"
+#include "SharedLeafSetTable.hpp"
+#include "LcaIndex.hpp"
+#include "LeafIntervals.hpp"
+
+#include <stdint.h>
 
 /*
  * Various utility routines that work on trees
@@ -24,28 +29,46 @@ public:
     static void CheckTree(Tree* tree);
     static void CheckSubtree(Node* node, Node* fromNode);
     static void RenumberTreeAccordingToOther(Tree* tree, Tree* other);
+    static void RenumberTreeCanonically(Tree* tree);
+    static bool HaveSameLeaves(Tree* t1, Tree* t2);
+    static void PrecomputeSubtreeData(Tree* tree);
+    static void DeleteTree(Tree* tree);
+
+    // The ways the shared leaf set sizes can be computed
+    enum SharedLeafSetEngine {
+        RECURSIVE_ENGINE,   // sums over pairs of subtrees, children before parents
+        BITSET_ENGINE       // popcounts over leaf bitsets
+    };
 
     static std::vector<int> SubtreeLeafSetSizes(Tree* tree);
-    static std::vector< std::vector<int> > CalcSharedLeafSetSizes(Tree* t1, Tree* t2);
+    static std::vector<uint64_t> SplitHashes(Tree* tree);
+    static std::vector<uint64_t> NontrivialSplitHashes(Tree* tree);
+    static uint64_t TopologyHash(Tree* tree);
+    static std::vector<int> FindDuplicateTopologies(const std::vector<Tree*> &trees);
+    static uint64_t Fingerprint(Tree* tree);
+    template<typename Size>
+    static void CalcSharedLeafSetSizes(Tree* t1, Tree* t2, SharedLeafSetTable<Size>* sharedLeafSetSizes,
+                                       SharedLeafSetEngine engine = RECURSIVE_ENGINE);
 
     static Path* FindPath(LeafNode* fromNode, LeafNode* toNode);
+    static Path* FindPath(const LcaIndex &index, LeafNode* fromNode, LeafNode* toNode);
     static Center FindCenter(Tree* tree, LeafNode* a, LeafNode* b, LeafNode* c);
+    static Center FindCenter(const LcaIndex &index, LeafNode* a, LeafNode* b, LeafNode* c);
     static std::vector<Center> MakeCenterArrayFromPath(Tree* tree, Path* path);
 
     static std::vector<LeafNode*> CollectLeavesInSubtree(DirectedEdge* subtreeEdge);
-
-private:
-    static int CountLeavesDownwards(Node* node, Node* fromNode, std::vector<int>* subtreeLeafSetSizes);
-    static void CalcLeavesUpwards(Tree* tree, std::vector<int>* subtreeLeafSetSizes);
-
-    static void CalcSharedLeafSetSizesDownDown(DirectedEdge* e1, DirectedEdge* e2, std::vector< std::vector<int> >* sharedLeafSetSizes);
-
-    static bool FindPathRecursive(DirectedEdge* edge, LeafNode* endNode, std::vector<DirectedEdge*>*);
-
     static std::vector<DirectedEdge*> CollectEdgesPointingAwayFromRoot(Tree* tree);
-    static void CollectEdgesRecursive(Node* node, Node* fromNode, std::vector<DirectedEdge*>* downEdges);
 
-    static void CollectLeavesRecursive(DirectedEdge* subtreeEdge, std::vector<LeafNode*>* leaves);
+private:
+    template<typename Size>
+    static void CalcSharedLeafSetSizesDownDown(const std::vector<DirectedEdge*> &t1DownEdges,
+                                               const std::vector<DirectedEdge*> &t2DownEdges,
+                                               SharedLeafSetTable<Size>* sharedLeafSetSizes);
+    template<typename Size>
+    static void CalcSharedLeafSetSizesDownDownBitset(Tree* t1, Tree* t2,
+                                                     const std::vector<DirectedEdge*> &t1DownEdges,
+                                                     const std::vector<DirectedEdge*> &t2DownEdges,
+                                                     SharedLeafSetTable<Size>* sharedLeafSetSizes);
 };
 
 /*
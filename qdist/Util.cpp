@@ -96,3 +96,24 @@ std::string Util::LoadFileToString(std::string filename) {
 
    return lines;
 }
+
+/*
+ * 64-bit FNV-1a hash of a string
+ */
+unsigned long Util::HashString(const std::string &string) {
+    unsigned long hash = 14695981039346656037UL;
+    for (std::string::size_type i = 0; i < string.size(); i++) {
+        hash ^= (unsigned char)string[i];
+        hash *= 1099511628211UL;
+    }
+    return hash;
+}
+
+/*
+ * The splitmix64 finalizer, which spreads the bits of a hash over all bits of the result.
+ */
+unsigned long Util::MixHash(unsigned long hash) {
+    hash = (hash ^ (hash >> 30)) * 0xbf58476d1ce4e5b9UL;
+    hash = (hash ^ (hash >> 27)) * 0x94d049bb133111ebUL;
+    return hash ^ (hash >> 31);
+}
@@ -14,6 +14,8 @@ namespace Util {
     long Choose2(int n);
     long Choose(int n, int k);
     std::string LoadFileToString(std::string filename);
+    unsigned long HashString(const std::string &string);
+    unsigned long MixHash(unsigned long hash);
 
 }
 
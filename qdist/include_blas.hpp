@@ -1 +0,0 @@
-#include<cblas.h>
\ No newline at end of file
@@ -1,9 +1,14 @@
 
 #include <iostream>
+#include <fstream>
 #include <string>
 #include <cstdlib>
 #include <algorithm>
 #include <set>
+#include <map>
+#include <sstream>
+#include <thread>
+#include <atomic>
 
 #include "Util.hpp"
 #include "NewickParser.hpp"
@@ -11,6 +16,14 @@
 #include "Tree.hpp"
 #include "TreeUtil.hpp"
 #include "QDist.hpp"
+#include "TreeCache.hpp"
+#include "TreeReader.hpp"
+#include "QDistServer.hpp"
+#include "QDistBatch.hpp"
+#include "QuartetQuery.hpp"
+#include "RFDist.hpp"
+#include "TreeSearch.hpp"
+#include "SketchIndex.hpp"
 
 
 
@@ -18,43 +31,492 @@ static const std::string &ExtractLeafLabel(const LeafNode *n) {
     return n->GetLabel();
 }
 
-int main(int argc, char** argv) {
+static void PrintUsage(const char* program) {
+    std::cout << "Usage: " << program << " [--breakdown file] [--table-dir dir] [--rf | --rf-only] [--checkpoint file [--resume]] [--progress] tree1 tree2" << std::endl;
+    std::cout << "       " << program << " --compile tree cachefile" << std::endl;
+    std::cout << "       " << program << " --serve socket [--workers n] [--cache-size n]" << std::endl;
+    std::cout << "       " << program << " --pairs manifest [--trees file] [--format tsv|ndjson] [--threads n] [--checkpoint file [--resume]] [--progress]" << std::endl;
+    std::cout << "       " << program << " --reference tree --trees file [--format tsv|ndjson] [--threads n]" << std::endl;
+    std::cout << "       " << program << " --quartets file [--threads n] tree..." << std::endl;
+    std::cout << "       " << program << " --trees file (--knn k query... | --medoid) [--pivots n] [--threads n]" << std::endl;
+    std::cout << "       " << program << " --trees file --knn k --approx [--candidates n] query..." << std::endl;
+    std::cout << "  Where:" << std::endl;
+    std::cout << "    tree1 and tree2 are files each containing one tree in newic" << std::endl;
+    std::cout << "    format, or tree cache files made with --compile. All leaves in" << std::endl;
+    std::cout << "    the two trees should be labeled, and the two trees should have" << std::endl;
+    std::cout << "    the same set of leaves. Tree files, and the files of several" << std::endl;
+    std::cout << "    trees given with --trees, may be compressed with gzip or zstd," << std::endl;
+    std::cout << "    and may be NEXUS files, read from their TREES blocks." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Prints the quartet-distance between tree1 and tree2 and various" << std::endl;
+    std::cout << "summary statistics:" << std::endl;
+    std::cout << "    N      - The number of leaves in the trees (should be the same for both)." << std::endl;
+    std::cout << "    B1     - The number of butterfly quartets in the first tree." << std::endl;
+    std::cout << "    B2     - The number of butterfly quartets in the second tree." << std::endl;
+    std::cout << "    S      - The number of shared butterfly quartets." << std::endl;
+    std::cout << "    D      - The number of different butterfly quartets." << std::endl;
+    std::cout << "    Norm B - The normalized shared butterflies, i.e. S / min(B1,B2)." << std::endl;
+    std::cout << "    Q      - The quartet distance between the two trees." << std::endl;
+    std::cout << "    Norm Q - The normalized quartet distance, i.e. Q / (N choose 4)." << std::endl;
+    std::cout << std::endl;
+    std::cout << "Options:" << std::endl;
+    std::cout << "    --breakdown file  Also write a TSV file with the number of differing quartets" << std::endl;
+    std::cout << "                      containing each leaf, and for each internal edge of tree1" << std::endl;
+    std::cout << "                      the number of its butterflies anchored at the edge that" << std::endl;
+    std::cout << "                      tree2 does not share. Edges are named by the leaves on" << std::endl;
+    std::cout << "                      their smaller side." << std::endl;
+    std::cout << "    --rf              Also print the Robinson-Foulds distance, the number of" << std::endl;
+    std::cout << "                      non-trivial splits in only one of the trees, and the" << std::endl;
+    std::cout << "                      same normalized by the number of splits in both trees." << std::endl;
+    std::cout << "    --rf-only         Print only N and the Robinson-Foulds distance, which takes" << std::endl;
+    std::cout << "                      linear time, instead of the quartet distance." << std::endl;
+    std::cout << "    --checkpoint file Save the partial sums of a comparison, or the result lines" << std::endl;
+    std::cout << "                      of --pairs, to file every minute and when done." << std::endl;
+    std::cout << "    --checkpoint-interval s" << std::endl;
+    std::cout << "                      Seconds between checkpoints (default 60)." << std::endl;
+    std::cout << "    --resume          Continue from the state in the --checkpoint file, if it" << std::endl;
+    std::cout << "                      exists. It must have been saved for the same input." << std::endl;
+    std::cout << "                      --pairs writes the saved result lines again first." << std::endl;
+    std::cout << "    --progress        Report the progress and the time left on stderr, and the" << std::endl;
+    std::cout << "                      number of node pairs skipped as adding nothing." << std::endl;
+    std::cout << "    --compile         Parse tree and write it to cachefile in a binary format" << std::endl;
+    std::cout << "                      that loads without parsing." << std::endl;
+    std::cout << "    --table-dir dir   Keep the table of shared leaf set sizes in a temporary" << std::endl;
+    std::cout << "                      memory-mapped file in dir, for trees too large for the" << std::endl;
+    std::cout << "                      table to fit in memory." << std::endl;
+    std::cout << "    --serve socket    Serve REGISTER, COMPARE and BATCH requests on a Unix" << std::endl;
+    std::cout << "                      domain socket, see QDistServer.hpp for the protocol." << std::endl;
+    std::cout << "    --workers n       Number of connections served at a time (default 4)." << std::endl;
+    std::cout << "    --cache-size n    Number of parsed trees the server keeps (default 1000)." << std::endl;
+    std::cout << "    --pairs manifest  Compare the pairs of trees listed in manifest, or on" << std::endl;
+    std::cout << "                      standard input for -, one pair per line. A tree is a" << std::endl;
+    std::cout << "                      file name, or an index counting from 0 into the trees" << std::endl;
+    std::cout << "                      given with --trees. Prints one line per pair, in order." << std::endl;
+    std::cout << "    --trees file      A file of several newick trees for --pairs to refer to." << std::endl;
+    std::cout << "    --reference tree  Compare tree with each tree of --trees, printing one line" << std::endl;
+    std::cout << "                      per tree as for --pairs while the file is still read." << std::endl;
+    std::cout << "    --format f        Output format of --pairs and --reference, tsv (default)" << std::endl;
+    std::cout << "                      or ndjson." << std::endl;
+    std::cout << "    --threads n       Number of threads for --pairs, --reference, --knn," << std::endl;
+    std::cout << "                      --medoid and --quartets, and for parsing --trees" << std::endl;
+    std::cout << "                      (default: all cores)." << std::endl;
+    std::cout << "    --knn k query...  Print the k trees of --trees closest to each query tree." << std::endl;
+    std::cout << "    --medoid          Print the tree of --trees with the smallest sum of" << std::endl;
+    std::cout << "                      distances to the others." << std::endl;
+    std::cout << "    --pivots n        Number of pivot trees that bound the distances for --knn" << std::endl;
+    std::cout << "                      and --medoid (default one per 16 distinct topologies, at" << std::endl;
+    std::cout << "                      most 8, or 0 for a single --knn query, as the pivots only" << std::endl;
+    std::cout << "                      pay off over several queries)." << std::endl;
+    std::cout << "    --approx          Answer --knn approximately for very large collections: the" << std::endl;
+    std::cout << "                      trees are indexed by MinHash sketches of their splits, and" << std::endl;
+    std::cout << "                      only the candidates most similar by sketch are compared." << std::endl;
+    std::cout << "    --candidates n    Number of candidates --approx compares (default 100)." << std::endl;
+    std::cout << "    --quartets file   Count how many of the quartets in file each tree displays." << std::endl;
+    std::cout << "                      Each line holds four leaf labels a b c d, standing for" << std::endl;
+    std::cout << "                      the quartet ab|cd." << std::endl;
+    std::cout << std::endl;
+}
+
+/*
+ * Write the per-leaf and per-edge breakdown of a comparison as TSV.
+ */
+static void WriteBreakdown(const std::string &filename, Tree* tree1, const QDistBreakdown &breakdown) {
+    std::ofstream out(filename.c_str());
+    if (!out) {
+        std::cerr << "Could not open file: " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    breakdown.Write(out, tree1);
+}
+
+/*
+ * Count how many of the quartets in a file each tree displays, and print a TSV line per tree.
+ */
+static int CountDisplayedQuartets(const std::string &quartetsFilename,
+                                  const std::vector<std::string> &treeFilenames, int numThreads) {
+    std::ifstream in(quartetsFilename.c_str());
+    if (!in) {
+        std::cerr << "Could not open file: " << quartetsFilename << std::endl;
+        return 1;
+    }
+
+    std::vector<std::vector<std::string> > labelQuartets;
+    std::string line;
+    while (std::getline(in, line)) {
+        std::istringstream fields(line);
+        std::vector<std::string> labels;
+        std::string label;
+        while (fields >> label)
+            labels.push_back(label);
+        if (labels.empty() || labels[0][0] == '#')
+            continue;
+        if (labels.size() != 4) {
+            std::cerr << "Quartet line without four leaves: " << line << std::endl;
+            return 1;
+        }
+        labelQuartets.push_back(labels);
+    }
+
+    std::cout << "tree\tquartets\tdisplayed" << std::endl;
+    for (unsigned t = 0; t < treeFilenames.size(); t++) {
+        Tree* tree = TreeCache::LoadTreeFile(treeFilenames[t]);
+
+        std::map<std::string, int> leafIds;
+        for (int i = 0; i < tree->NumLeafNodes(); i++)
+            leafIds[tree->GetLeafNode(i)->GetLabel()] = i;
+
+        std::vector<QuartetQuery::Quartet> quartets(labelQuartets.size());
+        for (unsigned i = 0; i < labelQuartets.size(); i++) {
+            int ids[4];
+            for (int k = 0; k < 4; k++) {
+                std::map<std::string, int>::iterator found = leafIds.find(labelQuartets[i][k]);
+                if (found == leafIds.end()) {
+                    std::cerr << "No leaf " << labelQuartets[i][k] << " in " << treeFilenames[t] << std::endl;
+                    return 1;
+                }
+                ids[k] = found->second;
+            }
+            QuartetQuery::Quartet q = {ids[0], ids[1], ids[2], ids[3]};
+            quartets[i] = q;
+        }
+
+        QuartetQuery query(tree);
+        std::cout << treeFilenames[t] << '\t' << quartets.size() << '\t'
+                  << query.CountDisplayed(quartets, numThreads) << std::endl;
+        TreeUtil::DeleteTree(tree);
+    }
+
+    return 0;
+}
 
-    if (argc != 3) {
-        std::cout << "Usage: " << argv[0] << " tree1 tree2" << std::endl;
-        std::cout << "  Where:" << std::endl;
-        std::cout << "    tree1 and tree2 are files each containing one tree in newic" << std::endl;
-        std::cout << "    format. All leaves in the two trees should be labeled, and" << std::endl;
-        std::cout << "    the two trees should have the same set of leaves." << std::endl;
-        std::cout << std::endl;
-        std::cout << "Prints the quartet-distance between tree1 and tree2 and various" << std::endl;
-        std::cout << "summary statistics:" << std::endl;
-        std::cout << "    N      - The number of leaves in the trees (should be the same for both)." << std::endl;
-        std::cout << "    B1     - The number of butterfly quartets in the first tree." << std::endl;
-        std::cout << "    B2     - The number of butterfly quartets in the second tree." << std::endl;
-        std::cout << "    S      - The number of shared butterfly quartets." << std::endl;
-        std::cout << "    D      - The number of different butterfly quartets." << std::endl;
-        std::cout << "    Norm B - The normalized shared butterflies, i.e. S / min(B1,B2)." << std::endl;
-        std::cout << "    Q      - The quartet distance between the two trees." << std::endl;
-        std::cout << "    Norm Q - The normalized quartet distance, i.e. Q / (N choose 4)." << std::endl;
-        std::cout << std::endl;
+/*
+ * Answer nearest neighbour queries, if any are given, or find the medoid of a collection.
+ */
+static int SearchCollection(const std::string &collectionFilename, const std::vector<std::string> &queries,
+                            int k, int numPivots, int numThreads, const QDistOptions &options) {
+    std::vector<Tree*> trees = QDistBatch::ParseTreeCollection(collectionFilename, numThreads);
+    if (trees.empty()) {
+        std::cerr << "No trees in " << collectionFilename << std::endl;
         return 1;
     }
+    for (unsigned i = 1; i < trees.size(); i++)
+        if (!TreeUtil::HaveSameLeaves(trees[0], trees[i])) {
+            std::cerr << "Tree " << i << " does not have the same leaf set as tree 0" << std::endl;
+            return 1;
+        }
+
+    //search the distinct topologies, each standing for the trees that have it
+    std::vector<int> representatives = TreeUtil::FindDuplicateTopologies(trees);
+    std::vector<Tree*> topologies;
+    std::vector<int> topologyOf(trees.size());
+    std::vector<std::vector<int> > members;
+    for (unsigned i = 0; i < trees.size(); i++) {
+        if (representatives[i] == (int)i) {
+            topologyOf[i] = topologies.size();
+            topologies.push_back(trees[i]);
+            members.push_back(std::vector<int>());
+        }
+        else
+            topologyOf[i] = topologyOf[representatives[i]];
+        members[topologyOf[i]].push_back(i);
+    }
+    std::vector<long> multiplicities(topologies.size());
+    for (unsigned t = 0; t < topologies.size(); t++)
+        multiplicities[t] = members[t].size();
+    std::cerr << topologies.size() << " distinct topologies among " << trees.size() << " trees" << std::endl;
+
+    if (numPivots < 0)
+        //a pivot costs a comparison with every topology, so small collections get fewer
+        numPivots = queries.size() == 1 ? 0 : std::min(8, (int)topologies.size() / 16);
+    TreeSearch search(topologies, numPivots, numThreads, options, multiplicities);
+    long naiveComparisons;
+
+    if (!queries.empty()) {
+        std::cout << "query\trank\ttree\tQ" << std::endl;
+        for (unsigned q = 0; q < queries.size(); q++) {
+            Tree* queryTree = TreeCache::LoadTreeFile(queries[q]);
+            TreeUtil::RenumberTreeCanonically(queryTree);
+            TreeUtil::PrecomputeSubtreeData(queryTree);
+            if (!TreeUtil::HaveSameLeaves(trees[0], queryTree)) {
+                std::cerr << queries[q] << " does not have the same leaf set as the trees" << std::endl;
+                return 1;
+            }
+
+            //every tree of the nearest topologies, by distance and index
+            std::vector<std::pair<long, int> > neighbours;
+            std::vector<std::pair<long, int> > nearest = search.NearestNeighbours(queryTree, k);
+            for (unsigned t = 0; t < nearest.size(); t++)
+                for (unsigned m = 0; m < members[nearest[t].second].size(); m++)
+                    neighbours.push_back(std::make_pair(nearest[t].first, members[nearest[t].second][m]));
+            std::sort(neighbours.begin(), neighbours.end());
+            if ((int)neighbours.size() > k)
+                neighbours.resize(k);
+
+            for (unsigned i = 0; i < neighbours.size(); i++)
+                std::cout << queries[q] << '\t' << i + 1 << '\t' << neighbours[i].second << '\t'
+                          << neighbours[i].first << std::endl;
+            TreeUtil::DeleteTree(queryTree);
+        }
+        naiveComparisons = (long)trees.size() * queries.size();
+    }
+    else {
+        std::pair<int, long> medoid = search.Medoid();
+        std::cout << "tree\tsum Q" << std::endl;
+        std::cout << members[medoid.first][0] << '\t' << medoid.second << std::endl;
+        naiveComparisons = (long)trees.size() * (trees.size() - 1) / 2;
+    }
+
+    std::cerr << "Computed " << search.NumComparisons() << " quartet distances instead of "
+              << naiveComparisons << std::endl;
+    return 0;
+}
+
+/*
+ * Answer nearest neighbour queries approximately: the trees are sketched as they are parsed
+ * and none of them is kept. The candidates the sketches find for the queries are read again
+ * in a second pass over the file, and only those are kept and compared to the queries, on
+ * numThreads threads.
+ */
+static int ApproximateNeighbours(const std::string &collectionFilename, const std::vector<std::string> &queries,
+                                 int k, int numCandidates, int numThreads, const QDistOptions &options) {
+    SketchIndex index;
+    NewickParser parser;
+    std::string newick;
+    long numTrees = 0;
+    {
+        TreeReader reader(collectionFilename);
+        while (reader.Next(newick)) {
+            Tree* tree = reader.Parse(newick, parser);
+            index.Add(tree);
+            TreeUtil::DeleteTree(tree);
+            numTrees++;
+        }
+    }
+
+    std::vector<Tree*> queryTrees;
+    std::vector<std::vector<int> > candidates;
+    std::vector<bool> wanted(numTrees, false);
+    for (unsigned q = 0; q < queries.size(); q++) {
+        Tree* queryTree = TreeCache::LoadTreeFile(queries[q]);
+        TreeUtil::RenumberTreeCanonically(queryTree);
+        queryTrees.push_back(queryTree);
 
-    Tree* tree1;
-    Tree* tree2;
+        candidates.push_back(index.Candidates(queryTree));
+        if ((int)candidates.back().size() > numCandidates)
+            candidates.back().resize(numCandidates);
+        for (unsigned c = 0; c < candidates.back().size(); c++)
+            wanted[candidates.back()[c]] = true;
+    }
 
-    //load newick strings from files
-    std::string filename1 = argv[1];
-    std::string input1 = Util::LoadFileToString(filename1);
+    std::map<int, Tree*> candidateTrees;
+    {
+        TreeReader reader(collectionFilename);
+        for (int t = 0; reader.Next(newick); t++) {
+            if (!wanted[t])
+                continue;
+            Tree* tree = reader.Parse(newick, parser);
+            TreeUtil::RenumberTreeCanonically(tree);
+            candidateTrees[t] = tree;
+        }
+    }
 
-    std::string filename2 = argv[2];
-    std::string input2 = Util::LoadFileToString(filename2);
+    long numCompared = 0;
+    int status = 0;
+    std::cout << "query\trank\ttree\tQ" << std::endl;
+    for (unsigned q = 0; q < queries.size(); q++) {
+        const std::vector<int> &queryCandidates = candidates[q];
+        for (unsigned c = 0; c < queryCandidates.size() && status == 0; c++)
+            if (!TreeUtil::HaveSameLeaves(queryTrees[q], candidateTrees[queryCandidates[c]])) {
+                std::cerr << "Tree " << queryCandidates[c] << " does not have the same leaf set as " << queries[q] << std::endl;
+                status = 1;
+            }
+        if (status != 0)
+            break;
 
-    //parse strings
-    NewickParser* parser = new NewickParser();
-    tree1 = parser->Parse(input1);
-    tree2 = parser->Parse(input2);
+        std::vector<std::pair<long, int> > neighbours(queryCandidates.size());
+        std::atomic<long> next(0);
+        std::vector<std::thread> threads;
+        for (int i = 0; i < std::min(std::max(numThreads, 1), (int)queryCandidates.size()); i++)
+            threads.push_back(std::thread([&]() {
+                long c;
+                while ((c = next++) < (long)queryCandidates.size()) {
+                    long b1, b2, shared, diff;
+                    neighbours[c] = std::make_pair(SubCubicQDist(queryTrees[q], candidateTrees[queryCandidates[c]],
+                                                                 b1, b2, shared, diff, options),
+                                                   queryCandidates[c]);
+                }
+            }));
+        for (unsigned i = 0; i < threads.size(); i++)
+            threads[i].join();
+        numCompared += queryCandidates.size();
+
+        std::sort(neighbours.begin(), neighbours.end());
+        for (int i = 0; i < std::min(k, (int)neighbours.size()); i++)
+            std::cout << queries[q] << '\t' << i + 1 << '\t' << neighbours[i].second << '\t'
+                      << neighbours[i].first << std::endl;
+    }
+
+    for (unsigned q = 0; q < queryTrees.size(); q++)
+        TreeUtil::DeleteTree(queryTrees[q]);
+    for (std::map<int, Tree*>::iterator it = candidateTrees.begin(); it != candidateTrees.end(); ++it)
+        TreeUtil::DeleteTree(it->second);
+    if (status != 0)
+        return status;
+
+    std::cerr << "Computed " << numCompared << " quartet distances instead of "
+              << numTrees * queries.size() << std::endl;
+    return 0;
+}
+
+int main(int argc, char** argv) {
+
+    std::string breakdownFilename;
+    std::string tableDirectory;
+    bool compile = false;
+    std::string socketPath;
+    int numWorkers = 4;
+    unsigned cacheSize = 1000;
+    std::string manifestFilename;
+    std::string collectionFilename;
+    std::string referenceFilename;
+    QDistBatch::Format format = QDistBatch::TSV_FORMAT;
+    int numThreads = std::max(1u, std::thread::hardware_concurrency());
+    std::string quartetsFilename;
+    bool rf = false;
+    bool rfOnly = false;
+    int k = 0;
+    bool medoid = false;
+    bool approximate = false;
+    int numCandidates = 100;
+    int numPivots = -1;
+    std::string checkpointFilename;
+    int checkpointInterval = 60;
+    bool resume = false;
+    bool progress = false;
+    std::vector<std::string> treeFilenames;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--breakdown" && i + 1 < argc)
+            breakdownFilename = argv[++i];
+        else if (arg == "--compile")
+            compile = true;
+        else if (arg == "--table-dir" && i + 1 < argc)
+            tableDirectory = argv[++i];
+        else if (arg == "--serve" && i + 1 < argc)
+            socketPath = argv[++i];
+        else if (arg == "--workers" && i + 1 < argc)
+            numWorkers = std::max(1, atoi(argv[++i]));
+        else if (arg == "--cache-size" && i + 1 < argc)
+            cacheSize = std::max(1, atoi(argv[++i]));
+        else if (arg == "--pairs" && i + 1 < argc)
+            manifestFilename = argv[++i];
+        else if (arg == "--trees" && i + 1 < argc)
+            collectionFilename = argv[++i];
+        else if (arg == "--reference" && i + 1 < argc)
+            referenceFilename = argv[++i];
+        else if (arg == "--format" && i + 1 < argc) {
+            std::string name = argv[++i];
+            if (name != "tsv" && name != "ndjson") {
+                PrintUsage(argv[0]);
+                return 1;
+            }
+            format = name == "ndjson" ? QDistBatch::NDJSON_FORMAT : QDistBatch::TSV_FORMAT;
+        }
+        else if (arg == "--threads" && i + 1 < argc)
+            numThreads = std::max(1, atoi(argv[++i]));
+        else if (arg == "--knn" && i + 1 < argc)
+            k = std::max(1, atoi(argv[++i]));
+        else if (arg == "--approx")
+            approximate = true;
+        else if (arg == "--candidates" && i + 1 < argc)
+            numCandidates = std::max(1, atoi(argv[++i]));
+        else if (arg == "--medoid")
+            medoid = true;
+        else if (arg == "--pivots" && i + 1 < argc)
+            numPivots = std::max(0, atoi(argv[++i]));
+        else if (arg == "--rf")
+            rf = true;
+        else if (arg == "--rf-only")
+            rf = rfOnly = true;
+        else if (arg == "--quartets" && i + 1 < argc)
+            quartetsFilename = argv[++i];
+        else if (arg == "--checkpoint" && i + 1 < argc)
+            checkpointFilename = argv[++i];
+        else if (arg == "--checkpoint-interval" && i + 1 < argc)
+            checkpointInterval = std::max(0, atoi(argv[++i]));
+        else if (arg == "--resume")
+            resume = true;
+        else if (arg == "--progress")
+            progress = true;
+        else
+            treeFilenames.push_back(arg);
+    }
+
+    if (!socketPath.empty() && treeFilenames.empty()) {
+        QDistOptions options;
+        options.sharedLeafSetTableDirectory = tableDirectory;
+        QDistServer server(numWorkers, cacheSize, options);
+        server.Listen(socketPath);
+        return 0;
+    }
+
+    if (!manifestFilename.empty() && treeFilenames.empty()) {
+        QDistOptions options;
+        options.sharedLeafSetTableDirectory = tableDirectory;
+        options.checkpointFilename = checkpointFilename;
+        options.checkpointInterval = checkpointInterval;
+        options.resume = resume;
+        options.progress = progress;
+        QDistBatch batch(numThreads, format, options);
+        if (!collectionFilename.empty())
+            batch.LoadTreeCollection(collectionFilename);
+
+        if (manifestFilename == "-")
+            batch.Run(std::cin, std::cout);
+        else {
+            std::ifstream manifest(manifestFilename.c_str());
+            if (!manifest) {
+                std::cerr << "Could not open file: " << manifestFilename << std::endl;
+                return 1;
+            }
+            batch.Run(manifest, std::cout);
+        }
+        return 0;
+    }
+
+    if (!referenceFilename.empty() && !collectionFilename.empty() && treeFilenames.empty()) {
+        QDistOptions options;
+        options.sharedLeafSetTableDirectory = tableDirectory;
+        QDistBatch batch(numThreads, format, options);
+        batch.RunAgainst(referenceFilename, collectionFilename, std::cout);
+        return 0;
+    }
+
+    if (((k > 0 && !treeFilenames.empty()) || (medoid && treeFilenames.empty())) && !collectionFilename.empty()) {
+        QDistOptions options;
+        options.sharedLeafSetTableDirectory = tableDirectory;
+        if (approximate && k > 0)
+            return ApproximateNeighbours(collectionFilename, treeFilenames, k, numCandidates, numThreads, options);
+        return SearchCollection(collectionFilename, treeFilenames, k, numPivots, numThreads, options);
+    }
+
+    if (!quartetsFilename.empty() && !treeFilenames.empty())
+        return CountDisplayedQuartets(quartetsFilename, treeFilenames, numThreads);
+
+    if (treeFilenames.size() != 2) {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    if (compile) {
+        TreeCache::Write(TreeCache::LoadTreeFile(treeFilenames[0]), treeFilenames[1]);
+        return 0;
+    }
+
+    //load trees from files
+    Tree* tree1 = TreeCache::LoadTreeFile(treeFilenames[0]);
+    Tree* tree2 = TreeCache::LoadTreeFile(treeFilenames[1]);
 
     // Check that the leaf lists match
     std::set<std::string> leaves1, leaves2;
@@ -78,14 +540,42 @@ int main(int argc, char** argv) {
 
     long n = leaves1.size();
     long max_qdist = Util::Choose(n, 4);
+
+    //the cheap split distance first
+    long rf_dist = 0, splits1 = 0, splits2 = 0;
+    if (rf)
+        rf_dist = RFDist(tree1, tree2, splits1, splits2);
+    double norm_rf = splits1 + splits2 > 0 ? double(rf_dist) / (splits1 + splits2) : 0;
+
+    if (rfOnly) {
+        std::cout << "N\tRF\tNorm RF" << std::endl;
+        std::cout << n << '\t' << rf_dist << '\t' << norm_rf << std::endl;
+        return 0;
+    }
     
+    QDistOptions options;
+    options.sharedLeafSetTableDirectory = tableDirectory;
+    options.checkpointFilename = checkpointFilename;
+    options.checkpointInterval = checkpointInterval;
+    options.resume = resume;
+    options.progress = progress;
+    QDistBreakdown breakdown;
+    if (!breakdownFilename.empty())
+        options.breakdown = &breakdown;
+
     long qdist, b1, b2, shared_b, diff_b;
-    qdist = SubCubicQDist(tree1, tree2, b1, b2, shared_b, diff_b);
+    qdist = SubCubicQDist(tree1, tree2, b1, b2, shared_b, diff_b, options);
+
+    if (!breakdownFilename.empty())
+        WriteBreakdown(breakdownFilename, tree1, breakdown);
     
     long min_b = std::min(b1, b2);
     
-    std::cout << "N\tB1\tB2\tS\tD\tNorm B\tQ\tNorm Q" << std::endl;
-    std::cout << n << '\t' << b1 << '\t' << b2 << '\t' << shared_b << '\t' << diff_b << '\t' << (double(shared_b) / min_b)  << '\t' << qdist << '\t' << (double(qdist) / max_qdist) << std::endl;
+    std::cout << "N\tB1\tB2\tS\tD\tNorm B\tQ\tNorm Q" << (rf ? "\tRF\tNorm RF" : "") << std::endl;
+    std::cout << n << '\t' << b1 << '\t' << b2 << '\t' << shared_b << '\t' << diff_b << '\t' << (double(shared_b) / min_b)  << '\t' << qdist << '\t' << (double(qdist) / max_qdist);
+    if (rf)
+        std::cout << '\t' << rf_dist << '\t' << norm_rf;
+    std::cout << std::endl;
 
 
 	return 0;
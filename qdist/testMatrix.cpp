@@ -6,6 +6,82 @@
 
 
 
+/*
+ * Check every product of the two integer matrices against a naive triple loop.
+ */
+void testLongProducts(int height, int inner, int width)
+{
+    Matrix<long> a(height, inner);
+    Matrix<long> aT(inner, height);
+    Matrix<long> b(inner, width);
+    Matrix<long> bT(width, inner);
+
+    for(int i = 0; i < height; ++i)
+        for(int p = 0; p < inner; ++p)
+            a(i, p) = aT(p, i) = (rand() % 4 == 0) ? 0 : rand() % 1000;
+
+    for(int p = 0; p < inner; ++p)
+        for(int j = 0; j < width; ++j)
+            b(p, j) = bT(j, p) = (rand() % 4 == 0) ? 0 : rand() % 1000;
+
+    Matrix<long> expected(height, width);
+    for(int i = 0; i < height; ++i)
+        for(int j = 0; j < width; ++j)
+        {
+            long sum = 0;
+            for(int p = 0; p < inner; ++p)
+                sum += a(i, p) * b(p, j);
+            expected(i, j) = sum;
+        }
+
+    Matrix<long> out(height, width);
+
+    for(int variant = 0; variant < 4; ++variant)
+    {
+        const Matrix<long> &in1 = (variant & 1) ? aT : a;
+        const Matrix<long> &in2 = (variant & 2) ? bT : b;
+
+        Matrix<long>::Mult(in1, (variant & 1) ? Matrix<long>::TRANSPOSE : Matrix<long>::NO_TRANSPOSE,
+                           in2, (variant & 2) ? Matrix<long>::TRANSPOSE : Matrix<long>::NO_TRANSPOSE,
+                           out);
+
+        for(int i = 0; i < height; ++i)
+            for(int j = 0; j < width; ++j)
+                if(out(i, j) != expected(i, j))
+                {
+                    std::cout << "Entry at (" << i << ", " << j << ") of " << height << "x" << inner << "x" << width
+                              << " product variant " << variant << " is wrong." << std::endl;
+                    std::exit(-1);
+                }
+    }
+
+    // Products of a matrix with its own transpose.
+    Matrix<long> gram(height, height);
+    Matrix<long>::Mult(a, Matrix<long>::NO_TRANSPOSE,
+                       a, Matrix<long>::TRANSPOSE,
+                       gram);
+    Matrix<long> gramT(height, height);
+    Matrix<long>::Mult(aT, Matrix<long>::TRANSPOSE,
+                       aT, Matrix<long>::NO_TRANSPOSE,
+                       gramT);
+
+    for(int i = 0; i < height; ++i)
+        for(int j = 0; j < height; ++j)
+        {
+            long sum = 0;
+            for(int p = 0; p < inner; ++p)
+                sum += a(i, p) * a(j, p);
+            if(gram(i, j) != sum || gramT(i, j) != sum)
+            {
+                std::cout << "Entry at (" << i << ", " << j << ") of " << height << "x" << inner
+                          << " Gram matrix is wrong." << std::endl;
+                std::exit(-1);
+            }
+        }
+}
+
+
+
 int main(int argn, char** argv)
 {
     Matrix<double> m1(2, 1);
@@ -52,5 +128,13 @@ int main(int argn, char** argv)
         }
     }
 
+    srand(42);
+    testLongProducts(1, 1, 1);
+    testLongProducts(3, 5, 4);
+    testLongProducts(17, 3, 40);
+    testLongProducts(300, 7, 300);
+    testLongProducts(150, 150, 150);
+    testLongProducts(20, 600, 5);
+
     return 0;
 }
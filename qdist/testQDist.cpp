@@ -2,10 +2,36 @@
 #include "Util.hpp"
 #include "TreeUtil.hpp"
 #include "QDist.hpp"
+#include "TreeCache.hpp"
+#include "QDistServer.hpp"
+#include "QDistBatch.hpp"
+#include "QuartetQuery.hpp"
+#include "RFDist.hpp"
+#include "TreeSearch.hpp"
+#include "SketchIndex.hpp"
+#include "InternalNode.hpp"
+#include "LeafNode.hpp"
+#include "TreeReader.hpp"
+#include "BoundedQueue.hpp"
 
+#include <cstdio>
 #include <cstdlib>
 #include <iostream>
 #include <sstream>
+#include <fstream>
+#include <algorithm>
+#include <iterator>
+#include <set>
+#include <thread>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#ifdef QDIST_USE_ZLIB
+#include <zlib.h>
+#endif
+#ifdef QDIST_USE_ZSTD
+#include <zstd.h>
+#endif
 
 
 
@@ -19,36 +45,1396 @@ std::string toString(const T& x)
 
 
 
-void testTrees(Tree* tree1, Tree* tree2)
+void testTrees(Tree* tree1, Tree* tree2, const std::string &description)
 {
-#if 0 // FIXME: left over from when we implemented more of the algorithms.
-    long result1 = QDist::SubCubicQDist(tree1, tree2);
-    long result2 = QDist::CubicQDist(tree1, tree2);
-    long result3 = QDist::QuarticQDist(tree1, tree2);
+    long b1, b2, shared, diff;
+    long result1 = SubCubicQDist(tree1, tree2, b1, b2, shared, diff);
+
+    long qb1, qb2, qshared, qdiff;
+    long result2 = QuarticQDist(tree1, tree2, qb1, qb2, qshared, qdiff);
 
     bool fail = false;
 
     if(result1 != result2)
     {
-        std::cout << "Sub-cubic and cubic qdists disagree." << std::endl;
+        std::cout << "Sub-cubic and quartic qdists disagree." << std::endl;
         fail = true;
     }
 
-    if(result1 != result3)
+    if(b1 != qb1 || b2 != qb2)
     {
-        std::cout << "Sub-cubic and quartic qdists disagree." << std::endl;
+        std::cout << "Sub-cubic and quartic butterfly counts disagree." << std::endl;
+        fail = true;
+    }
+
+    if(shared != qshared || diff != qdiff)
+    {
+        std::cout << "Sub-cubic and quartic shared/different butterflies disagree." << std::endl;
+        fail = true;
+    }
+
+    // Both ways of computing the shared leaf set sizes, on the heap and in a mapped file.
+    SharedLeafSetTable<uint16_t> recursiveTable(tree1, tree2);
+    SharedLeafSetTable<uint32_t> bitsetTable(tree1, tree2, P_tmpdir);
+    TreeUtil::CalcSharedLeafSetSizes(tree1, tree2, &recursiveTable, TreeUtil::RECURSIVE_ENGINE);
+    TreeUtil::CalcSharedLeafSetSizes(tree1, tree2, &bitsetTable, TreeUtil::BITSET_ENGINE);
+    bool tablesAgree = bitsetTable.IsMapped();
+    for(int e1 = 0; e1 < tree1->NumEdges(); e1++)
+        for(int e2 = 0; e2 < tree2->NumEdges(); e2++)
+            tablesAgree = tablesAgree && recursiveTable[e1][e2] == bitsetTable[e1][e2];
+
+    if(!tablesAgree)
+    {
+        std::cout << "Recursive and bitset shared leaf set sizes disagree." << std::endl;
+        fail = true;
+    }
+
+    // The table in a mapped file, with 32-bit entries.
+    QDistOptions mappedOptions;
+    mappedOptions.sharedLeafSetTableDirectory = P_tmpdir;
+    mappedOptions.narrowSharedLeafSetTable = false;
+    long mb1, mb2, mshared, mdiff;
+    if(SubCubicQDist(tree1, tree2, mb1, mb2, mshared, mdiff, mappedOptions) != result2)
+    {
+        std::cout << "Sub-cubic qdist with a mapped table and quartic qdist disagree." << std::endl;
+        fail = true;
+    }
+
+    // Count every node pair that is large enough from the sparse representation of I.
+    QDistOptions sparseOptions;
+    sparseOptions.sparseDegreeThreshold = 3;
+    sparseOptions.sparseMinEntriesPerLeaf = 0;
+    long sb1, sb2, sshared, sdiff;
+    long result3 = SubCubicQDist(tree1, tree2, sb1, sb2, sshared, sdiff, sparseOptions);
+
+    if(result3 != result2 || sshared != qshared || sdiff != qdiff)
+    {
+        std::cout << "Sparse sub-cubic and quartic qdists disagree." << std::endl;
+        fail = true;
+    }
+
+    // Node pairs skipped before building I. Against itself, every pair of two different nodes
+    // adds nothing and is skipped.
+    long prunedPairs = -1;
+    QDistOptions pruningOptions;
+    pruningOptions.prunedPairs = &prunedPairs;
+    SubCubicQDist(tree1, tree2, b1, b2, shared, diff, pruningOptions);
+
+    long numNodes = 0;
+    for(int n = 0; n < tree1->NumInternalNodes(); n++)
+        if(tree1->GetInternalNode(n)->GetEdges().size() >= 3)
+            numNodes++;
+
+    if(prunedPairs < 0 || (tree1 == tree2 && prunedPairs != numNodes * numNodes - numNodes))
+    {
+        std::cout << "Unexpected number of skipped node pairs: " << prunedPairs << std::endl;
         fail = true;
     }
 
-    if(result2 != result3)
+    // The per-leaf and per-edge breakdown.
+    QDistBreakdown breakdown;
+    QDistOptions breakdownOptions;
+    breakdownOptions.breakdown = &breakdown;
+    SubCubicQDist(tree1, tree2, b1, b2, shared, diff, breakdownOptions);
+
+    QDistBreakdown expectedBreakdown;
+    QuarticQDist(tree1, tree2, qb1, qb2, qshared, qdiff, &expectedBreakdown);
+
+    if(breakdown.leafQuartets != expectedBreakdown.leafQuartets)
     {
-        std::cout << "Cubic and quartic qdists disagree." << std::endl;
+        std::cout << "Sub-cubic and quartic per-leaf breakdowns disagree." << std::endl;
+        fail = true;
+    }
+
+    if(breakdown.edgeQuartets != expectedBreakdown.edgeQuartets)
+    {
+        std::cout << "Sub-cubic and quartic per-edge breakdowns disagree." << std::endl;
         fail = true;
     }
 
     if(fail)
+    {
+        std::cout << "  " << description << std::endl;
+        std::cout << "  sub-cubic: Q=" << result1 << " B1=" << b1 << " B2=" << b2
+                  << " S=" << shared << " D=" << diff << std::endl;
+        std::cout << "  quartic:   Q=" << result2 << " B1=" << qb1 << " B2=" << qb2
+                  << " S=" << qshared << " D=" << qdiff << std::endl;
         exit(-1);
+    }
+}
+
+
+
+/*
+ * Check the paths and centers found with an LcaIndex against those found by a full traversal.
+ */
+void testLcaIndex(Tree* tree, const std::string &description)
+{
+    LcaIndex index(tree);
+
+    for(int a = 0; a < tree->NumLeafNodes(); ++a)
+        for(int b = 0; b < tree->NumLeafNodes(); ++b)
+        {
+            if(a == b)
+                continue;
+
+            LeafNode* leafA = tree->GetLeafNode(a);
+            LeafNode* leafB = tree->GetLeafNode(b);
+            Path* path1 = TreeUtil::FindPath(leafA, leafB);
+            Path* path2 = TreeUtil::FindPath(index, leafA, leafB);
+
+            if(path1->GetEdges() != path2->GetEdges() ||
+               index.Distance(leafA, leafB) != (int)path1->GetEdges().size())
+            {
+                std::cout << "LCA index test failed for leaves " << a << " and " << b << std::endl;
+                std::cout << "  " << description << std::endl;
+                exit(-1);
+            }
+
+            delete path1;
+            delete path2;
+
+            //a center for the pair, with a third leaf
+            int c = (std::max(a, b) + 1) % tree->NumLeafNodes();
+            if(c == a || c == b)
+                continue;
+            LeafNode* leafC = tree->GetLeafNode(c);
+            Center center1 = TreeUtil::FindCenter(tree, leafA, leafB, leafC);
+            Center center2 = TreeUtil::FindCenter(index, leafA, leafB, leafC);
+            if(center1.GetCenterNode() != center2.GetCenterNode() || center1.GetAEdge() != center2.GetAEdge() ||
+               center1.GetBEdge() != center2.GetBEdge() || center1.GetCEdge() != center2.GetCEdge())
+            {
+                std::cout << "LCA index center test failed for leaves " << a << ", " << b << " and " << c << std::endl;
+                std::cout << "  " << description << std::endl;
+                exit(-1);
+            }
+        }
+}
+
+
+
+/*
+ * Check the leaf span of every edge against the leaves found by a traversal of its subtree.
+ */
+void testLeafIntervals(Tree* tree, const std::string &description)
+{
+    LeafIntervals intervals(tree);
+
+    for(int e = 0; e < tree->NumEdges(); ++e)
+    {
+        DirectedEdge* edge = tree->GetEdge(e);
+        std::vector<LeafNode*> leaves1 = TreeUtil::CollectLeavesInSubtree(edge);
+        std::vector<LeafNode*> leaves2(intervals.Begin(edge), intervals.End(edge));
+        std::sort(leaves1.begin(), leaves1.end());
+        std::sort(leaves2.begin(), leaves2.end());
+
+        if(leaves1 != leaves2 || intervals.Size(edge) != (int)leaves1.size())
+        {
+            std::cout << "Leaf interval test failed for edge " << e << std::endl;
+            std::cout << "  " << description << std::endl;
+            exit(-1);
+        }
+    }
+}
+
+
+
+/*
+ * Query every quartet of a tree in a batch on several threads, and check the topologies
+ * against single queries and the brute-force QuartetTopologies, and the number of displayed
+ * butterflies against B(tree).
+ */
+void testQuartetQuery(Tree* tree, long butterflies, const std::string &description)
+{
+    const int n = tree->NumLeafNodes();
+    QuartetQuery query(tree);
+
+    std::vector<QuartetQuery::Quartet> quartets;
+    for(int a = 0; a < n; ++a)
+        for(int b = a + 1; b < n; ++b)
+            for(int c = b + 1; c < n; ++c)
+                for(int d = c + 1; d < n; ++d)
+                {
+                    QuartetQuery::Quartet q = {a, b, c, d};
+                    quartets.push_back(q);
+                }
+
+    std::vector<QuartetQuery::Topology> topologies;
+    query.Query(quartets, &topologies, 3);
+    QuartetTopologies reference(tree);
+
+    //turn every butterfly into the form ab|cd
+    std::vector<QuartetQuery::Quartet> butterflyQuartets;
+    bool agree = true;
+    for(unsigned i = 0; i < quartets.size(); ++i)
+    {
+        QuartetQuery::Quartet q = quartets[i];
+        agree = agree && topologies[i] == query.Query(q.a, q.b, q.c, q.d)
+            && topologies[i] == reference.Topology(q.a, q.b, q.c, q.d);
+
+        if(topologies[i] == QuartetQuery::AC_BD)
+            std::swap(q.b, q.c);
+        else if(topologies[i] == QuartetQuery::AD_BC)
+            std::swap(q.b, q.d);
+        if(topologies[i] != QuartetQuery::STAR)
+            butterflyQuartets.push_back(q);
+    }
+
+    if(!agree || (long)butterflyQuartets.size() != butterflies ||
+       query.CountDisplayed(butterflyQuartets, 3) != butterflies ||
+       query.CountDisplayed(quartets, 1) != (long)std::count(topologies.begin(), topologies.end(), QuartetQuery::AB_CD))
+    {
+        std::cout << "Quartet query test failed" << std::endl;
+        std::cout << "  " << description << std::endl;
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * The non-trivial splits of a tree, each as the sorted labels of the side without the
+ * smallest label.
+ */
+std::set<std::vector<std::string> > treeSplits(Tree* tree)
+{
+    std::string smallest = tree->GetLeafNode(0)->GetLabel();
+    for(int i = 0; i < tree->NumLeafNodes(); ++i)
+        smallest = std::min(smallest, tree->GetLeafNode(i)->GetLabel());
+
+    std::set<std::vector<std::string> > splits;
+    for(int e = 0; e < tree->NumEdges(); ++e)
+    {
+        std::vector<LeafNode*> leaves = TreeUtil::CollectLeavesInSubtree(tree->GetEdge(e));
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < leaves.size(); ++i)
+            labels.push_back(leaves[i]->GetLabel());
+        std::sort(labels.begin(), labels.end());
+
+        if(labels.size() >= 2 && (int)labels.size() <= tree->NumLeafNodes() - 2 && labels[0] != smallest)
+            splits.insert(labels);
+    }
+    return splits;
+}
+
+
+
+/*
+ * Check the Robinson-Foulds distance against the splits compared as leaf sets.
+ */
+void testRFDist(Tree* tree1, Tree* tree2, const std::string &description)
+{
+    std::set<std::vector<std::string> > splits1 = treeSplits(tree1);
+    std::set<std::vector<std::string> > splits2 = treeSplits(tree2);
+    std::vector<std::vector<std::string> > difference;
+    std::set_symmetric_difference(splits1.begin(), splits1.end(), splits2.begin(), splits2.end(),
+                                  std::back_inserter(difference));
+
+    long numSplits1, numSplits2;
+    long rf = RFDist(tree1, tree2, numSplits1, numSplits2);
+
+    if(rf != (long)difference.size() || numSplits1 != (long)splits1.size() || numSplits2 != (long)splits2.size())
+    {
+        std::cout << "RF test failed" << std::endl;
+        std::cout << "  " << description << std::endl;
+        std::cout << "  RF=" << rf << " splits " << numSplits1 << " " << numSplits2 << std::endl;
+        std::cout << "  expected RF=" << difference.size() << " splits " << splits1.size() << " " << splits2.size() << std::endl;
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Write the trees to tree cache files and check that they load as the same trees.
+ */
+void testTreeCache(Tree* tree1, Tree* tree2, const std::string &description)
+{
+    const std::string prefix = std::string(P_tmpdir) + "/testQDist-" + toString(getpid());
+    TreeCache::Write(tree1, prefix + "-1.qdt");
+    TreeCache::Write(tree2, prefix + "-2.qdt");
+
+    bool fail = !TreeCache::IsCacheFile(prefix + "-1.qdt");
+    Tree* loaded1 = TreeCache::Load(prefix + "-1.qdt");
+    Tree* loaded2 = TreeCache::Load(prefix + "-2.qdt");
+    unlink((prefix + "-1.qdt").c_str());
+    unlink((prefix + "-2.qdt").c_str());
+
+    TreeUtil::CheckTree(loaded1);
+    TreeUtil::CheckTree(loaded2);
+
+    for(int i = 0; i < tree1->NumLeafNodes(); i++)
+        fail = fail || loaded1->GetLeafNode(i)->GetLabel() != tree1->GetLeafNode(i)->GetLabel()
+                    || loaded2->GetLeafNode(i)->GetLabel() != tree2->GetLeafNode(i)->GetLabel();
+
+    fail = fail || loaded1->GetSubtreeLeafSetSizes() != TreeUtil::SubtreeLeafSetSizes(tree1);
+
+    long b1, b2, shared, diff;
+    long lb1, lb2, lshared, ldiff;
+    fail = fail || SubCubicQDist(loaded1, loaded2, lb1, lb2, lshared, ldiff)
+                   != SubCubicQDist(tree1, tree2, b1, b2, shared, diff);
+
+    if(fail)
+    {
+        std::cout << "Trees loaded from tree cache files differ." << std::endl;
+        std::cout << "  " << description << std::endl;
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Send the server requests for the two trees and check its responses against SubCubicQDist.
+ */
+void testServer(QDistServer* server, const std::string &newick1, const std::string &newick2,
+                Tree* tree1, Tree* tree2)
+{
+    long b1, b2, shared, diff;
+    long result = SubCubicQDist(tree1, tree2, b1, b2, shared, diff);
+    const std::string expected = "OK\t" + toString(tree1->NumLeafNodes()) + "\t" + toString(b1)
+        + "\t" + toString(b2) + "\t" + toString(shared) + "\t" + toString(diff)
+        + "\t" + toString(result) + "\n";
+
+    // registered with whitespace and without the semicolon, it has the same hash
+    std::string spaced;
+    for(std::string::size_type i = 0; i + 1 < newick1.size(); i++)
+        spaced += newick1[i] == ',' ? std::string(", ") : std::string(1, newick1[i]);
+
+    FILE* in = tmpfile();
+    FILE* out = tmpfile();
+    fprintf(in, "REGISTER %s\n", spaced.c_str());
+    fprintf(in, "COMPARE %x %s\n", 0, newick2.c_str());
+    fprintf(in, "BATCH 2\n%s %s\nnotatree %s\n", newick1.c_str(), newick2.c_str(), newick2.c_str());
+    fprintf(in, "QUIT\nCOMPARE %s %s\n", newick1.c_str(), newick2.c_str());
+    rewind(in);
+    server->Serve(in, out);
+    rewind(out);
+
+    std::vector<std::string> lines;
+    char buffer[4096];
+    while(fgets(buffer, sizeof(buffer), out))
+        lines.push_back(buffer);
+    fclose(in);
+    fclose(out);
+
+    std::ostringstream hash;
+    hash << "OK\t" << std::hex << Util::HashString(newick1) << "\n";
+
+    if(lines.size() != 4 || lines[0] != hash.str() || lines[1].compare(0, 6, "ERROR\t") != 0
+       || lines[2] != expected || lines[3].compare(0, 6, "ERROR\t") != 0)
+    {
+        std::cout << "Server responses are wrong." << std::endl;
+        std::cout << "  " << newick1 << " vs " << newick2 << std::endl;
+        for(unsigned i = 0; i < lines.size(); i++)
+            std::cout << "  " << lines[i];
+        exit(-1);
+    }
+
+    // inline trees do not push a registered tree out of a cache of a single tree
+    QDistServer small(1, 1);
+    in = tmpfile();
+    out = tmpfile();
+    fprintf(in, "REGISTER %s\n", newick1.c_str());
+    fprintf(in, "COMPARE %s %s\n", newick2.c_str(), newick1.c_str());
+    fprintf(in, "COMPARE %s %s\n", hash.str().substr(3, hash.str().size() - 4).c_str(), newick2.c_str());
+    rewind(in);
+    small.Serve(in, out);
+    rewind(out);
+
+    lines.clear();
+    while(fgets(buffer, sizeof(buffer), out))
+        lines.push_back(buffer);
+    fclose(in);
+    fclose(out);
+
+    if(lines.size() != 3 || lines[0] != hash.str() || lines[2] != expected)
+    {
+        std::cout << "Inline trees push registered trees out of the server cache." << std::endl;
+        for(unsigned i = 0; i < lines.size(); i++)
+            std::cout << "  " << lines[i];
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Compare the test data trees in a batch, named by file and by index into a collection, and
+ * check each result line against SubCubicQDist.
+ */
+void testBatch(const std::vector<std::string> &filenames, NewickParser* parser)
+{
+    const std::string collectionFilename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".trees";
+    std::ofstream collection(collectionFilename.c_str());
+    for(unsigned i = 0; i < filenames.size(); i++)
+        collection << Util::LoadFileToString(filenames[i]) << std::endl;
+    collection.close();
+
+    std::ostringstream manifest;
+    std::vector<std::string> expected;
+    for(unsigned i = 0; i < filenames.size(); i++)
+        for(unsigned j = 0; j < filenames.size(); j++)
+        {
+            Tree* tree1 = parser->Parse(Util::LoadFileToString(filenames[i]));
+            Tree* tree2 = parser->Parse(Util::LoadFileToString(filenames[j]));
+            TreeUtil::RenumberTreeAccordingToOther(tree2, tree1);
+            long b1, b2, shared, diff;
+            long result = SubCubicQDist(tree1, tree2, b1, b2, shared, diff);
+            std::string fields = "\t" + toString(b1) + "\t" + toString(b2) + "\t" + toString(shared)
+                + "\t" + toString(diff) + "\t";
+
+            manifest << filenames[i] << ' ' << toString(j) << std::endl;
+            expected.push_back(filenames[i] + "\t" + toString(j) + "\t" + toString(tree1->NumLeafNodes())
+                               + fields + "|" + toString(result));
+        }
+    manifest << "# a comment" << std::endl << std::endl << "0 " << filenames.size() << std::endl;
+    expected.push_back("0\t" + toString(filenames.size()) + "\tNA");
+
+    QDistBatch batch(3, QDistBatch::TSV_FORMAT);
+    batch.LoadTreeCollection(collectionFilename);
+    unlink(collectionFilename.c_str());
+
+    std::istringstream in(manifest.str());
+    std::ostringstream out;
+    batch.Run(in, out);
+
+    std::istringstream lines(out.str());
+    std::string line;
+    std::getline(lines, line);
+    bool fail = line.compare(0, 6, "tree1\t") != 0;
+    for(unsigned k = 0; k < expected.size() && !fail; k++)
+    {
+        // the expected line up to the normalized shared butterflies, then Q
+        std::string::size_type bar = expected[k].find('|');
+        std::string::size_type prefix = bar == std::string::npos ? expected[k].size() : bar;
+        fail = !std::getline(lines, line) || line.compare(0, prefix, expected[k], 0, prefix) != 0;
+        if(!fail && bar != std::string::npos)
+        {
+            std::vector<std::string> columns;
+            std::istringstream fields(line);
+            std::string column;
+            while(std::getline(fields, column, '\t'))
+                columns.push_back(column);
+            fail = columns.size() != 10 || columns[8] != expected[k].substr(bar + 1);
+        }
+    }
+
+    if(fail || std::getline(lines, line))
+    {
+        std::cout << "Batch results are wrong." << std::endl;
+        std::cout << out.str();
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Read a file of the test data trees, with line breaks inside and between the trees, plain
+ * and compressed, in chunks of several sizes, and check that the same trees come out as from
+ * NewickParser::SplitTrees.
+ */
+void testTreeReader(const std::vector<std::string> &filenames)
+{
+    const std::string prefix = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".trees";
+
+    std::string contents;
+    for(unsigned i = 0; i < filenames.size(); i++)
+    {
+        std::string newick = Util::LoadFileToString(filenames[i]);
+        newick.insert(newick.find(','), "\n");
+        contents += newick + "\n";
+    }
+    contents += "(a,b,(c,d))";
+    std::string joined = contents;
+    joined.erase(std::remove(joined.begin(), joined.end(), '\n'), joined.end());
+    std::vector<std::string> expected = NewickParser::SplitTrees(joined);
+
+    std::vector<std::string> files;
+    files.push_back(prefix);
+    std::ofstream(prefix.c_str()) << contents;
+#ifdef QDIST_USE_ZLIB
+    files.push_back(prefix + ".gz");
+    gzFile gz = gzopen(files.back().c_str(), "wb");
+    gzwrite(gz, contents.data(), contents.size());
+    gzclose(gz);
 #endif
+#ifdef QDIST_USE_ZSTD
+    files.push_back(prefix + ".zst");
+    std::vector<char> compressed(ZSTD_compressBound(contents.size()));
+    compressed.resize(ZSTD_compress(&compressed[0], compressed.size(), contents.data(), contents.size(), 3));
+    std::ofstream(files.back().c_str()).write(&compressed[0], compressed.size());
+#endif
+
+    const size_t chunkSizes[] = {1, 7, 1 << 18};
+    for(unsigned f = 0; f < files.size(); f++)
+    {
+        for(unsigned c = 0; c < 3; c++)
+        {
+            TreeReader reader(files[f], chunkSizes[c]);
+            std::vector<std::string> trees;
+            std::string newick;
+            while(reader.Next(newick))
+                trees.push_back(newick);
+
+            if(trees != expected)
+            {
+                std::cout << "Trees read from " << files[f] << " in chunks of " << chunkSizes[c]
+                          << " bytes are wrong." << std::endl;
+                exit(-1);
+            }
+        }
+
+        //a compressed file cut short must fail to read, in a child process as the reader exits
+        if(f > 0)
+        {
+            std::ifstream file(files[f].c_str(), std::ios::binary);
+            std::string bytes((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+            file.close();
+            std::ofstream(files[f].c_str()).write(bytes.data(), bytes.size() - 8);
+            pid_t child = fork();
+            if(child == 0)
+            {
+                freopen("/dev/null", "w", stderr);
+                TreeReader reader(files[f]);
+                std::string newick;
+                while(reader.Next(newick))
+                    ;
+                _exit(0);
+            }
+            int status;
+            waitpid(child, &status, 0);
+            if(!WIFEXITED(status) || WEXITSTATUS(status) != EXIT_FAILURE)
+            {
+                std::cout << "Truncated " << files[f] << " was read without an error." << std::endl;
+                exit(-1);
+            }
+        }
+        unlink(files[f].c_str());
+    }
+}
+
+
+
+/*
+ * Resume a comparison and a batch from their checkpoints, and check that the results come
+ * out the same. The batch checkpoint is cut back to its first result lines, as if the batch
+ * had been interrupted. The comparison checkpoint and the first saved result line are changed
+ * to show that the saved state is used.
+ */
+void testCheckpoint(const std::vector<std::string> &filenames, NewickParser* parser)
+{
+    const std::string checkpointFilename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".checkpoint";
+
+    Tree* tree1 = parser->Parse(Util::LoadFileToString(filenames[0]));
+    Tree* tree2 = parser->Parse(Util::LoadFileToString(filenames[1]));
+    TreeUtil::RenumberTreeAccordingToOther(tree2, tree1);
+
+    QDistBreakdown breakdown;
+    QDistOptions options;
+    options.breakdown = &breakdown;
+    options.checkpointFilename = checkpointFilename;
+    options.checkpointInterval = 0;
+    long b1, b2, shared, diff;
+    long result = SubCubicQDist(tree1, tree2, b1, b2, shared, diff, options);
+
+    //count one more shared butterfly than saved
+    std::ostringstream stateStream;
+    stateStream << std::ifstream(checkpointFilename.c_str()).rdbuf();
+    std::string state = stateStream.str();
+    std::string::size_type start = state.find("value shared ") + 13;
+    std::string::size_type end = state.find('\n', start);
+    long saved = atol(state.substr(start, end - start).c_str());
+    state.replace(start, end - start, toString(saved + 4));
+    std::ofstream(checkpointFilename.c_str()) << state;
+
+    QDistBreakdown resumedBreakdown;
+    options.breakdown = &resumedBreakdown;
+    options.resume = true;
+    long resumedShared;
+    long resumed = SubCubicQDist(tree1, tree2, b1, b2, resumedShared, diff, options);
+    if(resumedShared != shared + 1 || resumed != result - 2
+       || resumedBreakdown.leafQuartets != breakdown.leafQuartets
+       || resumedBreakdown.edgeQuartets != breakdown.edgeQuartets)
+    {
+        std::cout << "Resumed comparison of " << filenames[0] << " and " << filenames[1]
+                  << " does not continue from the checkpoint." << std::endl;
+        exit(-1);
+    }
+    unlink(checkpointFilename.c_str());
+    TreeUtil::DeleteTree(tree1);
+    TreeUtil::DeleteTree(tree2);
+
+    //the whole batch, then again from its first three result lines
+    std::ostringstream manifest;
+    for(unsigned i = 0; i < filenames.size(); i++)
+        for(unsigned j = 0; j < filenames.size(); j++)
+            manifest << filenames[i] << ' ' << filenames[j] << std::endl;
+
+    QDistOptions batchOptions;
+    batchOptions.checkpointFilename = checkpointFilename;
+    std::string outputs[2];
+    for(int run = 0; run < 2; run++)
+    {
+        QDistBatch batch(2, QDistBatch::NDJSON_FORMAT, batchOptions);
+        std::istringstream in(manifest.str());
+        std::ostringstream out;
+        batch.Run(in, out);
+        outputs[run] = out.str();
+
+        std::ifstream lines(checkpointFilename.c_str());
+        std::ostringstream firstLines;
+        std::string line;
+        for(int k = 0; k < 2 + 3 && std::getline(lines, line); k++)
+            firstLines << (k == 2 ? "line {\"saved\":true}" : line) << std::endl;
+        std::ofstream(checkpointFilename.c_str()) << firstLines.str();
+        batchOptions.resume = true;
+    }
+    unlink(checkpointFilename.c_str());
+
+    //the first line comes from the checkpoint, the others are the same
+    if(outputs[1] != "{\"saved\":true}" + outputs[0].substr(outputs[0].find('\n')))
+    {
+        std::cout << "Resumed batch results are wrong." << std::endl;
+        std::cout << outputs[0] << "--" << std::endl << outputs[1];
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Build a caterpillar with n leaves directly, as the parser cannot take trees this deep. The
+ * root is the internal node at one end of the spine.
+ */
+Tree* caterpillarTree(int n)
+{
+    std::vector<InternalNode*> internalNodes;
+    std::vector<LeafNode*> leafNodes;
+    std::vector<DirectedEdge*> edges;
+
+    for(int i = 0; i < n - 2; ++i)
+        internalNodes.push_back(new InternalNode("", i));
+    for(int i = 0; i < n; ++i)
+        leafNodes.push_back(new LeafNode("L" + toString(i), i));
+
+    std::vector<std::pair<Node*, Node*> > links;
+    for(int i = 0; i < n - 2; ++i)
+        links.push_back(std::make_pair((Node*)internalNodes[i], (Node*)leafNodes[i]));
+    for(int i = 0; i + 1 < n - 2; ++i)
+        links.push_back(std::make_pair((Node*)internalNodes[i], (Node*)internalNodes[i + 1]));
+    links.push_back(std::make_pair((Node*)internalNodes[0], (Node*)leafNodes[n - 2]));
+    links.push_back(std::make_pair((Node*)internalNodes[n - 3], (Node*)leafNodes[n - 1]));
+
+    for(unsigned i = 0; i < links.size(); ++i)
+    {
+        DirectedEdge* edge = new DirectedEdge(edges.size());
+        edges.push_back(edge);
+        DirectedEdge* backEdge = new DirectedEdge(edges.size());
+        edges.push_back(backEdge);
+
+        edge->SetFromNode(links[i].first);
+        edge->SetToNode(links[i].second);
+        backEdge->SetFromNode(links[i].second);
+        backEdge->SetToNode(links[i].first);
+        edge->SetBackEdge(backEdge);
+        backEdge->SetBackEdge(edge);
+        links[i].first->AddEdge(edge);
+        links[i].second->AddEdge(backEdge);
+    }
+
+    Tree* tree = new Tree();
+    tree->SetRoot(internalNodes[0]);
+    tree->SetInternalNodeList(internalNodes);
+    tree->SetLeafNodeList(leafNodes);
+    tree->SetEdgeList(edges);
+    return tree;
+}
+
+
+
+/*
+ * The tree traversals must not be limited by the depth of the tree.
+ */
+void testDeepTree(int n)
+{
+    Tree* tree = caterpillarTree(n);
+    TreeUtil::CheckTree(tree);
+
+    std::vector<DirectedEdge*> downEdges = TreeUtil::CollectEdgesPointingAwayFromRoot(tree);
+    std::vector<int> sizes = TreeUtil::SubtreeLeafSetSizes(tree);
+    std::vector<LeafNode*> leaves = TreeUtil::CollectLeavesInSubtree(tree->GetLeafNode(n - 2)->GetEdge());
+    Path* path = TreeUtil::FindPath(tree->GetLeafNode(n - 2), tree->GetLeafNode(n - 1));
+    LcaIndex index(tree);
+    Center center = TreeUtil::FindCenter(index, tree->GetLeafNode(0), tree->GetLeafNode(n - 2), tree->GetLeafNode(n - 1));
+
+    // the edge from the root down the spine holds all leaves but the two at the root
+    int spineEdge = tree->GetInternalNode(0)->GetEdges()[1]->GetEdgeId();
+
+    if((int)downEdges.size() != n * 2 - 3 || sizes[spineEdge] != n - 2 ||
+       (int)leaves.size() != n - 1 || (int)path->GetEdges().size() != n - 1 ||
+       index.Distance(tree->GetLeafNode(n - 2), tree->GetLeafNode(n - 1)) != n - 1 ||
+       center.GetCenterNode() != tree->GetInternalNode(0))
+    {
+        std::cout << "Deep tree test failed for a caterpillar with " << n << " leaves" << std::endl;
+        exit(-1);
+    }
+
+    delete path;
+    TreeUtil::DeleteTree(tree);
+}
+
+
+
+/*
+ * Build a random tree in Newick format over the given labels. Subtrees are joined two to
+ * maxJoin at a time, so the tree may contain polytomies, and the root has degree two or three.
+ */
+std::string randomNewick(std::vector<std::string> subtrees, unsigned maxJoin)
+{
+    std::random_shuffle(subtrees.begin(), subtrees.end());
+
+    const unsigned rootDegree = 2 + rand() % 2;
+
+    while(subtrees.size() > rootDegree)
+    {
+        unsigned k = std::min(2 + rand() % (maxJoin - 1), (unsigned)(subtrees.size() - rootDegree + 1));
+
+        std::string joined = "(";
+        for(unsigned i = 0; i < k; ++i)
+        {
+            unsigned pick = rand() % subtrees.size();
+            joined += (i == 0 ? "" : ",") + subtrees[pick];
+            subtrees.erase(subtrees.begin() + pick);
+        }
+        joined += ")";
+
+        subtrees.push_back(joined);
+    }
+
+    std::string newick = "(";
+    for(unsigned i = 0; i < subtrees.size(); ++i)
+        newick += (i == 0 ? "" : ",") + subtrees[i];
+    newick += ");";
+
+    return newick;
+}
+
+
+
+void testRandomTrees(NewickParser* parser, unsigned rounds)
+{
+    // a small cache, so trees are also dropped from it
+    QDistServer server(1, 8);
+
+    for(unsigned round = 0; round < rounds; ++round)
+    {
+        const unsigned n = 4 + rand() % 9;
+
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < n; ++i)
+            labels.push_back("L" + toString(i));
+
+        // every other round favours high-degree nodes
+        const unsigned maxJoin = (round % 2 == 0) ? 4 : 8;
+
+        std::string newick1 = randomNewick(labels, maxJoin);
+        std::string newick2 = randomNewick(labels, maxJoin);
+
+        Tree* tree1 = parser->Parse(newick1);
+        Tree* tree2 = parser->Parse(newick2);
+
+        TreeUtil::RenumberTreeAccordingToOther(tree2, tree1);
+
+        TreeUtil::CheckTree(tree1);
+        TreeUtil::CheckTree(tree2);
+
+        testTrees(tree1, tree2, newick1 + " vs " + newick2);
+        testTrees(tree1, tree1, newick1 + " vs itself");
+        testTreeCache(tree1, tree2, newick1 + " vs " + newick2);
+        testLcaIndex(tree1, newick1);
+        testLeafIntervals(tree1, newick1);
+
+        long b1, b2, shared, diff;
+        QuarticQDist(tree1, tree2, b1, b2, shared, diff);
+        testQuartetQuery(tree1, b1, newick1);
+        testRFDist(tree1, tree2, newick1 + " vs " + newick2);
+        if(round % 10 == 0)
+            testServer(&server, newick1, newick2, tree1, tree2);
+    }
+}
+
+
+
+/*
+ * Check nearest neighbours and the medoid of random collections against all distances.
+ */
+void testTreeSearch(NewickParser* parser, unsigned rounds)
+{
+    for(unsigned round = 0; round < rounds; ++round)
+    {
+        const unsigned n = 5 + rand() % 6;
+        const unsigned numTrees = 1 + rand() % 25;
+
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < n; ++i)
+            labels.push_back("L" + toString(i));
+
+        std::vector<Tree*> trees;
+        for(unsigned t = 0; t < numTrees; ++t)
+        {
+            Tree* tree = parser->Parse(randomNewick(labels, 2 + rand() % 3));
+            TreeUtil::RenumberTreeCanonically(tree);
+            TreeUtil::PrecomputeSubtreeData(tree);
+            trees.push_back(tree);
+        }
+
+        std::vector<std::vector<long> > distances(numTrees, std::vector<long>(numTrees));
+        for(unsigned x = 0; x < numTrees; ++x)
+            for(unsigned y = 0; y < numTrees; ++y)
+            {
+                long b1, b2, shared, diff;
+                distances[x][y] = SubCubicQDist(trees[x], trees[y], b1, b2, shared, diff);
+            }
+
+        //pivot q compares with the trees that are not pivots yet, itself excluded
+        const long numPivots = std::min<long>(rand() % 4, numTrees);
+        TreeSearch search(trees, numPivots, 1 + rand() % 3);
+        bool ok = search.NumComparisons() <= numPivots * (numTrees - 1) - numPivots * (numPivots - 1) / 2;
+
+        //neighbours of a tree in the collection
+        const unsigned query = rand() % numTrees;
+        const int k = 1 + rand() % 5;
+        std::vector<std::pair<long, int> > neighbours = search.NearestNeighbours(trees[query], k);
+        std::vector<long> expected(distances[query]);
+        std::sort(expected.begin(), expected.end());
+        expected.resize(std::min<unsigned>(k, numTrees));
+
+        ok = ok && neighbours.size() == expected.size();
+        for(unsigned i = 0; ok && i < neighbours.size(); ++i)
+            ok = neighbours[i].first == expected[i] &&
+                 distances[query][neighbours[i].second] == neighbours[i].first;
+
+        std::pair<int, long> medoid = search.Medoid();
+        long bestSum = -1;
+        for(unsigned x = 0; x < numTrees; ++x)
+        {
+            long sum = 0;
+            for(unsigned y = 0; y < numTrees; ++y)
+                sum += distances[x][y];
+            if(bestSum == -1 || sum < bestSum)
+                bestSum = sum;
+        }
+        long medoidSum = 0;
+        for(unsigned y = 0; y < numTrees; ++y)
+            medoidSum += distances[medoid.first][y];
+        ok = ok && medoid.second == bestSum && medoidSum == bestSum;
+
+        if(!ok)
+        {
+            std::cout << "Tree search test failed in round " << round << std::endl;
+            exit(-1);
+        }
+
+        for(unsigned t = 0; t < numTrees; ++t)
+            TreeUtil::DeleteTree(trees[t]);
+    }
+}
+
+
+
+/*
+ * Helper for testBreakdownRooting. The newick of the subtree an edge points to.
+ */
+std::string newickBelow(DirectedEdge* edge)
+{
+    Node* node = edge->GetToNode();
+    if(node->isLeaf())
+        return node->GetLabel();
+
+    std::string newick;
+    const std::vector<DirectedEdge*> &edges = ((InternalNode*)node)->GetEdges();
+    for(unsigned i = 0; i < edges.size(); ++i)
+        if(edges[i] != edge->GetBackEdge())
+            newick += (newick.empty() ? "(" : ",") + newickBelow(edges[i]);
+    return newick + ")";
+}
+
+
+
+/*
+ * Helper for testBreakdownRooting. The breakdown TSV of a comparison of two trees.
+ */
+std::string breakdownTsv(NewickParser* parser, const std::string &newick1, const std::string &newick2)
+{
+    Tree* tree1 = parser->Parse(newick1);
+    Tree* tree2 = parser->Parse(newick2);
+    TreeUtil::RenumberTreeAccordingToOther(tree2, tree1);
+
+    QDistBreakdown breakdown;
+    QDistOptions options;
+    options.breakdown = &breakdown;
+    long b1, b2, shared, diff;
+    SubCubicQDist(tree1, tree2, b1, b2, shared, diff, options);
+
+    std::ostringstream out;
+    breakdown.Write(out, tree1);
+    TreeUtil::DeleteTree(tree1);
+    TreeUtil::DeleteTree(tree2);
+    return out.str();
+}
+
+
+
+/*
+ * The breakdown TSV of a tree must not depend on where the tree is rooted. Each tree is
+ * written again rooted on a random edge, which gives a root of degree two, or at a random
+ * internal node, and both rootings are compared to the same other tree.
+ */
+void testBreakdownRooting(NewickParser* parser, unsigned rounds)
+{
+    for(unsigned round = 0; round < rounds; ++round)
+    {
+        const unsigned n = 4 + rand() % 8;
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < n; ++i)
+            labels.push_back("L" + toString(i));
+
+        std::string newicks[2];
+        newicks[0] = randomNewick(labels, 2 + rand() % 3);
+        Tree* tree = parser->Parse(newicks[0]);
+        if(rand() % 2 == 0)
+        {
+            DirectedEdge* edge = tree->GetEdge(rand() % tree->NumEdges());
+            newicks[1] = "(" + newickBelow(edge) + "," + newickBelow(edge->GetBackEdge()) + ");";
+        }
+        else
+        {
+            const std::vector<DirectedEdge*> &edges = tree->GetInternalNode(rand() % tree->NumInternalNodes())->GetEdges();
+            for(unsigned i = 0; i < edges.size(); ++i)
+                newicks[1] += (i == 0 ? "(" : ",") + newickBelow(edges[i]);
+            newicks[1] += ");";
+        }
+        TreeUtil::DeleteTree(tree);
+        const std::string other = randomNewick(labels, 2 + rand() % 3);
+
+        if(breakdownTsv(parser, newicks[0], other) != breakdownTsv(parser, newicks[1], other))
+        {
+            std::cout << "Breakdown of " << newicks[0] << " changes when rooted as " << newicks[1] << std::endl;
+            exit(-1);
+        }
+    }
+
+    //the example of a root of degree two: one line for the split, with both edges' counts
+    const std::string rootings[2] = {"((a,b,e),(c,d,f));", "(a,b,e,(c,d,f));"};
+    for(unsigned r = 0; r < 2; ++r)
+    {
+        std::string tsv = breakdownTsv(parser, rootings[r], "((a,c,e),(b,d,f));");
+        if(tsv.find("edge\ta,b,e\t16\n") == std::string::npos || tsv.find("edge\tc,d,f") != std::string::npos)
+        {
+            std::cout << "Breakdown of " << rootings[r] << " is wrong:" << std::endl << tsv;
+            exit(-1);
+        }
+    }
+}
+
+
+
+/*
+ * Random trees on few leaves repeat their topologies, rooted and ordered differently. Trees
+ * must get the same topology hash and representative exactly when their distance is 0, and
+ * the collapsed collection must give the same searches and batch results as the whole one.
+ */
+void testTopologyHash(NewickParser* parser, unsigned rounds)
+{
+    const std::string filename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".trees";
+
+    for(unsigned round = 0; round < rounds; ++round)
+    {
+        const unsigned n = 4 + rand() % 3;
+        const unsigned numTrees = 2 + rand() % 20;
+
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < n; ++i)
+            labels.push_back("L" + toString(i));
+
+        std::vector<Tree*> trees;
+        std::ofstream out(filename.c_str());
+        for(unsigned t = 0; t < numTrees; ++t)
+        {
+            std::string newick = randomNewick(labels, 2 + rand() % 2);
+            out << newick << std::endl;
+            Tree* tree = parser->Parse(newick);
+            TreeUtil::RenumberTreeCanonically(tree);
+            TreeUtil::PrecomputeSubtreeData(tree);
+            trees.push_back(tree);
+        }
+        out.close();
+
+        std::vector<int> representatives = TreeUtil::FindDuplicateTopologies(trees);
+        std::vector<std::vector<long> > distances(numTrees, std::vector<long>(numTrees));
+        bool ok = true;
+        for(unsigned x = 0; x < numTrees; ++x)
+            for(unsigned y = 0; y < numTrees; ++y)
+            {
+                long b1, b2, shared, diff;
+                distances[x][y] = SubCubicQDist(trees[x], trees[y], b1, b2, shared, diff);
+                bool same = distances[x][y] == 0;
+                ok = ok && (TreeUtil::TopologyHash(trees[x]) == TreeUtil::TopologyHash(trees[y])) == same
+                    && (representatives[x] == representatives[y]) == same && representatives[x] <= (int)x;
+            }
+
+        //search the distinct topologies, each with its multiplicity
+        std::vector<Tree*> topologies;
+        std::vector<unsigned> topologyTrees;
+        std::vector<long> multiplicities;
+        std::vector<int> topologyOf(numTrees);
+        for(unsigned x = 0; x < numTrees; ++x)
+        {
+            if(representatives[x] == (int)x)
+            {
+                topologyOf[x] = topologies.size();
+                topologies.push_back(trees[x]);
+                topologyTrees.push_back(x);
+                multiplicities.push_back(0);
+            }
+            else
+                topologyOf[x] = topologyOf[representatives[x]];
+            multiplicities[topologyOf[x]]++;
+        }
+        TreeSearch search(topologies, rand() % 3, 2, QDistOptions(), multiplicities);
+
+        const unsigned query = rand() % numTrees;
+        const int k = 1 + rand() % 8;
+        std::vector<std::pair<long, int> > nearest = search.NearestNeighbours(trees[query], k);
+        std::vector<long> found;
+        for(unsigned i = 0; i < nearest.size(); ++i)
+            found.insert(found.end(), multiplicities[nearest[i].second], nearest[i].first);
+        std::sort(found.begin(), found.end());
+        found.resize(std::min<unsigned>(k, found.size()));
+        std::vector<long> expected(distances[query]);
+        std::sort(expected.begin(), expected.end());
+        expected.resize(std::min<unsigned>(k, numTrees));
+        ok = ok && found == expected;
+
+        std::vector<long> sums(numTrees, 0);
+        for(unsigned x = 0; x < numTrees; ++x)
+            for(unsigned y = 0; y < numTrees; ++y)
+                sums[x] += distances[x][y];
+        std::pair<int, long> medoid = search.Medoid();
+        ok = ok && medoid.second == *std::min_element(sums.begin(), sums.end())
+            && medoid.second == sums[topologyTrees[medoid.first]];
+
+        //a batch of all pairs, each line with the distance of its pair
+        QDistBatch batch(2, QDistBatch::TSV_FORMAT);
+        batch.LoadTreeCollection(filename);
+        std::ostringstream manifest;
+        for(unsigned x = 0; x < numTrees; ++x)
+            for(unsigned y = 0; y < numTrees; ++y)
+                manifest << x << ' ' << y << std::endl;
+        std::istringstream in(manifest.str());
+        std::ostringstream results;
+        batch.Run(in, results);
+
+        std::istringstream lines(results.str());
+        std::string line;
+        std::getline(lines, line);
+        for(unsigned x = 0; x < numTrees && ok; ++x)
+            for(unsigned y = 0; y < numTrees && ok; ++y)
+            {
+                ok = (bool)std::getline(lines, line);
+                std::istringstream fields(line);
+                std::string name1, name2, normB;
+                long leaves, b1, b2, shared, diff, qdist;
+                ok = ok && (fields >> name1 >> name2 >> leaves >> b1 >> b2 >> shared >> diff >> normB >> qdist)
+                    && name1 == toString(x) && name2 == toString(y)
+                    && b1 == NumButterflies(trees[x]) && b2 == NumButterflies(trees[y])
+                    && qdist == distances[x][y];
+            }
+
+        if(!ok)
+        {
+            std::cout << "Topology hash test failed in round " << round << std::endl;
+            std::cout << results.str();
+            exit(-1);
+        }
+
+        for(unsigned t = 0; t < numTrees; ++t)
+            TreeUtil::DeleteTree(trees[t]);
+    }
+    unlink(filename.c_str());
+}
+
+
+
+/*
+ * Every tree of a sketch index must find itself, or a tree with the same splits, first.
+ */
+void testSketchIndex(NewickParser* parser, unsigned rounds)
+{
+    for(unsigned round = 0; round < rounds; ++round)
+    {
+        const unsigned n = 6 + rand() % 10;
+        const unsigned numTrees = 1 + rand() % 30;
+
+        std::vector<std::string> labels;
+        for(unsigned i = 0; i < n; ++i)
+            labels.push_back("L" + toString(i));
+
+        SketchIndex index;
+        std::vector<std::string> newicks;
+        for(unsigned t = 0; t < numTrees; ++t)
+        {
+            newicks.push_back(randomNewick(labels, 2 + rand() % 3));
+            Tree* tree = parser->Parse(newicks.back());
+            index.Add(tree);
+            TreeUtil::DeleteTree(tree);
+        }
+
+        for(unsigned t = 0; t < numTrees; ++t)
+        {
+            Tree* query = parser->Parse(newicks[t]);
+            std::vector<int> candidates = index.Candidates(query);
+
+            if(std::find(candidates.begin(), candidates.end(), (int)t) == candidates.end() ||
+               index.Similarity(query, t) != 1.0 || index.Similarity(query, candidates[0]) != 1.0)
+            {
+                std::cout << "Sketch index test failed for " << newicks[t] << std::endl;
+                exit(-1);
+            }
+            TreeUtil::DeleteTree(query);
+        }
+    }
+}
+
+
+
+/*
+ * Parse a file of random trees on one and on several threads, and check that the trees come
+ * out the same and in file order.
+ */
+void testParallelParsing(NewickParser* parser, unsigned numTrees)
+{
+    const std::string filename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".trees";
+
+    std::vector<std::string> labels;
+    for(unsigned i = 0; i < 12; ++i)
+        labels.push_back("L" + toString(i));
+
+    std::vector<std::string> newicks;
+    std::ofstream out(filename.c_str());
+    for(unsigned t = 0; t < numTrees; ++t)
+    {
+        newicks.push_back(randomNewick(labels, 2 + rand() % 3));
+        out << newicks.back() << std::endl;
+    }
+    out.close();
+
+    std::vector<Tree*> serial = QDistBatch::ParseTreeCollection(filename, 1);
+    std::vector<Tree*> parallel = QDistBatch::ParseTreeCollection(filename, 4);
+    unlink(filename.c_str());
+
+    bool fail = serial.size() != numTrees || parallel.size() != numTrees;
+    for(unsigned t = 0; t < numTrees && !fail; ++t)
+    {
+        Tree* tree = parser->Parse(newicks[t]);
+        TreeUtil::RenumberTreeCanonically(tree);
+        fail = TreeUtil::Fingerprint(serial[t]) != TreeUtil::Fingerprint(tree)
+            || TreeUtil::Fingerprint(parallel[t]) != TreeUtil::Fingerprint(tree);
+        TreeUtil::DeleteTree(tree);
+    }
+
+    if(fail)
+    {
+        std::cout << "Trees parsed on several threads are wrong." << std::endl;
+        exit(-1);
+    }
+
+    for(unsigned t = 0; t < numTrees; ++t)
+    {
+        TreeUtil::DeleteTree(serial[t]);
+        TreeUtil::DeleteTree(parallel[t]);
+    }
+}
+
+
+
+/*
+ * Pass numbers through a small BoundedQueue between two threads, and compare a tree with a
+ * file of random trees in the pipeline of QDistBatch::RunAgainst, checking each line against
+ * SubCubicQDist.
+ */
+void testPipeline(NewickParser* parser, unsigned numTrees)
+{
+    BoundedQueue<long> queue(3);
+    long item;
+    bool fail = queue.TryPop(item);
+    std::thread producer([&]() {
+        for(long i = 0; i < 10000; i++)
+            queue.Push(i);
+    });
+    for(long i = 0; i < 10000 && !fail; i++)
+        fail = queue.Pop() != i;
+    producer.join();
+
+    if(fail || queue.TryPop(item) || !queue.TryPush(1) || !queue.TryPush(2) || !queue.TryPush(3)
+       || queue.TryPush(4))
+    {
+        std::cout << "Items through a BoundedQueue are wrong." << std::endl;
+        exit(-1);
+    }
+
+    const std::string treeFilename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".tree";
+    const std::string collectionFilename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".trees";
+
+    std::vector<std::string> labels;
+    for(unsigned i = 0; i < 12; ++i)
+        labels.push_back("L" + toString(i));
+    const std::string reference = randomNewick(labels, 4);
+    std::ofstream(treeFilename.c_str()) << reference << std::endl;
+
+    std::vector<std::string> newicks;
+    std::ofstream out(collectionFilename.c_str());
+    for(unsigned t = 0; t < numTrees; ++t)
+    {
+        newicks.push_back(randomNewick(labels, 2 + rand() % 3));
+        out << newicks.back() << std::endl;
+    }
+    // and one more with a leaf less
+    out << randomNewick(std::vector<std::string>(labels.begin() + 1, labels.end()), 3) << std::endl;
+    out.close();
+
+    QDistBatch batch(3, QDistBatch::TSV_FORMAT);
+    std::ostringstream results;
+    batch.RunAgainst(treeFilename, collectionFilename, results);
+    unlink(treeFilename.c_str());
+    unlink(collectionFilename.c_str());
+
+    Tree* tree1 = parser->Parse(reference);
+    std::istringstream lines(results.str());
+    std::string line;
+    std::getline(lines, line);
+    fail = line.compare(0, 6, "tree1\t") != 0;
+    for(unsigned t = 0; t <= numTrees && !fail; ++t)
+    {
+        std::vector<std::string> columns;
+        fail = !std::getline(lines, line);
+        std::istringstream fields(line);
+        std::string column;
+        while(std::getline(fields, column, '\t'))
+            columns.push_back(column);
+        fail = fail || columns.size() != 10 || columns[0] != treeFilename || columns[1] != toString(t);
+        if(fail || t == numTrees)
+        {
+            fail = fail || columns[2] != "NA";
+            continue;
+        }
+
+        Tree* tree2 = parser->Parse(newicks[t]);
+        TreeUtil::RenumberTreeAccordingToOther(tree2, tree1);
+        long b1, b2, shared, diff;
+        long result = SubCubicQDist(tree1, tree2, b1, b2, shared, diff);
+        fail = columns[3] != toString(b1) || columns[4] != toString(b2) || columns[5] != toString(shared)
+            || columns[6] != toString(diff) || columns[8] != toString(result);
+        TreeUtil::DeleteTree(tree2);
+    }
+    TreeUtil::DeleteTree(tree1);
+
+    if(fail || std::getline(lines, line))
+    {
+        std::cout << "Pipelined comparisons against a tree are wrong." << std::endl;
+        std::cout << results.str();
+        exit(-1);
+    }
+}
+
+
+
+/*
+ * Write random trees as a NEXUS file, with a TRANSLATE table in shuffled order, comments and
+ * branch lengths, and read it back in chunks of several sizes. Each tree must come out as
+ * NewickParser parses its newick.
+ */
+void testNexus(NewickParser* parser, unsigned numTrees)
+{
+    const std::string filename = std::string(P_tmpdir) + "/testQDist-" + toString(getpid()) + ".nex";
+    const unsigned n = 12;
+
+    std::vector<std::string> labels;
+    for(unsigned i = 0; i < n; ++i)
+        labels.push_back("L" + toString(i));
+    std::vector<unsigned> tokens(n);
+    for(unsigned i = 0; i < n; ++i)
+        tokens[i] = i + 1;
+    std::random_shuffle(tokens.begin(), tokens.end());
+
+    std::ofstream out(filename.c_str());
+    out << "#NEXUS\n[written by; testQDist (with parentheses)]\nBEGIN TAXA;\n  DIMENSIONS NTAX=" << n << ";\nEND;\n";
+    out << "begin trees;\n  translate\n";
+    for(unsigned i = 0; i < n; ++i)
+        out << "    " << tokens[i] << (i == 3 ? " 'L" : " L") << i << (i == 3 ? "'" : "") << (i + 1 < n ? ",\n" : "\n");
+    out << "  ;\n";
+
+    std::vector<std::string> newicks;
+    for(unsigned t = 0; t < numTrees; ++t)
+    {
+        newicks.push_back(randomNewick(labels, 2 + rand() % 3));
+
+        //the labels as their tokens, and every node with metadata and a length
+        std::string description;
+        const std::string &newick = newicks.back();
+        for(std::string::size_type i = 0; i < newick.size(); ++i)
+        {
+            if(newick[i] == 'L')
+            {
+                std::string::size_type end = newick.find_first_of(",)", i);
+                description += toString(tokens[atoi(newick.substr(i + 1, end - i - 1).c_str())]);
+                i = end - 1;
+            }
+            else
+                description += newick[i];
+            if(newick[i] != '(' && newick[i] != ',' && newick[i] != ';' && (i + 1 == newick.size() || newick[i + 1] != 'L'))
+                description += "[&rate=0.5,set={1,2},note=\"a;b(c)\"]:0.0" + toString(t % 10);
+        }
+        out << "  tree STATE_" << t << " = [&R] " << description << "\n";
+    }
+    out << "end;\n";
+    out.close();
+
+    const size_t chunkSizes[] = {1, 7, 1 << 18};
+    for(unsigned c = 0; c < 3; c++)
+    {
+        TreeReader reader(filename, chunkSizes[c]);
+        std::string description;
+        unsigned t = 0;
+        for(; reader.Next(description); ++t)
+        {
+            Tree* tree = reader.Parse(description, *parser);
+            Tree* expected = t < numTrees ? parser->Parse(newicks[t]) : NULL;
+            bool fail = expected == NULL || !reader.IsNexus();
+            if(!fail)
+            {
+                TreeUtil::RenumberTreeAccordingToOther(expected, tree);
+                fail = !TreeUtil::HaveSameLeaves(tree, expected)
+                    || TreeUtil::Fingerprint(tree) != TreeUtil::Fingerprint(expected);
+            }
+            if(fail)
+            {
+                std::cout << "NEXUS tree " << t << " read in chunks of " << chunkSizes[c] << " bytes is wrong: "
+                          << description << std::endl;
+                exit(-1);
+            }
+            TreeUtil::DeleteTree(tree);
+            TreeUtil::DeleteTree(expected);
+        }
+        if(t != numTrees)
+        {
+            std::cout << "Read " << t << " of " << numTrees << " NEXUS trees." << std::endl;
+            exit(-1);
+        }
+    }
+    unlink(filename.c_str());
 }
 
 
@@ -62,6 +1448,11 @@ int main(int argc, char** argv) {
     const std::string FILE_SUFFIX = ".tree";
     const unsigned N_FILES = 5;
 
+    const unsigned RANDOM_ROUNDS = 2000;
+    const int DEEP_TREE_LEAVES = 200000;
+    const unsigned SEARCH_ROUNDS = 100;
+    const unsigned PARSE_TREES = 500;
+
     NewickParser* parser = new NewickParser();
 
     for(unsigned i = 1; i <= N_FILES; ++i)
@@ -81,9 +1472,28 @@ int main(int argc, char** argv) {
             TreeUtil::CheckTree(tree1);
             TreeUtil::CheckTree(tree2);
 
-            testTrees(tree1, tree2);
+            testTrees(tree1, tree2, filename1 + " vs " + filename2);
         }
     }
 
+    std::vector<std::string> filenames;
+    for(unsigned i = 1; i <= N_FILES; ++i)
+        filenames.push_back(FILE_PREFIX + toString(i) + FILE_SUFFIX);
+    testBatch(filenames, parser);
+    testCheckpoint(filenames, parser);
+    testTreeReader(filenames);
+
+    testDeepTree(DEEP_TREE_LEAVES);
+
+    srand(42);
+    testRandomTrees(parser, RANDOM_ROUNDS);
+    testBreakdownRooting(parser, SEARCH_ROUNDS);
+    testTreeSearch(parser, SEARCH_ROUNDS);
+    testTopologyHash(parser, SEARCH_ROUNDS);
+    testSketchIndex(parser, SEARCH_ROUNDS);
+    testParallelParsing(parser, PARSE_TREES);
+    testPipeline(parser, SEARCH_ROUNDS);
+    testNexus(parser, SEARCH_ROUNDS);
+
 	return 0;
 }